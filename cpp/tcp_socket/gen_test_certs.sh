@@ -0,0 +1,7 @@
+#!/bin/bash
+
+# Self-signed certificate to run TcpApplication with TLS over loopback. Then set in AddressTest_config.json:
+#   "tls_certificate": "test_cert.pem", "tls_private_key": "test_key.pem", "tls_ca": "test_cert.pem"
+openssl req -x509 -newkey rsa:2048 -nodes -days 365 -subj "/CN=localhost" \
+    -addext "subjectAltName=IP:127.0.0.1,DNS:localhost" \
+    -keyout test_key.pem -out test_cert.pem
@@ -8,8 +8,13 @@
 #include "logger.hpp"
 #include "server.hpp"
 #include "client.hpp"
+#include "supervisor.hpp"
+#include "process_stats.hpp"
+#include "crc32c.hpp"
 
 #include <map>
+#include <deque>
+#include <atomic>
 
 using namespace tcp;
 
@@ -20,6 +25,30 @@ typedef struct
     uint16_t client_port;
     uint16_t clients_number;
     tcp::LogLevel logLevel;
+    uint16_t benchmark_seconds;
+    uint32_t zerocopy_threshold;
+    tcp::TlsConfig tls;
+    tcp::CompressionConfig compression;
+    uint32_t benchmark_payload_bytes;
+    uint32_t client_connect_rate;
+    bool restart_clients;
+    uint32_t client_max_reconnect_attempts;
+    tcp::RateLimit connection_rate_limit;
+    tcp::RateLimit source_rate_limit;
+    tcp::AdmissionLimits admission;
+    std::string capture_file;
+    uint32_t trace_sample_every;
+    std::string trace_file;
+    uint32_t soak_seconds;
+    double soak_connect_rate;
+    uint32_t soak_sample_seconds;
+    uint32_t io_threads;
+    bool chunking;
+    tcp::ResponseCacheConfig response_cache;
+    tcp::InboundCredits inbound_credits;
+    bool timestamping;
+    bool integrity;
+    std::string handoff_path;
 } EnvConfig;
 
 static EnvConfig configurations = 
@@ -29,7 +58,31 @@ static EnvConfig configurations =
     31490,
     31400,
     1,
-    tcp::LogLevel::DEBUG
+    tcp::LogLevel::DEBUG,
+    10,
+    64 * 1024,
+    {},
+    {},
+    0,
+    0,
+    false,
+    0,
+    {},
+    {},
+    {},
+    "",
+    0,
+    "trace.json",
+    3600,
+    20,
+    10,
+    0,
+    false,
+    {},
+    {},
+    false,
+    false,
+    ""
 };
 
 static const std::map<std::string, tcp::LogLevel> logLevelMap = 
@@ -59,6 +112,45 @@ static void loadConfigurations()
         configurations.clients_number = root.get<uint16_t>("clients_number");
         logLevel = root.get<std::string>("log_level");
         configurations.logLevel = logLevelMap.at(logLevel);
+        configurations.benchmark_seconds = root.get<uint16_t>("benchmark_seconds", configurations.benchmark_seconds);
+        configurations.zerocopy_threshold = root.get<uint32_t>("zerocopy_threshold", configurations.zerocopy_threshold);
+        configurations.tls.certificate_file = root.get<std::string>("tls_certificate", "");
+        configurations.tls.private_key_file = root.get<std::string>("tls_private_key", "");
+        configurations.tls.ca_file = root.get<std::string>("tls_ca", "");
+        configurations.tls.server_name = root.get<std::string>("tls_server_name", "");
+        configurations.tls.ktls = root.get<bool>("tls_ktls", true);
+        configurations.tls.enabled = !configurations.tls.certificate_file.empty();
+        configurations.compression.codec = tcp::getCodec(root.get<std::string>("compression", "none"));
+        configurations.compression.threshold = root.get<size_t>("compression_threshold", configurations.compression.threshold);
+        configurations.compression.level = root.get<int>("compression_level", configurations.compression.level);
+        configurations.compression.dictionary_file = root.get<std::string>("compression_dictionary", "");
+        configurations.benchmark_payload_bytes = root.get<uint32_t>("benchmark_payload_bytes", configurations.benchmark_payload_bytes);
+        configurations.client_connect_rate = root.get<uint32_t>("client_connect_rate", configurations.client_connect_rate);
+        configurations.restart_clients = root.get<bool>("restart_clients", configurations.restart_clients);
+        configurations.client_max_reconnect_attempts = root.get<uint32_t>("client_max_reconnect_attempts", configurations.client_max_reconnect_attempts);
+        configurations.connection_rate_limit.messages_per_second = root.get<double>("rate_limit_messages", 0);
+        configurations.connection_rate_limit.bytes_per_second = root.get<double>("rate_limit_bytes", 0);
+        configurations.source_rate_limit.messages_per_second = root.get<double>("source_rate_limit_messages", 0);
+        configurations.source_rate_limit.bytes_per_second = root.get<double>("source_rate_limit_bytes", 0);
+        configurations.admission.max_connections = root.get<size_t>("max_connections", 0);
+        configurations.admission.max_pending_messages = root.get<size_t>("max_pending_messages", 0);
+        configurations.admission.max_buffered_bytes = root.get<size_t>("max_buffered_bytes", 0);
+        configurations.admission.policy = tcp::getOverloadPolicy(root.get<std::string>("overload_policy", "reject"));
+        configurations.capture_file = root.get<std::string>("capture_file", "");
+        configurations.trace_sample_every = root.get<uint32_t>("trace_sample_every", configurations.trace_sample_every);
+        configurations.trace_file = root.get<std::string>("trace_file", configurations.trace_file);
+        configurations.soak_seconds = root.get<uint32_t>("soak_seconds", configurations.soak_seconds);
+        configurations.soak_connect_rate = root.get<double>("soak_connect_rate", configurations.soak_connect_rate);
+        configurations.soak_sample_seconds = root.get<uint32_t>("soak_sample_seconds", configurations.soak_sample_seconds);
+        configurations.io_threads = root.get<uint32_t>("io_threads", configurations.io_threads);
+        configurations.chunking = root.get<bool>("chunking", configurations.chunking);
+        configurations.response_cache.max_bytes = root.get<size_t>("response_cache_bytes", 0);
+        configurations.response_cache.ttl = std::chrono::milliseconds(root.get<uint32_t>("response_cache_ttl_ms", 1000));
+        configurations.inbound_credits.max_messages = root.get<size_t>("inbound_max_messages", 0);
+        configurations.inbound_credits.max_bytes = root.get<size_t>("inbound_max_bytes", 0);
+        configurations.timestamping = root.get<bool>("timestamping", configurations.timestamping);
+        configurations.integrity = root.get<bool>("integrity", configurations.integrity);
+        configurations.handoff_path = root.get<std::string>("handoff_path", "");
 
     }
     catch(const std::exception& e)
@@ -70,7 +162,42 @@ static void loadConfigurations()
                        << ", server_port: " << configurations.server_port 
                        << ", client_port: " << configurations.client_port
                        << ", clients_number: " << configurations.clients_number
-                       << ", logLevel: " << logLevel;
+                       << ", logLevel: " << logLevel
+                       << ", benchmark_seconds: " << configurations.benchmark_seconds
+                       << ", zerocopy_threshold: " << configurations.zerocopy_threshold
+                       << ", tls: " << (configurations.tls.enabled ? configurations.tls.certificate_file : "off")
+                       << ", compression: " << tcp::toString(configurations.compression.codec)
+                       << ", benchmark_payload_bytes: " << configurations.benchmark_payload_bytes
+                       << ", client_connect_rate: " << configurations.client_connect_rate
+                       << ", restart_clients: " << std::boolalpha << configurations.restart_clients
+                       << ", client_max_reconnect_attempts: " << configurations.client_max_reconnect_attempts
+                       << ", rate_limit: " << configurations.connection_rate_limit.messages_per_second << " msg/s "
+                       << configurations.connection_rate_limit.bytes_per_second << " B/s"
+                       << ", source_rate_limit: " << configurations.source_rate_limit.messages_per_second << " msg/s "
+                       << configurations.source_rate_limit.bytes_per_second << " B/s"
+                       << ", max_connections: " << configurations.admission.max_connections
+                       << ", max_pending_messages: " << configurations.admission.max_pending_messages
+                       << ", max_buffered_bytes: " << configurations.admission.max_buffered_bytes
+                       << ", overload_policy: " << tcp::toString(configurations.admission.policy)
+                       << ", capture_file: " << (configurations.capture_file.empty() ? "off" : configurations.capture_file)
+                       << ", trace_sample_every: " << configurations.trace_sample_every
+                       << ", soak_seconds: " << configurations.soak_seconds
+                       << ", soak_connect_rate: " << configurations.soak_connect_rate
+                       << ", io_threads: " << configurations.io_threads
+                       << ", chunking: " << configurations.chunking
+                       << ", response_cache_bytes: " << configurations.response_cache.max_bytes
+                       << ", response_cache_ttl_ms: " << configurations.response_cache.ttl.count()
+                       << ", inbound_max_messages: " << configurations.inbound_credits.max_messages
+                       << ", inbound_max_bytes: " << configurations.inbound_credits.max_bytes
+                       << ", timestamping: " << configurations.timestamping
+                       << ", integrity: " << configurations.integrity
+                       << ", handoff_path: " << (configurations.handoff_path.empty() ? "off" : configurations.handoff_path);
+
+    if(!tcp::isAvailable(configurations.compression.codec))
+    {
+        LOG_WARNING << function_id << " " << tcp::toString(configurations.compression.codec) << " support is not compiled in, compression disabled";
+        configurations.compression.codec = tcp::Codec::None;
+    }
 
 }
 
@@ -78,17 +205,41 @@ enum class TestMode : uint8_t
 {
     All,
     Server,
-    Client
+    Client,
+    Benchmark,
+    Soak,
+    Checksum
 };
 
 static const std::map<std::string, TestMode> testModeMap = 
 {
     {"-s", TestMode::Server},
-    {"-c", TestMode::Client}
+    {"-c", TestMode::Client},
+    {"-b", TestMode::Benchmark},
+    {"-k", TestMode::Soak},
+    {"-i", TestMode::Checksum}
 };
 
 static TestMode testMode = TestMode::All;
 
+// the server does not ask clients for certificates, tls_ca is only used by clients to verify the server
+static tcp::TlsConfig getServerTlsConfig()
+{
+    tcp::TlsConfig serverTls = configurations.tls;
+    serverTls.ca_file.clear();
+    return serverTls;
+}
+
+static tcp::TlsConfig getClientTlsConfig()
+{
+    tcp::TlsConfig clientTls;
+    clientTls.enabled = configurations.tls.enabled;
+    clientTls.ca_file = configurations.tls.ca_file;
+    clientTls.server_name = configurations.tls.server_name;
+    clientTls.ktls = configurations.tls.ktls;
+    return clientTls;
+}
+
 static void setTestMode(int argc, char *argv[])
 {
     std::string function_id = getFunctionId(__func__);
@@ -101,9 +252,11 @@ static void setTestMode(int argc, char *argv[])
         {
             testMode = testModeMap.at(_argv);
             LOG_DEBUG << function_id 
-                      << ((testMode == TestMode::Server) ?
-                         " Setting test mode to run only the Server" 
-                         : " Setting test mode to run only the Clients");
+                      << ((testMode == TestMode::Server) ? " Setting test mode to run only the Server" 
+                         : (testMode == TestMode::Client) ? " Setting test mode to run only the Clients"
+                         : (testMode == TestMode::Soak) ? " Setting test mode to run the connection churn Soak test"
+                         : (testMode == TestMode::Checksum) ? " Setting test mode to run the Checksum throughput benchmark"
+                         : " Setting test mode to run the ping-pong Benchmark");
         }
         else
         {
@@ -112,6 +265,522 @@ static void setTestMode(int argc, char *argv[])
     }
 }
 
+// nullptr when capturing is off or the file can not be created (the server then runs without it)
+static std::shared_ptr<CaptureWriter> makeCapture()
+{
+    std::string function_id = getFunctionId(__func__);
+    if(configurations.capture_file.empty()) return nullptr;
+
+    try
+    {
+        LOG_DEBUG << function_id << " Capturing inbound traffic to " << configurations.capture_file;
+        return std::make_shared<CaptureWriter>(configurations.capture_file);
+    }
+    catch(const std::exception& e)
+    {
+        LOG_ERROR << function_id << " " << e.what();
+        return nullptr;
+    }
+}
+
+static void printCaptureStats(const std::shared_ptr<CaptureWriter>& capture)
+{
+    if(!capture) return;
+    std::cout << "Capture [" << configurations.capture_file << "] recorded: " << capture->getRecorded()
+              << ", dropped: " << capture->getDropped() << std::endl;
+}
+
+static void exportTrace()
+{
+    std::string function_id = getFunctionId(__func__);
+    if(!Tracer::enabled()) return;
+
+    if(!Tracer::exportChromeTrace(configurations.trace_file))
+    {
+        LOG_ERROR << function_id << " Cannot write " << configurations.trace_file;
+        return;
+    }
+    std::cout << "Trace [" << configurations.trace_file << "] written, dropped stamps: " << Tracer::getDropped() << std::endl;
+}
+
+// Starts every client at once, they connect concurrently (paced by client_connect_rate when set),
+// then waits until they are all connected or the warm-up time is over. Returns the connected count.
+static size_t startClients(std::vector<std::unique_ptr<ClientBase>>& clients)
+{
+    std::string function_id = getFunctionId(__func__);
+
+    auto startTime = std::chrono::steady_clock::now();
+    auto warmUp = std::chrono::seconds(2);
+
+    std::shared_ptr<TokenBucket> connectLimiter;
+    if(configurations.client_connect_rate > 0)
+    {
+        connectLimiter = std::make_shared<TokenBucket>(configurations.client_connect_rate, 1);
+        warmUp += std::chrono::seconds(clients.size() / configurations.client_connect_rate);
+    }
+
+    for(auto& client : clients)
+    {
+        client->setConnectRateLimiter(connectLimiter);
+        LOG_DEBUG << function_id <<  " Launching Client " << (uint16_t)(client->getId()) << " thread";
+        client->start();
+    }
+
+    auto warmUpDeadline = startTime + warmUp;
+    size_t connectedClients = 0;
+    for(auto& client : clients)
+    {
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(warmUpDeadline - std::chrono::steady_clock::now());
+        connectedClients += client->waitUntilConnected(std::max(remaining, std::chrono::milliseconds(0))) ? 1 : 0;
+    }
+
+    LOG_DEBUG << function_id <<  " Clients connected: " << connectedClients << "/" << clients.size() << " in "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - startTime).count() << "ms";
+    return connectedClients;
+}
+
+// hot restart, new process: a server already running with the same handoff_path passes its sockets over
+static void takeOver(ServerBase& server)
+{
+    std::string function_id = getFunctionId(__func__);
+
+    HandoffState state;
+    try
+    {
+        if(!requestHandoff(configurations.handoff_path, state))
+        {
+            LOG_DEBUG << function_id << " No server to take over from at " << configurations.handoff_path;
+            return;
+        }
+    }
+    catch(const std::exception& e)
+    {
+        LOG_ERROR << function_id << " Hot restart failed, starting on our own: " << e.what();
+        return;
+    }
+
+    LOG_WARNING << function_id << " Taking over " << ((state.listener_fd >= 0) ? "the listening socket and " : "")
+                << state.connections.size() << " connections";
+    server.adopt(std::move(state));
+}
+
+// hot restart, old process: once a successor connects it gets the sockets, then main shuts down as on CTRL + C
+static std::unique_ptr<HandoffListener> listenForSuccessor(ServerBase& server, Supervisor& supervisor)
+{
+    std::string function_id = getFunctionId(__func__);
+
+    try
+    {
+        return std::make_unique<HandoffListener>(configurations.handoff_path, [&server, &supervisor](int successor_fd)
+            {
+                std::string function_id = getFunctionId("listenForSuccessor");
+
+                HandoffState state = server.handOff(std::chrono::seconds(5));
+                try
+                {
+                    sendHandoff(successor_fd, state);
+                    LOG_WARNING << function_id << " Handed off " << state.connections.size() << " connections, exiting";
+                }
+                catch(const std::exception& e)
+                {
+                    LOG_ERROR << function_id << " Hot restart failed: " << e.what();
+                }
+                state.close();
+                supervisor.stop();
+            });
+    }
+    catch(const std::exception& e)
+    {
+        LOG_ERROR << function_id << " No hot restart: " << e.what();
+        return nullptr;
+    }
+}
+
+// ############# BENCHMARK #############
+
+// repetitive records, roughly what real traffic looks like to a compressor
+static Payload makeBenchmarkPayload(uint32_t bytes)
+{
+    std::string text;
+    for(uint32_t i = 0; text.size() < bytes; ++i)
+    {
+        text += "{\"id\":" + std::to_string(i) + ",\"symbol\":\"TCP\",\"side\":\"buy\",\"price\":101.25,\"qty\":100}\n";
+    }
+    return Payload(text.begin(), text.begin() + bytes);
+}
+
+static void printCompressionStats(const std::string& name, const CompressionStats& stats)
+{
+    std::cout << "Compression [" << name << "] ratio: " << stats.ratio()
+              << ", compressed: " << stats.compressed_messages
+              << ", skipped: " << stats.skipped_messages
+              << ", decompressed: " << stats.decompressed_messages
+              << ", compress cpu(ms): " << std::chrono::duration<double, std::milli>(stats.compress_cpu_time).count()
+              << ", decompress cpu(ms): " << std::chrono::duration<double, std::milli>(stats.decompress_cpu_time).count()
+              << std::endl;
+}
+
+static void printLatency(const std::string& name, const LatencySummary& latency)
+{
+    auto us = [](std::chrono::nanoseconds ns){ return std::chrono::duration<double, std::micro>(ns).count(); };
+    std::cout << "  " << name << ": count: " << latency.count
+              << ", mean(us): " << us(latency.mean)
+              << ", p50(us): " << us(latency.p50)
+              << ", p99(us): " << us(latency.p99)
+              << ", max(us): " << us(latency.max) << std::endl;
+}
+
+// kernel-to-handler is our own reading and queueing, send-to-wire the socket buffer and qdisc after us
+static void printTimestampStats(const std::string& name, const TimestampStats& stats)
+{
+    std::cout << "Kernel timestamps [" << name << "]" << std::endl;
+    printLatency("kernel to handler", stats.kernel_to_handler);
+    printLatency("send to wire", stats.send_to_wire);
+}
+
+static void printIntegrityStats(const std::string& name, const IntegrityStats& stats)
+{
+    std::cout << "Integrity [" << name << "] verified frames: " << stats.verified_frames
+              << ", failed frames: " << stats.failed_frames << std::endl;
+}
+
+// Every client echoes back whatever the server echoes back, so the counter measures full round trips
+// sends every message back to the client it came from
+struct EchoHandler
+{
+    ServerBase* server;
+
+    void operator()(uint16_t clientPort, std::unique_ptr<Payload> rxBuffer_) const
+    {
+        size_t bytes = rxBuffer_->size();
+        server->send(clientPort, std::move(rxBuffer_));
+        // done with it once the echo is out (only counts in credit mode)
+        server->acknowledge(clientPort, bytes);
+    }
+};
+
+static void runBenchmark(const std::string& ip, uint16_t server_port, uint16_t client_port, uint16_t numberOfClients)
+{
+    std::string function_id = getFunctionId(__func__);
+
+    // per-message DEBUG logs would dominate the measurement
+    Logger::setMaximumLogLevel(tcp::LogLevel::WARNING);
+
+    std::atomic<uint64_t> roundTrips(0);
+    const Payload benchmarkPayload = makeBenchmarkPayload(configurations.benchmark_payload_bytes);
+    std::shared_ptr<CaptureWriter> capture = makeCapture();
+
+    // handlers compiled in and per-message logging compiled out, nothing but the transport is measured
+    BasicServer<EchoHandler, NoLog> server(ip, server_port, EchoHandler{&server});
+    server.setZeroCopyThreshold(configurations.zerocopy_threshold);
+    server.setTls(getServerTlsConfig());
+    server.setCompression(configurations.compression);
+    server.setIntegrity(configurations.integrity);
+    server.setRateLimits(configurations.connection_rate_limit, configurations.source_rate_limit);
+    server.setAdmissionLimits(configurations.admission);
+    server.setIoThreads(configurations.io_threads);
+    server.setCapture(capture);
+    // every echo is idempotent, the clients all send the same payload
+    server.setResponseCache(configurations.response_cache);
+    server.setInboundCredits(configurations.inbound_credits);
+    server.setTimestamping(configurations.timestamping);
+    server.start();
+    if(!server.waitUntilListening(std::chrono::seconds(5)))
+    {
+        LOG_ERROR << function_id << " Server did not start listening";
+        exit(EXIT_FAILURE);
+    }
+
+    std::vector<std::unique_ptr<ClientBase>> clients;
+    auto pingPong = [&clients, &roundTrips, &benchmarkPayload](uint16_t i)
+    {
+        return [&clients, &roundTrips, &benchmarkPayload, i](std::unique_ptr<Payload> rxBuffer_)
+            {
+                ++roundTrips;
+                if(rxBuffer_->size() < benchmarkPayload.size())
+                {
+                    // the first PONG, from now on the benchmark payload goes back and forth
+                    *rxBuffer_ = benchmarkPayload;
+                }
+                clients.at(i)->send(std::move(rxBuffer_));
+            };
+    };
+    using BenchmarkClient = BasicClient<decltype(pingPong(0)), NoLog>;
+
+    for(uint16_t i = 0; i < numberOfClients; ++i)
+    {
+        clients.emplace_back(std::make_unique<BenchmarkClient>(ip, client_port + i, ip, server_port, pingPong(i)));
+        clients.back()->setTls(getClientTlsConfig());
+        clients.back()->setCompression(configurations.compression);
+        clients.back()->setChunking(configurations.chunking);
+        clients.back()->setIntegrity(configurations.integrity);
+        clients.back()->setTimestamping(configurations.timestamping);
+    }
+
+    size_t connectedClients = startClients(clients);
+    if(connectedClients < clients.size())
+    {
+        LOG_WARNING << function_id << " Only " << connectedClients << "/" << clients.size() << " clients connected";
+    }
+
+    uint64_t startRoundTrips = roundTrips;
+    auto startTime = std::chrono::steady_clock::now();
+    std::this_thread::sleep_for(std::chrono::seconds(configurations.benchmark_seconds));
+    uint64_t totalRoundTrips = roundTrips - startRoundTrips;
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+
+    std::cout << "Benchmark [" << getIoBackend() << "] address: " << ip
+              << ", clients: " << numberOfClients
+              << ", seconds: " << elapsed
+              << ", round trips: " << totalRoundTrips
+              << ", round trips/s: " << (uint64_t)(totalRoundTrips / elapsed)
+              << ", avg RTT(us): " << ((totalRoundTrips > 0) ? (elapsed * 1e6 * numberOfClients / totalRoundTrips) : 0.0)
+              << std::endl;
+
+    MemoryUsage memory = server.getMemoryUsage();
+    std::cout << "Memory: connections: " << memory.connections
+              << ", bytes/connection: " << memory.bytesPerConnection()
+              << ", io threads: " << (memory.io_threads ? std::to_string(memory.io_threads) : std::string("one per connection"))
+              << ", fds: " << memory.total.fds << std::endl;
+
+    if(configurations.connection_rate_limit.enabled() || configurations.source_rate_limit.enabled())
+    {
+        std::cout << "Throttled reads: " << server.getThrottledReads() << std::endl;
+    }
+    if(configurations.inbound_credits.enabled())
+    {
+        std::cout << "Paused reads (out of credit): " << server.getPausedReads() << std::endl;
+    }
+
+    AdmissionStats admission = server.getAdmissionStats();
+    if(admission.rejected_connections || admission.paused_accepts || admission.shed_messages)
+    {
+        std::cout << "Overload: rejected connections: " << admission.rejected_connections
+                  << ", paused accepts: " << admission.paused_accepts
+                  << ", shed messages: " << admission.shed_messages << " (" << admission.shed_bytes << " bytes)" << std::endl;
+    }
+    printCaptureStats(capture);
+
+    if(configurations.response_cache.enabled())
+    {
+        ResponseCacheStats cache = server.getResponseCacheStats();
+        std::cout << "Response cache: hits: " << cache.hits
+                  << ", misses: " << cache.misses
+                  << ", evictions: " << cache.evictions
+                  << ", expirations: " << cache.expirations
+                  << ", entries: " << cache.entries << " (" << cache.bytes << " bytes)" << std::endl;
+    }
+
+    if(configurations.timestamping)
+    {
+        printTimestampStats("server", server.getTimestampStats());
+        printTimestampStats("client_1", clients.front()->getTimestampStats());
+    }
+
+    if(configurations.integrity)
+    {
+        printIntegrityStats("server", server.getIntegrityStats());
+        printIntegrityStats("client_1", clients.front()->getIntegrityStats());
+    }
+
+    if(configurations.compression.codec != Codec::None)
+    {
+        printCompressionStats("server " + std::string(toString(configurations.compression.codec)), server.getCompressionStats());
+        printCompressionStats("client_1 " + std::string(toString(configurations.compression.codec)), clients.front()->getCompressionStats());
+    }
+
+    clients.clear();
+    server.stop();
+    exportTrace();
+}
+
+// ############# SOAK #############
+
+// true when the minimum of the last third of the samples is above the minimum of the first third by more
+// than ratio and slack: minimums, so a busy moment does not count, a leak raises the floor
+static bool grewWithoutBound(const std::vector<size_t>& samples, double ratio, size_t slack)
+{
+    size_t third = samples.size() / 3;
+    if(third == 0) return false;
+
+    size_t first = *std::min_element(samples.begin(), samples.begin() + third);
+    size_t last = *std::min_element(samples.end() - third, samples.end());
+    return last > first * (1.0 + ratio) + slack;
+}
+
+// Churns connections (connect, one echoed round trip, disconnect) against an echo server for soak_seconds,
+// keeping clients_number of them open, and samples threads, fds, RSS and heap every soak_sample_seconds.
+// Fails when one of them keeps growing. Stops early on SIGINT/SIGTERM.
+static bool runSoak(Supervisor& supervisor, const std::string& ip, uint16_t server_port, uint16_t client_port, uint16_t numberOfClients)
+{
+    std::string function_id = getFunctionId(__func__);
+
+    // hours of per-connection DEBUG logs are of no use
+    Logger::setMaximumLogLevel(tcp::LogLevel::WARNING);
+
+    Server server(ip, server_port, [&server](uint16_t clientPort, std::unique_ptr<Payload> rxBuffer_)
+    {
+        server.send(clientPort, std::move(rxBuffer_));
+    });
+    server.setZeroCopyThreshold(configurations.zerocopy_threshold);
+    server.setTls(getServerTlsConfig());
+    server.setCompression(configurations.compression);
+    server.setIntegrity(configurations.integrity);
+    server.setRateLimits(configurations.connection_rate_limit, configurations.source_rate_limit);
+    server.setAdmissionLimits(configurations.admission);
+    server.setIoThreads(configurations.io_threads);
+    server.start();
+    if(!server.waitUntilListening(std::chrono::seconds(5)))
+    {
+        LOG_ERROR << function_id << " Server did not start listening";
+        return false;
+    }
+
+    std::atomic<bool> stopChurn(false);
+    std::atomic<uint64_t> connections(0);
+    std::atomic<uint64_t> exchanges(0);
+    std::vector<ProcessStats> samples;
+    const size_t window = std::max<size_t>(numberOfClients, 1);
+    const auto tick = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double>(1.0 / std::max(configurations.soak_connect_rate, 0.001)));
+    const auto sampleInterval = std::chrono::seconds(std::max<uint32_t>(configurations.soak_sample_seconds, 1));
+
+    std::cout << "Soak [" << configurations.soak_seconds << "s] churning " << configurations.soak_connect_rate
+              << " connections/s, " << window << " open at a time, sampling every " << sampleInterval.count() << "s" << std::endl;
+
+    std::thread churn([&]()
+    {
+        std::deque<std::unique_ptr<Client>> clients;
+        auto startTime = std::chrono::steady_clock::now();
+        auto endTime = startTime + std::chrono::seconds(configurations.soak_seconds);
+        auto nextSample = startTime + sampleInterval;
+        auto nextConnect = startTime;
+
+        while(!stopChurn && std::chrono::steady_clock::now() < endTime)
+        {
+            if(clients.size() == window)
+            {
+                clients.pop_front();
+            }
+
+            // ephemeral ports on TCP, recycled ids for unix/shm clients which name their socket/segment after it
+            uint16_t port = (getTransport(ip) == Transport::Tcp) ? 0 : (uint16_t)(client_port + connections % window);
+            clients.emplace_back(std::make_unique<Client>(ip, port, ip, server_port, [&exchanges](std::unique_ptr<Payload>)
+            {
+                ++exchanges;
+            }));
+            clients.back()->setTls(getClientTlsConfig());
+            clients.back()->setCompression(configurations.compression);
+            clients.back()->setChunking(configurations.chunking);
+            clients.back()->setIntegrity(configurations.integrity);
+            clients.back()->start();
+            ++connections;
+
+            auto now = std::chrono::steady_clock::now();
+            if(now >= nextSample)
+            {
+                samples.push_back(getProcessStats());
+                const ProcessStats& stats = samples.back();
+                std::cout << "Soak [" << std::chrono::duration_cast<std::chrono::seconds>(now - startTime).count() << "s]"
+                          << " connections: " << connections << ", exchanges: " << exchanges
+                          << ", threads: " << stats.threads << ", fds: " << stats.open_fds
+                          << ", rss(KiB): " << stats.rss_bytes / 1024 << ", heap(KiB): " << stats.heap_in_use_bytes / 1024
+                          << std::endl;
+                nextSample += sampleInterval;
+            }
+
+            nextConnect += tick;
+            std::this_thread::sleep_until(nextConnect);
+        }
+
+        clients.clear();
+        supervisor.stop();
+    });
+
+    if(supervisor.run() != 0)
+    {
+        LOG_WARNING << function_id << " Interrupted, checking the samples taken so far";
+    }
+    stopChurn = true;
+    churn.join();
+    server.stop();
+
+    // the first samples still see buffers, thread stacks and arenas being created for the first time
+    if(samples.size() > 2)
+    {
+        samples.erase(samples.begin(), samples.begin() + 2);
+    }
+    if(samples.size() < 6)
+    {
+        std::cout << "Soak: only " << samples.size() << " samples after warm-up, too few to judge growth" << std::endl;
+        return true;
+    }
+
+    std::vector<size_t> threads, fds, rss, heap;
+    for(auto& sample : samples)
+    {
+        threads.push_back(sample.threads);
+        fds.push_back(sample.open_fds);
+        rss.push_back(sample.rss_bytes);
+        heap.push_back(sample.heap_in_use_bytes);
+    }
+
+    // small absolute slack, the window of open clients alone moves these around a bit
+    bool passed = true;
+    auto check = [&passed](const char* name, const std::vector<size_t>& values, double ratio, size_t slack)
+    {
+        if(grewWithoutBound(values, ratio, slack))
+        {
+            std::cout << "Soak FAILED: " << name << " keeps growing (" << values.front() << " -> " << values.back() << ")" << std::endl;
+            passed = false;
+        }
+    };
+    check("threads", threads, 0.0, window + 4);
+    check("fds", fds, 0.0, 2 * window + 8);
+    check("rss", rss, 0.10, 8 * 1024 * 1024);
+    check("heap", heap, 0.10, 8 * 1024 * 1024);
+
+    if(passed)
+    {
+        std::cout << "Soak passed: " << connections << " connections, " << exchanges << " exchanges, no resource growth" << std::endl;
+    }
+    return passed;
+}
+
+// ############# CHECKSUM #############
+
+// CRC32C throughput of the implementation picked for this CPU against the portable tables, per message size
+static void runChecksumBenchmark()
+{
+    const size_t sizes[] = {64, 256, 1024, 4 * 1024, 64 * 1024, 1024 * 1024};
+    // per size and implementation, enough for a steady clock reading
+    const size_t bytesPerRun = 1024 * 1024 * 1024;
+    const Payload data = makeBenchmarkPayload(sizes[sizeof(sizes) / sizeof(sizes[0]) - 1]);
+
+    auto measure = [&data, bytesPerRun](size_t bytes, uint32_t (*checksum)(const uint8_t*, size_t, uint32_t))
+    {
+        size_t iterations = bytesPerRun / bytes;
+        // chained, so the calls can neither overlap nor be dropped
+        uint32_t crc = 0;
+        auto startTime = std::chrono::steady_clock::now();
+        for(size_t i = 0; i < iterations; ++i)
+        {
+            crc = checksum(data.data(), bytes, crc);
+        }
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+        volatile uint32_t sink = crc;
+        (void)sink;
+        return (double)iterations * bytes / elapsed / 1e9;
+    };
+
+    for(size_t bytes : sizes)
+    {
+        std::cout << "Checksum [crc32c] bytes: " << bytes
+                  << ", " << getCrc32cImplementation() << "(GB/s): " << measure(bytes, crc32c)
+                  << ", portable(GB/s): " << measure(bytes, crc32cPortable) << std::endl;
+    }
+}
+
 // ############# MAIN #############
 
 
@@ -128,93 +797,135 @@ int main(int argc, char *argv[])
     uint16_t client_port = configurations.client_port;
     uint16_t numberOfClients = configurations.clients_number;
     Logger::setMaximumLogLevel(configurations.logLevel);
+    Tracer::enable(configurations.trace_sample_every);
+
+    if(testMode == TestMode::Benchmark)
+    {
+        runBenchmark(ip, server_port, client_port, numberOfClients);
+        return 0;
+    }
+
+    if(testMode == TestMode::Checksum)
+    {
+        runChecksumBenchmark();
+        return 0;
+    }
 
+    // before any thread is created, so SIGINT/SIGTERM only reach the supervisor; the benchmarks above never run it
+    // and keep the default signal handling
+    Supervisor supervisor;
+
+    if(testMode == TestMode::Soak)
+    {
+        return runSoak(supervisor, ip, server_port, client_port, numberOfClients) ? 0 : EXIT_FAILURE;
+    }
+
+    std::shared_ptr<CaptureWriter> capture = makeCapture();
     Server server(ip, server_port);
+    server.setZeroCopyThreshold(configurations.zerocopy_threshold);
+    server.setTls(getServerTlsConfig());
+    server.setCompression(configurations.compression);
+    server.setIntegrity(configurations.integrity);
+    server.setRateLimits(configurations.connection_rate_limit, configurations.source_rate_limit);
+    server.setAdmissionLimits(configurations.admission);
+    server.setIoThreads(configurations.io_threads);
+    server.setCapture(capture);
+    bool serverRunning = false;
+    // destroyed before the server, a hand off in progress finishes first
+    std::unique_ptr<HandoffListener> handoff;
     if(testMode != TestMode::Client)
     {
         LOG_DEBUG << function_id <<  " Launching server thread";
+        if(!configurations.handoff_path.empty())
+        {
+            takeOver(server);
+        }
+        supervisor.watch(server);
         server.start();
+        serverRunning = server.waitUntilListening(std::chrono::seconds(5));
+        if(!serverRunning)
+        {
+            LOG_ERROR << function_id << " Server did not start listening";
+        }
+        else if(!configurations.handoff_path.empty())
+        {
+            handoff = listenForSuccessor(server, supervisor);
+        }
     }
 
-    std::vector<std::unique_ptr<Client>> clients;
-    clients.clear();
+    std::vector<std::unique_ptr<ClientBase>> clients;
+    std::map<uint16_t, ClientBase*> runningClients;
     if(testMode != TestMode::Server)
     {
         for(uint16_t i = 0; i < numberOfClients; ++i)
         {
-            std::this_thread::sleep_for(std::chrono::milliseconds(100)); // some time so the server and the previouse client can init
-            
             clients.emplace_back(std::make_unique<Client>(ip, client_port + i, ip, server_port));
-            LOG_DEBUG << function_id <<  " Launching Client " << (uint16_t)(clients.at(i)->getId()) << " thread";
-            clients.at(i)->start();
+            clients.at(i)->setTls(getClientTlsConfig());
+            clients.at(i)->setCompression(configurations.compression);
+            clients.at(i)->setChunking(configurations.chunking);
+            clients.at(i)->setIntegrity(configurations.integrity);
+            ReconnectPolicy reconnectPolicy;
+            reconnectPolicy.max_attempts = configurations.client_max_reconnect_attempts;
+            clients.at(i)->setReconnectPolicy(reconnectPolicy);
+            supervisor.watch(*clients.at(i));
+            runningClients.emplace(clients.at(i)->getId(), clients.at(i).get());
         }
 
-        LOG_DEBUG << function_id <<  " Clients started: " << clients.size();
+        LOG_DEBUG << function_id <<  " Clients created: " << clients.size();
+        startClients(clients);
     }
 
-    std::this_thread::sleep_for(std::chrono::milliseconds(100)); // some time so the server and the previouse client can init
-    
-    while(true)
+    TokenBucket restartBudget(1.0, std::max<double>(numberOfClients, 1));
+    supervisor.setEventHandler([&](const SupervisorEvent& event)
     {
-        LOG_DEBUG << function_id <<  " Idle on main loop. CTRL + C to stop";
-        bool server_status = false;
-        std::stringstream statusLog;
-
-        if(testMode != TestMode::Client)
+        if(event.source == SupervisorEvent::Source::Server)
         {
-            server_status = server.status() != std::future_status::ready;
-            statusLog << function_id <<  " Child threads status: server(" 
-                    << (server_status ? "\033[1;32m RUNNING \033[0m" : "\033[1;31m STOPPED \033[0m");
+            LOG_ERROR << function_id <<  " Server \033[1;31m STOPPED \033[0m";
+            serverRunning = false;
         }
-
-        if(testMode != TestMode::Server)
+        else
         {
-            LOG_DEBUG << function_id <<  " Clients running: " << clients.size();
-            
-            for(uint16_t i = 0; i < clients.size(); )
-            {
-                bool current_client_status = clients.at(i)->status() != std::future_status::ready;
-
-                if(testMode == TestMode::All)
-                {
-                    statusLog << "), client_" << (uint16_t)clients.at(i)->getId() << "(" 
-                              << (current_client_status ? "\033[1;32m RUNNING \033[0m" : "\033[1;31m STOPPED \033[0m");
-                }
-                else
-                {
-                    if(i == 0)
-                    {
-                        statusLog << function_id << " Child threads status: client_";
-                    }
-                    else
-                    {
-                        statusLog << "), client_";
-                    }
-                    statusLog << (uint16_t)clients.at(i)->getId() << "(" << (current_client_status ? "\033[1;32m RUNNING \033[0m" : "\033[1;31m STOPPED \033[0m");
-                }
+            auto client = runningClients.find(event.id);
+            if(client == runningClients.end()) return;
 
-
-                if(!current_client_status)
-                {
-                    clients.erase(clients.begin() + i);
-                }
-                else
-                {
-                    ++i;
-                }
+            // a client that keeps failing right away (e.g. bad TLS files) eventually runs out of restarts
+            if(configurations.restart_clients && restartBudget.tryAcquire())
+            {
+                LOG_WARNING << function_id <<  " client_" << event.id << " \033[1;31m STOPPED \033[0m, restarting it";
+                client->second->start();
+                return;
             }
+
+            LOG_WARNING << function_id <<  " client_" << event.id << " \033[1;31m STOPPED \033[0m";
+            runningClients.erase(client);
         }
-        statusLog << ")";
-        LOG_DEBUG << statusLog.str();
 
-        if(!server_status && ( clients.size() == 0))
+        LOG_DEBUG << function_id <<  " Still running: server(" << (serverRunning ? "yes" : "no") << "), clients(" << runningClients.size() << ")";
+        if(!serverRunning && runningClients.empty())
         {
             LOG_DEBUG << function_id <<  " All threads are STOPPED. Will exit main loop.";
-            break;
+            supervisor.stop();
         }
+    });
 
-        std::this_thread::sleep_for(std::chrono::seconds(2));
+    if(!serverRunning && runningClients.empty())
+    {
+        LOG_DEBUG << function_id <<  " Nothing is running. Will exit main loop.";
     }
+    else
+    {
+        LOG_DEBUG << function_id <<  " Idle on main loop. CTRL + C to stop";
+        if(supervisor.run() != 0)
+        {
+            LOG_DEBUG << function_id <<  " Shutting down";
+        }
+    }
+
+    // clients first, so they do not start reconnecting to a server that goes away
+    clients.clear();
+    server.stop();
+    printCaptureStats(capture);
+    exportTrace();
 
     LOG_DEBUG << function_id <<  " MAIN end";
 
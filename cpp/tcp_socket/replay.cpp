@@ -0,0 +1,281 @@
+#include <iostream>
+#include <thread>
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <atomic>
+
+#include "logger.hpp"
+#include "client.hpp"
+#include "capture.hpp"
+
+using namespace tcp;
+
+// Replays a capture made by the server (capture_file in AddressTest_config.json) against a running server:
+//
+//     TcpReplay <capture_file> <server_ip> <server_port> [speed] [connections] [client_port] [compression]
+//
+// speed:       1 = original timing (default), 10 = ten times faster, 0 = as fast as possible
+// connections: 0 = one per captured connection (default), otherwise captured connections are spread over this many
+// client_port: first local port, 0 = ephemeral ports (default)
+// compression: none (default), lz4 or zstd, offered to the server like the clients do
+//
+// Every response counts as the answer to the oldest unanswered message of its connection, so latencies
+// are exact for request/response servers that answer every message (the default server handler does).
+// Without compression the connection is a raw stream where the server may read several messages at once
+// and answer them once: the latencies then only cover the answered ones and the rest shows as unanswered.
+
+typedef struct
+{
+    std::string capture_file;
+    std::string server_ip;
+    uint16_t server_port;
+    double speed;
+    size_t connections;
+    uint16_t client_port;
+    CompressionConfig compression;
+} ReplayConfig;
+
+// one replaying connection, sent timestamps wait here for their response
+typedef struct
+{
+    std::unique_ptr<Client> client;
+    std::mutex mutex;
+    std::deque<std::chrono::steady_clock::time_point> outstanding;
+    std::vector<uint64_t> latencies_ns;
+    std::atomic<bool> greeted;  // the answer to the PING every client sends on connect
+} ReplayConnection;
+
+static bool parseArguments(int argc, char *argv[], ReplayConfig& config)
+{
+    if(argc < 4)
+    {
+        std::cerr << "usage: " << argv[0] << " <capture_file> <server_ip> <server_port> [speed] [connections] [client_port] [compression]" << std::endl;
+        return false;
+    }
+
+    try
+    {
+        config.capture_file = argv[1];
+        config.server_ip = argv[2];
+        config.server_port = (uint16_t)std::stoul(argv[3]);
+        config.speed = (argc > 4) ? std::stod(argv[4]) : 1.0;
+        config.connections = (argc > 5) ? std::stoul(argv[5]) : 0;
+        config.client_port = (argc > 6) ? (uint16_t)std::stoul(argv[6]) : 0;
+        config.compression.codec = getCodec((argc > 7) ? argv[7] : "none");
+    }
+    catch(const std::exception& e)
+    {
+        std::cerr << "invalid argument: " << e.what() << std::endl;
+        return false;
+    }
+    if(!isAvailable(config.compression.codec))
+    {
+        std::cerr << toString(config.compression.codec) << " support is not compiled in" << std::endl;
+        return false;
+    }
+    return config.speed >= 0;
+}
+
+// captured connection ids in order of appearance, and the time span of the capture
+static std::vector<uint16_t> scanCapture(const std::string& capture_file, uint64_t& messages, uint64_t& duration_ns)
+{
+    CaptureReader reader(capture_file);
+    CaptureRecord record;
+    Payload body;
+
+    std::vector<uint16_t> ids;
+    std::map<uint16_t, bool> seen;
+    messages = 0;
+    duration_ns = 0;
+    while(reader.next(record, body))
+    {
+        if(!seen[record.connection])
+        {
+            seen[record.connection] = true;
+            ids.push_back(record.connection);
+        }
+        ++messages;
+        duration_ns = record.time;
+    }
+    return ids;
+}
+
+static uint64_t percentile(const std::vector<uint64_t>& sorted, double fraction)
+{
+    if(sorted.empty()) return 0;
+    return sorted[std::min(sorted.size() - 1, (size_t)(fraction * sorted.size()))];
+}
+
+int main(int argc, char *argv[])
+{
+    std::string function_id = getFunctionId(__func__);
+
+    ReplayConfig config;
+    if(!parseArguments(argc, argv, config))
+    {
+        return EXIT_FAILURE;
+    }
+
+    // per-message DEBUG logs would dominate the measurement
+    Logger::setMaximumLogLevel(tcp::LogLevel::WARNING);
+
+    uint64_t capturedMessages = 0;
+    uint64_t capturedDuration = 0;
+    std::vector<uint16_t> capturedIds;
+    try
+    {
+        capturedIds = scanCapture(config.capture_file, capturedMessages, capturedDuration);
+    }
+    catch(const std::exception& e)
+    {
+        LOG_ERROR << function_id << " " << e.what();
+        return EXIT_FAILURE;
+    }
+    if(capturedIds.empty())
+    {
+        LOG_ERROR << function_id << " " << config.capture_file << " holds no messages";
+        return EXIT_FAILURE;
+    }
+
+    size_t numberOfConnections = (config.connections > 0) ? config.connections : capturedIds.size();
+    std::map<uint16_t, size_t> connectionOf;
+    for(size_t i = 0; i < capturedIds.size(); ++i)
+    {
+        connectionOf[capturedIds[i]] = i % numberOfConnections;
+    }
+
+    std::cout << "Replaying " << capturedMessages << " messages from " << capturedIds.size() << " connections ("
+              << capturedDuration / 1e9 << "s) over " << numberOfConnections << " connections at "
+              << ((config.speed > 0) ? std::to_string(config.speed) + "x" : std::string("full")) << " speed" << std::endl;
+
+    std::vector<std::unique_ptr<ReplayConnection>> connections;
+    for(size_t i = 0; i < numberOfConnections; ++i)
+    {
+        connections.emplace_back(std::make_unique<ReplayConnection>());
+        ReplayConnection* connection = connections.back().get();
+        connection->greeted = false;
+
+        uint16_t clientPort = (config.client_port > 0) ? (uint16_t)(config.client_port + i) : 0;
+        connection->client = std::make_unique<Client>(config.server_ip, clientPort, config.server_ip, config.server_port,
+            [connection](std::unique_ptr<Payload>)
+            {
+                auto now = std::chrono::steady_clock::now();
+                std::lock_guard<std::mutex> lock(connection->mutex);
+                if(connection->outstanding.empty())
+                {
+                    connection->greeted = true;
+                    return;
+                }
+                connection->latencies_ns.push_back((uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(now - connection->outstanding.front()).count());
+                connection->outstanding.pop_front();
+            });
+        connection->client->setCompression(config.compression);
+        connection->client->start();
+    }
+
+    // replayed messages must not be mistaken for the answer to the connect PING
+    auto warmUpDeadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    for(auto& connection : connections)
+    {
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(warmUpDeadline - std::chrono::steady_clock::now());
+        if(!connection->client->waitUntilConnected(std::max(remaining, std::chrono::milliseconds(0))))
+        {
+            LOG_ERROR << function_id << " Could not connect to " << config.server_ip << ":" << config.server_port;
+            return EXIT_FAILURE;
+        }
+        while(!connection->greeted && std::chrono::steady_clock::now() < warmUpDeadline)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        connection->greeted = true;
+    }
+
+    CaptureReader reader(config.capture_file);
+    CaptureRecord record;
+    Payload body;
+    uint64_t sentMessages = 0;
+    uint64_t sentBytes = 0;
+    uint64_t failedMessages = 0;
+    std::chrono::nanoseconds maxLag(0);
+
+    auto startTime = std::chrono::steady_clock::now();
+    while(reader.next(record, body))
+    {
+        if(body.empty()) continue;
+
+        if(config.speed > 0)
+        {
+            auto due = startTime + std::chrono::nanoseconds((int64_t)(record.time / config.speed));
+            auto now = std::chrono::steady_clock::now();
+            if(due > now)
+            {
+                std::this_thread::sleep_until(due);
+            }
+            else
+            {
+                maxLag = std::max(maxLag, std::chrono::duration_cast<std::chrono::nanoseconds>(now - due));
+            }
+        }
+
+        ReplayConnection& connection = *connections[connectionOf[record.connection]];
+        {
+            std::lock_guard<std::mutex> lock(connection.mutex);
+            connection.outstanding.push_back(std::chrono::steady_clock::now());
+        }
+        if(connection.client->send(std::make_unique<Payload>(body)))
+        {
+            ++sentMessages;
+            sentBytes += body.size();
+        }
+        else
+        {
+            std::lock_guard<std::mutex> lock(connection.mutex);
+            connection.outstanding.pop_back();
+            ++failedMessages;
+        }
+    }
+    auto sendEndTime = std::chrono::steady_clock::now();
+
+    // give the last responses a moment
+    auto drainDeadline = sendEndTime + std::chrono::seconds(2);
+    for(auto& connection : connections)
+    {
+        while(std::chrono::steady_clock::now() < drainDeadline)
+        {
+            {
+                std::lock_guard<std::mutex> lock(connection->mutex);
+                if(connection->outstanding.empty()) break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+    std::vector<uint64_t> latencies;
+    uint64_t unanswered = 0;
+    for(auto& connection : connections)
+    {
+        connection->client.reset();
+        latencies.insert(latencies.end(), connection->latencies_ns.begin(), connection->latencies_ns.end());
+        unanswered += connection->outstanding.size();
+    }
+    std::sort(latencies.begin(), latencies.end());
+
+    double elapsed = std::chrono::duration<double>(sendEndTime - startTime).count();
+    std::cout << "Replay sent: " << sentMessages << " messages (" << sentBytes << " bytes) in " << elapsed << "s"
+              << ", messages/s: " << (uint64_t)((elapsed > 0) ? sentMessages / elapsed : 0)
+              << ", MB/s: " << ((elapsed > 0) ? sentBytes / elapsed / 1e6 : 0.0)
+              << ", failed: " << failedMessages
+              << ", max lag behind schedule(us): " << std::chrono::duration_cast<std::chrono::microseconds>(maxLag).count()
+              << std::endl;
+    std::cout << "Replay latency(us) responses: " << latencies.size()
+              << ", unanswered: " << unanswered
+              << ", p50: " << percentile(latencies, 0.50) / 1e3
+              << ", p90: " << percentile(latencies, 0.90) / 1e3
+              << ", p99: " << percentile(latencies, 0.99) / 1e3
+              << ", max: " << (latencies.empty() ? 0 : latencies.back()) / 1e3
+              << std::endl;
+
+    return 0;
+}
@@ -0,0 +1,158 @@
+#include "admission.hpp"
+
+namespace tcp
+{
+
+OverloadPolicy getOverloadPolicy(const std::string& name)
+{
+    if(name == "pause") return OverloadPolicy::PauseAccept;
+    if(name == "shed") return OverloadPolicy::Shed;
+    return OverloadPolicy::Reject;
+}
+
+const char* toString(OverloadPolicy policy)
+{
+    switch(policy)
+    {
+        case OverloadPolicy::PauseAccept: return "pause";
+        case OverloadPolicy::Shed: return "shed";
+        default: return "reject";
+    }
+}
+
+AdmissionControl::AdmissionControl(const AdmissionLimits& limits_)
+    : limits(limits_), connections(0), pending_messages(0), buffered_bytes(0), rejected_connections(0), paused_accepts(0),
+      shed_messages(0), shed_bytes(0), waiters(0), interrupted(false)
+{
+
+}
+
+const AdmissionLimits& AdmissionControl::getLimits() const
+{
+    return limits;
+}
+
+bool AdmissionControl::hasCapacity() const
+{
+    return (limits.max_pending_messages == 0 || pending_messages < limits.max_pending_messages)
+        && (limits.max_buffered_bytes == 0 || buffered_bytes < limits.max_buffered_bytes);
+}
+
+bool AdmissionControl::connectionFits() const
+{
+    return hasCapacity() && (limits.max_connections == 0 || connections < limits.max_connections);
+}
+
+bool AdmissionControl::admitConnection(size_t footprint)
+{
+    // only the accept thread admits, the check and the increment can not race with another admit
+    if(!connectionFits())
+    {
+        return false;
+    }
+    ++connections;
+    buffered_bytes += footprint;
+    return true;
+}
+
+void AdmissionControl::releaseConnection(size_t footprint)
+{
+    --connections;
+    buffered_bytes -= footprint;
+    notifyCapacity();
+}
+
+void AdmissionControl::countRejected()
+{
+    ++rejected_connections;
+}
+
+bool AdmissionControl::waitForCapacity()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    if(connectionFits()) return !interrupted;
+
+    ++paused_accepts;
+    ++waiters;
+    capacity_cv.wait(lock, [this](){ return interrupted || connectionFits(); });
+    --waiters;
+    return !interrupted;
+}
+
+void AdmissionControl::interrupt()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        interrupted = true;
+    }
+    capacity_cv.notify_all();
+}
+
+void AdmissionControl::notifyCapacity()
+{
+    // the mutex is only taken while the accept thread is paused, not on every message
+    if(waiters == 0) return;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+    }
+    capacity_cv.notify_all();
+}
+
+bool AdmissionControl::shed(size_t bytes, Priority priority)
+{
+    if(limits.policy != OverloadPolicy::Shed || priority == Priority::Control || hasCapacity())
+    {
+        return false;
+    }
+    ++shed_messages;
+    shed_bytes += bytes;
+    return true;
+}
+
+bool AdmissionControl::beginMessage(const uint8_t* data, size_t bytes)
+{
+    // the classifier runs only once there is something to shed
+    if(limits.policy == OverloadPolicy::Shed && !hasCapacity() &&
+       shed(bytes, limits.priority ? limits.priority(data, bytes) : Priority::Normal)) return false;
+
+    ++pending_messages;
+    buffered_bytes += bytes;
+    return true;
+}
+
+void AdmissionControl::finishMessage(size_t bytes)
+{
+    --pending_messages;
+    buffered_bytes -= bytes;
+    notifyCapacity();
+}
+
+bool AdmissionControl::charge(size_t bytes, Priority priority)
+{
+    if(shed(bytes, priority)) return false;
+
+    buffered_bytes += bytes;
+    return true;
+}
+
+void AdmissionControl::release(size_t bytes)
+{
+    buffered_bytes -= bytes;
+    notifyCapacity();
+}
+
+AdmissionStats AdmissionControl::getStats() const
+{
+    AdmissionStats stats;
+    stats.rejected_connections = rejected_connections;
+    stats.paused_accepts = paused_accepts;
+    stats.shed_messages = shed_messages;
+    stats.shed_bytes = shed_bytes;
+    stats.connections = connections;
+    stats.pending_messages = pending_messages;
+    stats.buffered_bytes = buffered_bytes;
+    return stats;
+}
+
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include "lanes.hpp"
+
+namespace tcp
+{
+
+// What the server does once a limit is reached
+enum class OverloadPolicy
+{
+    Reject,         // accept and close new connections at once (RST), existing ones are untouched
+    PauseAccept,    // stop accepting, new connections wait in the listen backlog until load goes down
+    Shed            // reject new connections, drop received messages and queued broadcasts while over a limit,
+                    // except Control ones
+};
+
+// "reject" (default), "pause" or "shed"
+OverloadPolicy getOverloadPolicy(const std::string& name);
+const char* toString(OverloadPolicy policy);
+
+// 0 = unlimited
+struct AdmissionLimits
+{
+    size_t max_connections = 0;
+    size_t max_pending_messages = 0;    // received messages waiting for (or in) the handler
+    size_t max_buffered_bytes = 0;      // connection buffers, messages for the handler and queued broadcasts
+    OverloadPolicy policy = OverloadPolicy::Reject;
+    // priority of a received message, only asked while shedding; nullptr = every message is Normal
+    std::function<Priority(const uint8_t* data, size_t bytes)> priority;
+};
+
+// Per connection limits of messages handed to the handler and not acknowledged yet (0 = unlimited).
+// A connection over a limit is not read from until acknowledgements bring it back under, the client
+// meanwhile sees TCP flow control. One read may overshoot by the messages it holds.
+struct InboundCredits
+{
+    size_t max_messages = 0;
+    size_t max_bytes = 0;
+
+    bool enabled() const { return max_messages > 0 || max_bytes > 0; }
+};
+
+struct AdmissionStats
+{
+    uint64_t rejected_connections = 0;
+    uint64_t paused_accepts = 0;
+    uint64_t shed_messages = 0;
+    uint64_t shed_bytes = 0;
+    // current load
+    size_t connections = 0;
+    size_t pending_messages = 0;
+    size_t buffered_bytes = 0;
+};
+
+// Thread safe load bookkeeping, the server asks it before taking on more work
+class AdmissionControl
+{
+public:
+explicit AdmissionControl(const AdmissionLimits& limits_ = AdmissionLimits());
+
+const AdmissionLimits& getLimits() const;
+// false when pending work or buffered bytes are over their limit
+bool hasCapacity() const;
+// true when one more connection (costing footprint bytes) fits, it is then counted until releaseConnection()
+bool admitConnection(size_t footprint);
+void releaseConnection(size_t footprint);
+void countRejected();
+
+// PauseAccept: blocks until a connection would be admitted, false when interrupted
+bool waitForCapacity();
+// wakes up waitForCapacity() for good (the server is stopping)
+void interrupt();
+
+// false when the message is shed, otherwise it is pending until finishMessage()
+bool beginMessage(const uint8_t* data, size_t bytes);
+void finishMessage(size_t bytes);
+// bytes queued for sending, false when they are shed
+bool charge(size_t bytes, Priority priority);
+void release(size_t bytes);
+
+AdmissionStats getStats() const;
+
+private:
+    const AdmissionLimits limits;
+
+    std::atomic<size_t> connections;
+    std::atomic<size_t> pending_messages;
+    std::atomic<size_t> buffered_bytes;
+    std::atomic<uint64_t> rejected_connections;
+    std::atomic<uint64_t> paused_accepts;
+    std::atomic<uint64_t> shed_messages;
+    std::atomic<uint64_t> shed_bytes;
+
+    std::atomic<int> waiters;
+    bool interrupted;
+    std::mutex mutex;
+    std::condition_variable capacity_cv;
+
+    bool connectionFits() const;
+    bool shed(size_t bytes, Priority priority);
+    void notifyCapacity();
+};
+
+}
@@ -0,0 +1,170 @@
+#include "capture.hpp"
+#include "logger.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace tcp
+{
+
+static const char capture_magic[4] = {'T', 'C', 'P', 'C'};
+static constexpr uint8_t capture_version = 1;
+// the writer wakes up early once this much is buffered, otherwise every flush_interval
+static constexpr size_t flush_bytes = 256 * 1024;
+static constexpr std::chrono::milliseconds flush_interval(100);
+
+static bool writeAll(int fd, const uint8_t* data, size_t bytes)
+{
+    while(bytes > 0)
+    {
+        ssize_t written = ::write(fd, data, bytes);
+        if(written < 0)
+        {
+            if(errno == EINTR) continue;
+            return false;
+        }
+        data += written;
+        bytes -= (size_t)written;
+    }
+    return true;
+}
+
+CaptureWriter::CaptureWriter(const std::string& path_, size_t max_buffered_)
+    : path(path_), max_buffered(max_buffered_), fd(-1), start(std::chrono::steady_clock::now()), stopping(false), recorded(0), dropped(0)
+{
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0)
+    {
+        throw std::runtime_error("cannot create capture file " + path + ": " + std::strerror(errno));
+    }
+
+    CaptureFileHeader header = {};
+    std::memcpy(header.magic, capture_magic, sizeof(header.magic));
+    header.version = capture_version;
+    header.start_time = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    if(!writeAll(fd, reinterpret_cast<const uint8_t*>(&header), sizeof(header)))
+    {
+        ::close(fd);
+        throw std::runtime_error("cannot write capture file " + path + ": " + std::strerror(errno));
+    }
+
+    buffer.reserve(flush_bytes * 2);
+    writer = std::thread(&CaptureWriter::run, this);
+}
+
+CaptureWriter::~CaptureWriter()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    flush_cv.notify_all();
+    writer.join();
+    ::close(fd);
+}
+
+void CaptureWriter::record(uint16_t connection, const uint8_t* data, size_t bytes)
+{
+    CaptureRecord header = {};
+    header.time = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    header.length = (uint32_t)bytes;
+    header.connection = connection;
+
+    size_t buffered;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if(buffer.size() + sizeof(header) + bytes > max_buffered)
+        {
+            ++dropped;
+            return;
+        }
+        const uint8_t* raw = reinterpret_cast<const uint8_t*>(&header);
+        buffer.insert(buffer.end(), raw, raw + sizeof(header));
+        buffer.insert(buffer.end(), data, data + bytes);
+        buffered = buffer.size();
+    }
+    ++recorded;
+
+    if(buffered >= flush_bytes)
+    {
+        flush_cv.notify_one();
+    }
+}
+
+uint64_t CaptureWriter::getRecorded() const
+{
+    return recorded;
+}
+
+uint64_t CaptureWriter::getDropped() const
+{
+    return dropped;
+}
+
+void CaptureWriter::run()
+{
+    std::string function_id = getFunctionId(__func__, "CaptureWriter");
+
+    // swapped with buffer, so record() only waits for the swap and never for the write
+    Payload writing;
+    writing.reserve(flush_bytes * 2);
+    bool failed = false;
+
+    while(true)
+    {
+        bool last;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            flush_cv.wait_for(lock, flush_interval, [this](){ return stopping || buffer.size() >= flush_bytes; });
+            buffer.swap(writing);
+            last = stopping;
+        }
+
+        if(!writing.empty() && !failed && !writeAll(fd, writing.data(), writing.size()))
+        {
+            // keep draining so record() does not fill up, the capture is incomplete anyway
+            LOG_ERROR << function_id << " Writing " << path << " failed: " << std::strerror(errno);
+            failed = true;
+        }
+        writing.clear();
+
+        if(last) break;
+    }
+}
+
+CaptureReader::CaptureReader(const std::string& path) : file(std::fopen(path.c_str(), "rb"))
+{
+    if(!file)
+    {
+        throw std::runtime_error("cannot open capture file " + path + ": " + std::strerror(errno));
+    }
+    if(std::fread(&header, sizeof(header), 1, file) != 1 || std::memcmp(header.magic, capture_magic, sizeof(header.magic)) != 0
+       || header.version != capture_version)
+    {
+        std::fclose(file);
+        throw std::runtime_error(path + " is not a capture file");
+    }
+}
+
+CaptureReader::~CaptureReader()
+{
+    std::fclose(file);
+}
+
+const CaptureFileHeader& CaptureReader::getHeader() const
+{
+    return header;
+}
+
+bool CaptureReader::next(CaptureRecord& record, Payload& body)
+{
+    if(std::fread(&record, sizeof(record), 1, file) != 1) return false;
+
+    body.resize(record.length);
+    return record.length == 0 || std::fread(body.data(), record.length, 1, file) == 1;
+}
+
+}
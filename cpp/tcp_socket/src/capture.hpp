@@ -0,0 +1,85 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "types.hpp"
+
+namespace tcp
+{
+
+// Capture file: a CaptureFileHeader, then for every inbound message a CaptureRecord followed by length body bytes.
+// Host byte order, like the rest of the wire structures.
+struct CaptureFileHeader
+{
+    char magic[4];          // "TCPC"
+    uint8_t version;
+    uint8_t reserved[3];
+    uint64_t start_time;    // wall clock of the first byte of the capture, ns since the epoch
+};
+
+static_assert(sizeof(CaptureFileHeader) == 16, "CaptureFileHeader is part of the file format");
+
+struct CaptureRecord
+{
+    uint64_t time;          // ns since the capture started
+    uint32_t length;
+    uint16_t connection;    // client port on the server
+    uint16_t reserved;
+};
+
+static_assert(sizeof(CaptureRecord) == 16, "CaptureRecord is part of the file format");
+
+// Records messages from any thread, a background thread writes them out in batches so record() never touches the disk.
+// Records that do not fit in max_buffered_ bytes (disk slower than the traffic) are dropped and counted.
+class CaptureWriter
+{
+public:
+// throws when the file can not be created
+explicit CaptureWriter(const std::string& path_, size_t max_buffered_ = 64 * 1024 * 1024);
+// writes what is still buffered
+~CaptureWriter();
+
+void record(uint16_t connection, const uint8_t* data, size_t bytes);
+uint64_t getRecorded() const;
+uint64_t getDropped() const;
+
+private:
+    const std::string path;
+    const size_t max_buffered;
+    int fd;
+    const std::chrono::steady_clock::time_point start;
+
+    std::mutex mutex;
+    std::condition_variable flush_cv;
+    Payload buffer;         // filled by record()
+    bool stopping;
+    std::atomic<uint64_t> recorded;
+    std::atomic<uint64_t> dropped;
+    std::thread writer;
+
+    void run();
+};
+
+// Reads a capture back in file order
+class CaptureReader
+{
+public:
+// throws when the file can not be opened or is not a capture
+explicit CaptureReader(const std::string& path);
+~CaptureReader();
+
+const CaptureFileHeader& getHeader() const;
+// false at the end of the capture (a truncated last record is ignored)
+bool next(CaptureRecord& record, Payload& body);
+
+private:
+    FILE* file;
+    CaptureFileHeader header;
+};
+
+}
@@ -1,171 +1,855 @@
 #include "client.hpp"
 #include "logger.hpp"
 
+#include <cstring>
+#include <poll.h>
+#include <boost/asio/write.hpp>
+#include <unistd.h>
+
 namespace tcp
 {
 
-uint16_t Client::_id_generator = 0;
+uint16_t ClientBase::_id_generator = 0;
 
-Client::Client(std::string ip_, uint16_t port_, std::string server_ip_, uint16_t server_port_, std::function<void(std::unique_ptr<Payload> rxBuffer_)> handler_) 
-              : id(++_id_generator), client_id("Client_" + std::to_string(id)), handler(handler_)
+// where a client context points back to its Client; the app data slot belongs to asio, which keeps its verify
+// callback there and deletes whatever it finds when the context is destroyed
+static int getTlsOwnerIndex()
 {
-    client_endpoint = Endpoint(boost::asio::ip::make_address_v4(ip_), port_);
-    server_endpoint = Endpoint(boost::asio::ip::make_address_v4(server_ip_), server_port_);
+    static const int index = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+    return index;
+}
+
+ClientBase::ClientBase(std::string ip_, uint16_t port_, std::string server_ip_, uint16_t server_port_, DispatchFunction dispatch_) 
+              : id(++_id_generator), client_id("Client_" + std::to_string(id)), 
+                server_address(server_ip_), transport(getTransport(server_ip_)), tls_session(nullptr), codec(Codec::None), framed(false),
+                chunking(false), chunked(false), integrity(false), checksummed(false),
+                verified_frames(0), failed_frames(0), connection_generation(0), timestamping(false),
+                running(false), connected(false), random_generator(std::random_device{}() + id), shut_down(false), dispatch(dispatch_)
+{
+    client_endpoint = makeClientEndpoint(ip_, port_, server_ip_);
+    server_endpoint = makeEndpoint(server_ip_, server_port_);
     tx_buffer = {'P','I','N','G'}; 
     rx_buffer = Payload(4090); 
 }
 
-Client::~Client()
+ClientBase::~ClientBase()
+{
+    shutdown();
+}
+
+void ClientBase::shutdown()
 {
     std::string function_id = getFunctionId(__func__, client_id);
 
-    rx_buffer.resize(0);
-    tx_buffer.resize(0);
+    if(shut_down) return;
+    shut_down = true;
 
-    try
     {
-        server_socket->cancel();
-        server_socket->close();
+        // under the lock, or a waiter checking its predicate right now misses the wake up (and sleeps out its backoff)
+        std::lock_guard<std::mutex> lock(state_mutex);
+        running = false;
+    }
+    state_cv.notify_all();
 
-        io.stop();
+    {
+        std::lock_guard<std::mutex> lock(tx_mutex);
+        try
+        {
+            if(server_socket)
+            {
+                // already closed if we were between reconnect attempts
+                boost::system::error_code ignored;
+                server_socket->cancel(ignored);
+                server_socket->close(ignored);
+            }
+        }
+        catch(const std::exception& e)
+        {
+            LOG_ERROR << function_id << e.what();
+        }
     }
-    catch(const std::exception& e)
+    io.stop();
+
+    // start_up() still uses our members, wait for it before they go away
+    if(status_future.valid())
     {
-        LOG_ERROR << function_id << e.what();
+        status_future.wait();
     }
-    
+
+    if(shm)
+    {
+        shm->stop();
+    }
+
+    if(transport != Transport::Tcp)
+    {
+        ::unlink(toString(client_endpoint).c_str());
+    }
+
+    tls.reset();
+    if(tls_session)
+    {
+        SSL_SESSION_free(tls_session);
+    }
+
+    rx_buffer.resize(0);
+    tx_buffer.resize(0);
+}
+
+const std::string& ClientBase::getClientId() const
+{
+    return client_id;
 }
 
-void Client::start()
+void ClientBase::start()
 {
+    {
+        std::lock_guard<std::mutex> lock(state_mutex);
+        running = true;
+    }
     status_future = std::async(std::launch::async, [=](){this->start_up(); });
 }
 
-uint16_t Client::getId() const
+uint16_t ClientBase::getId() const
 {
     return id;
 }
 
-std::future_status Client::status() const
+std::future_status ClientBase::status() const
 {
     return status_future.wait_for(std::chrono::milliseconds(0));
 }
 
-void Client::send(std::unique_ptr<Payload> txBuffer_)
+void ClientBase::setReconnectPolicy(const ReconnectPolicy& policy_)
+{
+    reconnect_policy = policy_;
+}
+
+void ClientBase::setTls(const TlsConfig& config)
+{
+    tls_config = config;
+}
+
+void ClientBase::setCompression(const CompressionConfig& config)
+{
+    compression_config = config;
+}
+
+CompressionStats ClientBase::getCompressionStats() const
+{
+    return compressor ? compressor->getStats() : CompressionStats();
+}
+
+void ClientBase::setTimestamping(bool enabled)
+{
+    timestamping = enabled;
+}
+
+TimestampStats ClientBase::getTimestampStats() const
+{
+    TimestampStats stats;
+    stats.kernel_to_handler = kernel_to_handler.getSummary();
+    stats.send_to_wire = send_to_wire.getSummary();
+    return stats;
+}
+
+void ClientBase::setStoppedCallback(std::function<void()> callback_)
+{
+    stopped_callback = callback_;
+}
+
+void ClientBase::setConnectRateLimiter(std::shared_ptr<TokenBucket> limiter_)
+{
+    connect_limiter = limiter_;
+}
+
+bool ClientBase::isConnected() const
+{
+    return connected;
+}
+
+bool ClientBase::waitUntilConnected(std::chrono::milliseconds timeout) const
+{
+    std::unique_lock<std::mutex> lock(state_mutex);
+    return state_cv.wait_for(lock, timeout, [this](){ return connected || !running; }) && connected;
+}
+
+bool ClientBase::send(std::unique_ptr<Payload> txBuffer_, Priority priority)
 {
     std::string function_id = getFunctionId(__func__, client_id);
 
     if(txBuffer_->size() == 0)
     {
-        LOG_WARNING << function_id <<  " Empty Payload, will ignore!";
-        return;
+        LOG_WARNING_LIMITED(10) << function_id <<  " Empty Payload, will ignore!";
+        return false;
     }
 
-    LOG_DEBUG << function_id <<  " Sending Payload with " << txBuffer_->size() << " bytes to Server";
-    tx_buffer = *txBuffer_;
-    try
+    std::unique_lock<std::mutex> lock(tx_mutex);
+
+    if(connected)
     {
-        server_socket->send(boost::asio::buffer(tx_buffer));
+        LOG_DEBUG << function_id <<  " Sending Payload with " << txBuffer_->size() << " bytes to Server";
+        try
+        {
+            // nothing waiting on any lane and no chunks to make: straight out, without a copy
+            bool split = chunked && txBuffer_->size() > chunk_bytes;
+            if(!split && lanes.empty())
+            {
+                write_message_locked(txBuffer_->data(), txBuffer_->size());
+                return true;
+            }
+
+            // encoded without the lock, a reconnect in the meantime makes them stale
+            Compressor* encoder = framed ? compressor.get() : nullptr;
+            Codec encoding = codec;
+            bool sealed = checksummed;
+            uint64_t generation = connection_generation;
+            lock.unlock();
+            return write_frames(priority, makeFrames(encoder, encoding, split, sealed, priority, txBuffer_->data(), txBuffer_->size()),
+                                generation);
+        }
+        catch(const std::exception& e)
+        {
+            // the rx path notices the broken connection and starts reconnecting
+            LOG_ERROR << function_id << " " << e.what();
+            return false;
+        }
     }
-    catch(const std::exception& e)
+
+    if(reconnect_policy.send_policy == SendPolicy::Buffer && pending_tx.size() < reconnect_policy.max_buffered)
     {
-        LOG_ERROR << function_id << " " << e.what();
-    }    
+        LOG_DEBUG << function_id <<  " Not connected, buffering Payload with " << txBuffer_->size() << " bytes";
+        pending_tx.push_back(std::move(txBuffer_));
+        return true;
+    }
+
+    LOG_WARNING_LIMITED(10) << function_id <<  " Not connected, dropping Payload with " << txBuffer_->size() << " bytes";
+    return false;
+}
+
+void ClientBase::setChunking(bool enabled)
+{
+    chunking = enabled;
+}
+
+void ClientBase::setIntegrity(bool enabled)
+{
+    integrity = enabled;
+}
+
+IntegrityStats ClientBase::getIntegrityStats() const
+{
+    IntegrityStats stats;
+    stats.verified_frames = verified_frames;
+    stats.failed_frames = failed_frames;
+    return stats;
 }
 
-void Client::start_up()
+void ClientBase::start_up()
 {
     std::string function_id = getFunctionId(__func__, client_id);
 
     LOG_DEBUG << function_id << " Starting CLIENT thread";
 
-    server_socket = std::make_shared<Socket>(io);
+    if(tls_config.enabled && transport != Transport::SharedMemory)
+    {
+        try
+        {
+            tls_context = makeClientTlsContext(tls_config);
+            SSL_CTX_set_ex_data(tls_context->native_handle(), getTlsOwnerIndex(), this);
+            SSL_CTX_sess_set_new_cb(tls_context->native_handle(), &ClientBase::on_new_tls_session);
+        }
+        catch(const std::exception& e)
+        {
+            LOG_ERROR << function_id << " Invalid TLS configuration: " << e.what();
+            finish(true);
+            return;
+        }
+    }
+
+    if((compression_config.codec != Codec::None || chunking || integrity) && transport != Transport::SharedMemory)
+    {
+        try
+        {
+            compressor = std::make_unique<Compressor>(compression_config);
+        }
+        catch(const std::exception& e)
+        {
+            LOG_ERROR << function_id << " Invalid compression configuration: " << e.what();
+            finish(true);
+            return;
+        }
+    }
+
+    uint32_t attempt = 0;
+    while(running)
+    {
+        if(connect_limiter)
+        {
+            std::chrono::nanoseconds delay = connect_limiter->reserve();
+            if(delay.count() > 0)
+            {
+                std::unique_lock<std::mutex> lock(state_mutex);
+                if(state_cv.wait_for(lock, delay, [this](){ return !running; })) break;
+            }
+        }
+
+        if(connect())
+        {
+            attempt = 0;
+
+            LOG_DEBUG << function_id <<  " Starting io_context run";
+            io.restart();
+            if(running)
+            {
+                io.run(); // returns once the connection is gone
+            }
+
+            disconnect();
+            if(!running) break;
+
+            LOG_WARNING << function_id <<  " Lost connection to Server(" << toString(server_endpoint) << ")";
+        }
+
+        ++attempt;
+        if(!reconnect_policy.enabled || (reconnect_policy.max_attempts > 0 && attempt > reconnect_policy.max_attempts))
+        {
+            LOG_ERROR << function_id <<  " Giving up on Server(" << toString(server_endpoint) << ") after " << attempt << " attempts";
+            break;
+        }
+
+        std::chrono::milliseconds delay = next_backoff(attempt);
+        LOG_DEBUG << function_id <<  " Reconnecting in " << delay.count() << "ms (attempt " << attempt << ")";
+
+        std::unique_lock<std::mutex> lock(state_mutex);
+        state_cv.wait_for(lock, delay, [this](){ return !running; });
+    }
+
+    // still running means we gave up, not that the owner stopped us
+    finish(running);
+}
+
+void ClientBase::finish(bool on_own)
+{
+    std::string function_id = getFunctionId(__func__, client_id);
+
+    {
+        std::lock_guard<std::mutex> lock(tx_mutex);
+        pending_tx.clear();
+    }
+    {
+        std::lock_guard<std::mutex> lock(state_mutex);
+        running = false;
+    }
+    state_cv.notify_all();
+
+    LOG_DEBUG << function_id << " CLIENT thread stopped";
+    if(on_own && stopped_callback)
+    {
+        stopped_callback();
+    }
+}
+
+bool ClientBase::connect()
+{
+    std::string function_id = getFunctionId(__func__, client_id);
+
+    std::shared_ptr<Socket> socket = std::make_shared<Socket>(io);
 
     try
     {
-        LOG_DEBUG << function_id <<  " OPEN ip_v4 socket";
-        server_socket->open(client_endpoint.protocol().v4());
+        LOG_DEBUG << function_id <<  " OPEN " << ((transport == Transport::Tcp) ? "ip_v4" : "unix") << " socket";
+        socket->open(client_endpoint.protocol());
 
-        LOG_DEBUG << function_id <<  " SET_OPTION reuse_address(true)";
-        server_socket->set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+        if(transport == Transport::Tcp)
+        {
+            LOG_DEBUG << function_id <<  " SET_OPTION reuse_address(true)";
+            socket->set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+        }
+        else
+        {
+            ::unlink(toString(client_endpoint).c_str());
+        }
 
-        LOG_DEBUG << function_id <<  " BIND [" << client_endpoint.address().to_string() << ":" 
-                              << client_endpoint.port() << "]";
-        server_socket->bind(client_endpoint);
+        LOG_DEBUG << function_id <<  " BIND [" << toString(client_endpoint) << "]";
+        socket->bind(client_endpoint);
 
-        LOG_DEBUG << function_id <<  " CONNECT TO [" << server_endpoint.address().to_string() << ":" 
-                              << server_endpoint.port() << "]";
-        server_socket->connect(server_endpoint);
+        if(transport == Transport::SharedMemory)
+        {
+            // must exist before connecting, the server opens it as soon as it accepts us
+            LOG_DEBUG << function_id <<  " Creating shared memory channel";
+            shm = ShmChannel::create(getShmName(server_address, getPort(client_endpoint)));
+            shm->start([this](const uint8_t* data, size_t bytes){ this->process_payload(data, bytes); },
+                [this]()
+                {
+                    // the server broke the ring format, dropping the connection ends the read on it and start_up() reconnects
+                    boost::asio::post(io, [this]()
+                        {
+                            boost::system::error_code ignored;
+                            if(server_socket) server_socket->shutdown(Socket::shutdown_both, ignored);
+                        });
+                });
+        }
+
+        LOG_DEBUG << function_id <<  " CONNECT TO [" << toString(server_endpoint) << "]";
+        socket->connect(server_endpoint);
+
+        std::unique_ptr<TlsChannel> channel;
+        if(tls_context)
+        {
+            SSL_SESSION* session = nullptr;
+            {
+                std::lock_guard<std::mutex> lock(state_mutex);
+                if(tls_session && SSL_SESSION_up_ref(tls_session))
+                {
+                    session = tls_session;
+                }
+            }
+
+            LOG_DEBUG << function_id <<  " TLS handshake" << (session ? " (resuming session)" : "");
+            channel = std::make_unique<TlsChannel>(*tls_context, *socket, false);
+            try
+            {
+                // a unix socket path names no host, only the CA is checked there
+                if(!tls_config.server_name.empty() || transport == Transport::Tcp)
+                {
+                    channel->setServerName(tls_config.server_name.empty() ? server_address : tls_config.server_name);
+                }
+                channel->handshake(session);
+            }
+            catch(...)
+            {
+                SSL_SESSION_free(session);
+                throw;
+            }
+            SSL_SESSION_free(session);
+        }
+
+        Codec negotiated = Codec::None;
+        uint8_t negotiated_features = 0;
+        bool negotiated_framing = compressor && negotiate(*socket, channel.get(), negotiated, negotiated_features);
+
+        std::lock_guard<std::mutex> lock(tx_mutex);
+        server_socket = socket;
+        tls = std::move(channel);
+        codec = negotiated;
+        framed = negotiated_framing;
+        chunked = negotiated_framing && (negotiated_features & HelloChunks);
+        checksummed = negotiated_framing && (negotiated_features & HelloChecksums);
+        frame_reader.reset();
+        chunk_assembler.reset();
+        // frames queued for the previous connection, possibly half a chunked message, must not go out here
+        lanes.clear();
+        ++connection_generation;
+
+        // after the Hello exchange, the tx stamp ids count from the next write on
+        if(timestamping && transport == Transport::Tcp && !tls && !timestamps.enable(socket->native_handle(), true))
+        {
+            LOG_WARNING << function_id <<  " SO_TIMESTAMPING refused: " << std::strerror(errno);
+        }
 
         LOG_DEBUG << function_id <<  " Setting Async Rx Callback";
-        server_socket->async_receive(boost::asio::buffer(rx_buffer), [=](const boost::system::error_code& ec, size_t bytes){this->rx_callback(ec, bytes); });
+        arm_receive();
+
+        LOG_DEBUG << function_id <<  " Sending PING to Server(" << toString(server_endpoint) << ")";
+        write_message_locked(tx_buffer.data(), tx_buffer.size());
 
-        LOG_DEBUG << function_id <<  " Sending PING to Server(" << server_socket->remote_endpoint().port() << ")";
-        server_socket->send(boost::asio::buffer(tx_buffer));
+        if(!pending_tx.empty())
+        {
+            LOG_DEBUG << function_id <<  " Flushing " << pending_tx.size() << " buffered Payloads";
+        }
+        while(!pending_tx.empty())
+        {
+            write_message_locked(pending_tx.front()->data(), pending_tx.front()->size());
+            pending_tx.pop_front();
+        }
 
-        LOG_DEBUG << function_id <<  " Starting io_context run";
-        io.run();
+        std::lock_guard<std::mutex> state_lock(state_mutex);
+        connected = true;
     }
     catch(const std::exception& e)
     {
-        LOG_ERROR << function_id << " " << e.what();
-        exit (EXIT_FAILURE);
+        LOG_WARNING << function_id << " " << e.what();
+
+        boost::system::error_code ignored;
+        socket->close(ignored);
+        if(shm)
+        {
+            shm->stop();
+            shm.reset();
+        }
+        return false;
     }
-    
 
+    state_cv.notify_all();
+    return true;
 }
 
-void Client::rx_callback(const boost::system::error_code& ec, size_t bytes)
+bool ClientBase::negotiate(Socket& socket, TlsChannel* channel, Codec& codec_, uint8_t& features_)
+{
+    std::string function_id = getFunctionId(__func__, client_id);
+
+    uint8_t features = (chunking ? HelloChunks : 0) | (integrity ? HelloChecksums : 0);
+    Hello offer = makeHello((uint8_t)compressor->getCodec(), compressor->getDictionaryId(), features);
+    if(channel)
+    {
+        channel->write(reinterpret_cast<const uint8_t*>(&offer), sizeof(offer));
+    }
+    else
+    {
+        boost::asio::write(socket, boost::asio::buffer(&offer, sizeof(offer)));
+    }
+
+    // nothing else is in flight yet, the answer is the first thing the server sends
+    Hello answer;
+    uint8_t* data = reinterpret_cast<uint8_t*>(&answer);
+    size_t received = 0;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+    while(received < sizeof(answer) && std::chrono::steady_clock::now() < deadline)
+    {
+        size_t bytes = 0;
+        if(channel)
+        {
+            boost::system::error_code ec;
+            bytes = channel->read_some(data + received, sizeof(answer) - received, ec);
+            if(ec) throw boost::system::system_error(ec);
+        }
+        else
+        {
+            ssize_t result = ::recv(socket.native_handle(), data + received, sizeof(answer) - received, MSG_DONTWAIT);
+            if(result == 0) throw boost::system::system_error(boost::asio::error::eof);
+            if(result < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                throw boost::system::system_error(errno, boost::system::system_category());
+            }
+            bytes = (result > 0) ? result : 0;
+        }
+
+        if(bytes == 0)
+        {
+            pollfd pfd = {socket.native_handle(), POLLIN, 0};
+            ::poll(&pfd, 1, 100);
+        }
+        received += bytes;
+    }
+
+    if(received < sizeof(answer) || !isHello(data, received))
+    {
+        LOG_WARNING << function_id <<  " Server did not answer the compression offer, sending uncompressed";
+        return false;
+    }
+
+    codec_ = (answer.codecs == (uint8_t)compressor->getCodec()) ? compressor->getCodec() : Codec::None;
+    features_ = answer.features & features;
+    if(integrity && !(features_ & HelloChecksums))
+    {
+        LOG_WARNING << function_id <<  " Server does not check frames, sending without checksums";
+    }
+    LOG_DEBUG << function_id <<  " Framing negotiated, compression: " << toString(codec_);
+    return true;
+}
+
+void ClientBase::disconnect()
+{
+    std::lock_guard<std::mutex> lock(tx_mutex);
+
+    {
+        std::lock_guard<std::mutex> state_lock(state_mutex);
+        connected = false;
+    }
+    tls.reset();
+    lanes.clear();
+
+    if(shm)
+    {
+        shm->stop();
+        shm.reset();
+    }
+
+    if(server_socket)
+    {
+        boost::system::error_code ignored;
+        server_socket->close(ignored);
+    }
+}
+
+std::chrono::milliseconds ClientBase::next_backoff(uint32_t attempt)
+{
+    double delay = reconnect_policy.initial_delay.count();
+    for(uint32_t i = 1; i < attempt && delay < reconnect_policy.max_delay.count(); ++i)
+    {
+        delay *= reconnect_policy.multiplier;
+    }
+    delay = std::min(delay, (double)reconnect_policy.max_delay.count());
+
+    // half fixed, half random, so clients dropped together do not come back together
+    std::uniform_real_distribution<double> jitter(0.0, delay / 2);
+    return std::chrono::milliseconds((int64_t)(delay / 2 + jitter(random_generator)));
+}
+
+void ClientBase::rx_callback(const boost::system::error_code& ec, size_t bytes)
 {
     std::string function_id = getFunctionId(__func__, client_id);
-    LOG_DEBUG << function_id <<  " Got something!";
     
     if(ec)
     {
-        LOG_WARNING << function_id <<  " Erro code: " << ec.message();
+        if(ec == boost::asio::error::operation_aborted) return; // we are shutting the connection down
+
+        LOG_WARNING_LIMITED(10) << function_id <<  " Erro code: " << ec.message();
         if(ec == boost::asio::error::eof)
         {
             LOG_DEBUG << function_id <<  " Server closed the connection!";
         }
+        // no more work for io, start_up() takes over and reconnects
+        return;
+    }
+
+    setReceiveTimestamp(timestamps.getReceiveTime());
+    bool valid = !bytes || receive(rx_buffer.data(), bytes);
+    setReceiveTimestamp(std::chrono::system_clock::time_point());
+    if(!valid)
+    {
+        // no more work for io, start_up() reconnects with a fresh stream
+        LOG_ERROR << function_id <<  " Corrupt frame from Server, dropping the connection";
         return;
     }
 
-    LOG_DEBUG << function_id <<  " Received " << bytes << " bytes";
-    if(bytes)
+    if(timestamps.isEnabled())
     {
-        std::string payload(rx_buffer.begin(), rx_buffer.end());
-        LOG_DEBUG << function_id <<  " Rx Payload: " << payload;
+        // stamps of writes not followed by another one
+        timestamps.reap(send_to_wire);
+    }
 
-        if(handler)
+    LOG_DEBUG << function_id <<  " Setting Async Rx Callback";
+    arm_receive();
+
+}
+
+void ClientBase::arm_receive()
+{
+    if(tls)
+    {
+        // OpenSSL may already hold decrypted bytes, only wait on the socket when it has none
+        boost::system::error_code ec;
+        size_t bytes = tls->read_some(rx_buffer.data(), rx_buffer.size(), ec);
+        if(ec || bytes > 0)
         {
-            std::unique_ptr<Payload> rxPayload = std::make_unique<Payload>(rx_buffer);
-            handler(std::move(rxPayload));
+            boost::asio::post(io, [=](){ this->rx_callback(ec, bytes); });
+            return;
         }
-        else
-        {
-            // if no hadnler is defined simply Pong the client (use as default impl - maybe be comment out this section later)
-            std::this_thread::sleep_for(std::chrono::seconds(2));
-            try
+
+        server_socket->async_wait(Socket::wait_read, [=](const boost::system::error_code& ec)
             {
-                LOG_DEBUG << function_id <<  " Sending PING to Server(" << server_socket->remote_endpoint().port() << ")";
-                server_socket->send(boost::asio::buffer(tx_buffer));
-            }
-            catch(const std::exception& e)
+                if(ec)
+                {
+                    this->rx_callback(ec, 0);
+                    return;
+                }
+                this->arm_receive();
+            });
+        return;
+    }
+
+    if(timestamps.isEnabled())
+    {
+        // async_receive() drops the control messages carrying the receive time, read with recvmsg() once ready
+        server_socket->async_wait(Socket::wait_read, [=](const boost::system::error_code& ec)
             {
-                LOG_ERROR << function_id << " " << e.what();
-            }            
-        }
+                if(ec)
+                {
+                    this->rx_callback(ec, 0);
+                    return;
+                }
+
+                ssize_t result = timestamps.receive(rx_buffer.data(), rx_buffer.size());
+                if(result > 0)
+                {
+                    this->rx_callback(ec, (size_t)result);
+                }
+                else if(result == 0)
+                {
+                    this->rx_callback(boost::asio::error::eof, 0);
+                }
+                else if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                {
+                    this->arm_receive();
+                }
+                else
+                {
+                    this->rx_callback(boost::system::error_code(errno, boost::system::system_category()), 0);
+                }
+            });
+        return;
     }
 
-    LOG_DEBUG << function_id <<  " Setting Async Rx Callback";
     server_socket->async_receive(boost::asio::buffer(rx_buffer), 
         [=](const boost::system::error_code& ec, size_t bytes)
         {
             this->rx_callback(ec, bytes); 
         });
+}
+
+bool ClientBase::receive(const uint8_t* data, size_t bytes)
+{
+    std::string function_id = getFunctionId(__func__, client_id);
+
+    if(!framed)
+    {
+        process_payload(data, bytes);
+        return true;
+    }
+
+    bool valid = true;
+    Payload message;
+    bool complete = frame_reader.feed(data, bytes, [&](const FrameHeader& header, const uint8_t* body)
+        {
+            if(!valid) return;
+            FrameHeader frame = header;
+            if(checksummed)
+            {
+                if(!verifyFrame(frame, body))
+                {
+                    ++failed_frames;
+                    chunk_assembler.drop(frame);
+                    LOG_WARNING_LIMITED(10) << function_id <<  " Checksum mismatch in a frame from the Server, dropping its message";
+                    return;
+                }
+                ++verified_frames;
+            }
+            valid = compressor->decode(codec, frame, body, message);
+            bool corrupt = false;
+            if(valid && chunk_assembler.add(frame, message, corrupt))
+            {
+                process_payload(message.data(), message.size());
+            }
+            valid = valid && !corrupt;
+        });
+    return complete && valid;
+}
+
+void ClientBase::process_payload(const uint8_t* data, size_t bytes)
+{
+    std::chrono::system_clock::time_point received = getReceiveTimestamp();
+    if(received != std::chrono::system_clock::time_point())
+    {
+        kernel_to_handler.record(std::chrono::system_clock::now() - received);
+    }
+
+    if(!dispatch(*this, data, bytes))
+    {
+        // if no hadnler is defined simply Pong the client (use as default impl - maybe be comment out this section later)
+        std::string function_id = getFunctionId(__func__, client_id);
+        {
+            // interruptible, so stopping the client does not wait for the next PING
+            std::unique_lock<std::mutex> lock(state_mutex);
+            if(state_cv.wait_for(lock, std::chrono::seconds(2), [this](){ return !running; })) return;
+        }
+        try
+        {
+            LOG_DEBUG << function_id <<  " Sending PING to Server(" << toString(server_endpoint) << ")";
+            write_message(tx_buffer.data(), tx_buffer.size());
+        }
+        catch(const std::exception& e)
+        {
+            LOG_ERROR_LIMITED(10) << function_id << " " << e.what();
+        }            
+    }
+}
+
+void ClientBase::write_message(const uint8_t* data, size_t bytes)
+{
+    std::lock_guard<std::mutex> lock(tx_mutex);
+    write_message_locked(data, bytes);
+}
+
+void ClientBase::write_message_locked(const uint8_t* data, size_t bytes)
+{
+    if(!framed)
+    {
+        write_locked(boost::asio::buffer(data, bytes));
+        return;
+    }
 
+    // reused per thread, frames are built and written before the next one
+    static thread_local Payload frame;
+    frame.clear();
+    compressor->encode(codec, data, bytes, frame);
+    if(checksummed)
+    {
+        sealFrame(frame, 0);
+    }
+    write_locked(boost::asio::buffer(frame));
 }
 
+bool ClientBase::write_frames(Priority priority, std::vector<OutboundLanes::Frame> frames, uint64_t generation)
+{
+    OutboundLanes::Ticket ticket;
+    {
+        std::lock_guard<std::mutex> lock(tx_mutex);
+        if(!connected || generation != connection_generation) return false;
+        ticket = lanes.push(priority, std::move(frames));
+    }
+
+    // one frame per turn on the lock, so a sender of a higher lane gets in between
+    while(true)
+    {
+        std::lock_guard<std::mutex> lock(tx_mutex);
+        OutboundLanes::Frame frame;
+        if(lanes.done(ticket) || !lanes.next(frame)) return true;
 
+        try
+        {
+            write_locked(boost::asio::buffer(*frame));
+        }
+        catch(...)
+        {
+            // the connection is broken, the other senders must not wait for their frames
+            lanes.clear();
+            throw;
+        }
+    }
 }
 
+void ClientBase::write_locked(boost::asio::const_buffer buffer)
+{
+    if(shm)
+    {
+        shm->write(static_cast<const uint8_t*>(buffer.data()), buffer.size());
+        return;
+    }
+
+    if(tls)
+    {
+        tls->write(static_cast<const uint8_t*>(buffer.data()), buffer.size());
+        return;
+    }
+
+    if(!timestamps.isEnabled())
+    {
+        boost::asio::write(*server_socket, buffer);
+        return;
+    }
+
+    std::chrono::system_clock::time_point started = std::chrono::system_clock::now();
+    boost::asio::write(*server_socket, buffer);
+    timestamps.sent(buffer.size(), started);
+    timestamps.reap(send_to_wire);
+}
+
+int ClientBase::on_new_tls_session(SSL* ssl, SSL_SESSION* session)
+{
+    // every Client owns its context, which points back to it
+    ClientBase* client = static_cast<ClientBase*>(SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), getTlsOwnerIndex()));
+
+    std::lock_guard<std::mutex> lock(client->state_mutex);
+    if(client->tls_session)
+    {
+        SSL_SESSION_free(client->tls_session);
+    }
+    client->tls_session = session;
+
+    return 1; // we keep the reference
+}
+
+
+}
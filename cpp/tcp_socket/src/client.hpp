@@ -3,25 +3,96 @@
 #include <iostream>
 #include <thread>
 #include <future>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <random>
+#include <condition_variable>
 #include <boost/asio/ip/tcp.hpp>
 #include "types.hpp"
+#include "transport.hpp"
+#include "shm_channel.hpp"
+#include "tls.hpp"
+#include "compression.hpp"
+#include "rate_limiter.hpp"
+#include "policies.hpp"
+#include "message.hpp"
+#include "lanes.hpp"
+#include "timestamping.hpp"
 
 
 namespace tcp
 {
 
-class Client
+// What send() does while the client is (re)connecting
+enum class SendPolicy : uint8_t
+{
+    Buffer,     // keep up to max_buffered payloads and flush them once connected
+    Reject      // drop the payload, send() returns false
+};
+
+struct ReconnectPolicy
+{
+    bool enabled = true;
+    std::chrono::milliseconds initial_delay = std::chrono::milliseconds(100);
+    std::chrono::milliseconds max_delay = std::chrono::milliseconds(10000);
+    double multiplier = 2.0;
+    uint32_t max_attempts = 0;  // consecutive failed attempts before giving up, 0 = never
+    SendPolicy send_policy = SendPolicy::Buffer;
+    size_t max_buffered = 1024;
+};
+
+// Everything but the message handler, see BasicClient
+class ClientBase
 {
 public:
-Client(std::string ip_, uint16_t port_, std::string server_ip_, uint16_t server_port_, std::function<void(std::unique_ptr<Payload> rxBuffer_)> handler_ = nullptr);
-virtual ~Client();
+virtual ~ClientBase();
 
+// non-blocking, connects (and later reconnects) in the background, may be called again once the client stopped
 void start();
 std::future_status status() const;
 uint16_t getId() const;
 
-void send(std::unique_ptr<Payload> txBuffer_);
-
+void setReconnectPolicy(const ReconnectPolicy& policy_);
+// must be called before start(), reconnects resume the previous TLS session when the server allows it
+void setTls(const TlsConfig& config);
+// must be called before start(), the codec is offered to the server on every connect
+void setCompression(const CompressionConfig& config);
+CompressionStats getCompressionStats() const;
+// must be called before start(), large messages are then sent in chunks both ways, so higher priorities
+// get in between (see lanes.hpp); framing is negotiated for it even without compression
+void setChunking(bool enabled);
+// must be called before start(), every frame then carries a checksum both ways if the server agrees; framing is
+// negotiated for it even without compression. A frame that fails its check is dropped with its message and counted.
+void setIntegrity(bool enabled);
+IntegrityStats getIntegrityStats() const;
+// must be called before start(): kernel receive and transmit times (SO_TIMESTAMPING, software) over TCP without TLS,
+// the handler gets the receive time of its message from getReceiveTimestamp() (timestamping.hpp)
+void setTimestamping(bool enabled);
+TimestampStats getTimestampStats() const;
+// shared by a fleet of clients to cap how many connect (or reconnect) per second
+void setConnectRateLimiter(std::shared_ptr<TokenBucket> limiter_);
+// called from the client thread when it stops on its own (gave up reconnecting, invalid configuration)
+void setStoppedCallback(std::function<void()> callback_);
+bool isConnected() const;
+// lets callers start many clients first and then wait for all of them to be connected
+bool waitUntilConnected(std::chrono::milliseconds timeout) const;
+
+// false if the payload was neither sent nor buffered; higher priorities are written first
+bool send(std::unique_ptr<Payload> txBuffer_, Priority priority = Priority::Normal);
+
+protected:
+// called for every message from the client thread, data is only valid during the call;
+// false when there is no handler, the server then gets a PING every 2 seconds
+using DispatchFunction = bool (*)(ClientBase& client_, const uint8_t* data, size_t bytes);
+
+// server_ip_ may also be "unix:<path>" or "shm:<path>" (see transport.hpp);
+// dispatch_ is a static function of the derived class, a plain call with no virtual lookup per message
+ClientBase(std::string ip_, uint16_t port_, std::string server_ip_, uint16_t server_port_, DispatchFunction dispatch_);
+
+// stops the client thread, a derived class calls it first so dispatch_ is not called on a half destroyed object
+void shutdown();
+const std::string& getClientId() const;
 
 private:
     static uint16_t _id_generator;
@@ -29,6 +100,8 @@ private:
     const std::string client_id;
 
     Context io;
+    const std::string server_address;
+    const Transport transport;
     Endpoint client_endpoint;
     Endpoint server_endpoint;
 
@@ -38,13 +111,129 @@ private:
     Payload tx_buffer; 
 
     std::shared_ptr<Socket> server_socket;
-
-    std::function<void(std::unique_ptr<Payload> rxBuffer_)> handler;
+    std::shared_ptr<ShmChannel> shm;
+
+    TlsConfig tls_config;
+    std::unique_ptr<TlsContext> tls_context;
+    std::unique_ptr<TlsChannel> tls;
+    SSL_SESSION* tls_session;
+
+    CompressionConfig compression_config;
+    std::unique_ptr<Compressor> compressor;
+    Codec codec;            // negotiated for the current connection
+    bool framed;
+    FrameReader frame_reader;
+    bool chunking;          // asked for
+    bool chunked;           // accepted by the server for the current connection
+    bool integrity;         // asked for
+    bool checksummed;       // accepted by the server for the current connection
+    std::atomic<uint64_t> verified_frames;
+    std::atomic<uint64_t> failed_frames;
+    ChunkAssembler chunk_assembler;
+    OutboundLanes lanes;
+    uint64_t connection_generation;
+    bool timestamping;
+    SocketTimestamps timestamps;
+    LatencyHistogram kernel_to_handler;
+    LatencyHistogram send_to_wire;
+
+    ReconnectPolicy reconnect_policy;
+    std::shared_ptr<TokenBucket> connect_limiter;
+    std::atomic<bool> running;
+    std::atomic<bool> connected;
+    mutable std::mutex state_mutex;
+    mutable std::condition_variable state_cv;
+    std::mutex tx_mutex;
+    std::deque<std::unique_ptr<Payload>> pending_tx;
+    std::mt19937 random_generator;
+
+    std::function<void()> stopped_callback;
+    bool shut_down;
+    const DispatchFunction dispatch;
 
     void start_up();
+    void finish(bool on_own);
+    bool connect();
+    // features_: the HelloFeatures the server accepted
+    bool negotiate(Socket& socket, TlsChannel* channel, Codec& codec_, uint8_t& features_);
+    void disconnect();
+    std::chrono::milliseconds next_backoff(uint32_t attempt);
+    void arm_receive();
     void rx_callback(const boost::system::error_code& ec, size_t bytes);
+    bool receive(const uint8_t* data, size_t bytes);
+    void process_payload(const uint8_t* data, size_t bytes);
+    void write_locked(boost::asio::const_buffer buffer);
+    void write_message(const uint8_t* data, size_t bytes);
+    void write_message_locked(const uint8_t* data, size_t bytes);
+    // pushes the frames on their lane and writes frames of every lane, highest first, until they are out;
+    // false when the connection they were made for is gone
+    bool write_frames(Priority priority, std::vector<OutboundLanes::Frame> frames, uint64_t generation);
+
+    static int on_new_tls_session(SSL* ssl, SSL_SESSION* session);
 
 };
 
+// Client with the message handler and the per-message logging (see policies.hpp) fixed at compile time,
+// the handler call is inlined. The handler is called from the client thread, as one of
+//     handler(const uint8_t* data, size_t bytes)           no copy, data is only valid during the call
+//     handler(std::unique_ptr<Payload> rxBuffer_)          a copy the handler owns
+//     handler(MessageView<Schema> message)                 no copy either, a typed view of data (see message.hpp);
+//                                                          other messages are dropped
+template<typename Handler, typename LogPolicy = RuntimeLog>
+class BasicClient final : public ClientBase
+{
+public:
+BasicClient(std::string ip_, uint16_t port_, std::string server_ip_, uint16_t server_port_, Handler handler_ = Handler())
+    : ClientBase(std::move(ip_), port_, std::move(server_ip_), server_port_, &BasicClient::dispatch), handler(std::move(handler_)) {}
+~BasicClient() override { shutdown(); }
+
+private:
+    Handler handler;
+
+// the handler and LogPolicy are known here, both are inlined into the one call ClientBase makes per message
+static bool dispatch(ClientBase& client_, const uint8_t* data, size_t bytes)
+{
+    BasicClient& client = static_cast<BasicClient&>(client_);
+    Handler& handler = client.handler;
+
+    if(LogPolicy::enabled(LogLevel::DEBUG))
+    {
+        std::string function_id = getFunctionId(__func__, client.getClientId());
+        LOG_DEBUG << function_id <<  " Got something!";
+        LOG_DEBUG << function_id <<  " Received " << bytes << " bytes";
+        LOG_DEBUG << function_id <<  " Rx Payload: " << std::string(data, data + bytes);
+    }
+
+    if(!isSet(handler)) return false;
+
+    if constexpr(!std::is_void<typename HandlerSchema<Handler>::type>::value)
+    {
+        using Schema = typename HandlerSchema<Handler>::type;
+        MessageView<Schema> view = MessageView<Schema>::from(data, bytes);
+        if(!view)
+        {
+            std::string function_id = getFunctionId(__func__, client.getClientId());
+            LOG_WARNING_SAMPLED(1000) << function_id <<  " Dropping a message that is not of type "
+                                      << Schema::message_type << " version " << Schema::message_version;
+            return true;
+        }
+        handler(view);
+    }
+    else if constexpr(std::is_invocable<Handler&, const uint8_t*, size_t>::value)
+    {
+        handler(data, bytes);
+    }
+    else
+    {
+        handler(std::make_unique<Payload>(data, data + bytes));
+    }
+    return true;
+}
+};
+
+using ClientHandler = std::function<void(std::unique_ptr<Payload> rxBuffer_)>;
+// the handler may be nullptr, the client then PINGs the server every 2 seconds
+using Client = BasicClient<ClientHandler>;
+
 }
 
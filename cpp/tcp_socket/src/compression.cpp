@@ -0,0 +1,342 @@
+#include "compression.hpp"
+#include "logger.hpp"
+
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <time.h>
+
+#ifdef TCP_HAS_LZ4
+#include <lz4.h>
+#endif
+#ifdef TCP_HAS_ZSTD
+#include <zstd.h>
+#endif
+
+namespace tcp
+{
+
+static uint64_t threadCpuTimeNs()
+{
+    timespec now;
+    ::clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+// FNV-1a, only used to check both peers loaded the same dictionary
+static uint32_t getDictionaryHash(const Payload& dictionary)
+{
+    uint32_t hash = 2166136261u;
+    for(uint8_t byte : dictionary)
+    {
+        hash = (hash ^ byte) * 16777619u;
+    }
+    return hash ? hash : 1;
+}
+
+#ifdef TCP_HAS_LZ4
+// LZ4 only looks at the last 64KB of a dictionary
+static const size_t lz4_max_dictionary = 64 * 1024;
+
+static const char* getLz4Window(const Payload& dictionary, int& size)
+{
+    size = (int)std::min(dictionary.size(), lz4_max_dictionary);
+    return reinterpret_cast<const char*>(dictionary.data() + dictionary.size() - size);
+}
+
+// LZ4_attach_dictionary() is public API from lz4 1.10 on, before that only LZ4_loadDict() may fill a stream
+#define TCP_LZ4_ATTACH_DICTIONARY (LZ4_VERSION_NUMBER >= 11000)
+
+struct Lz4Context
+{
+    LZ4_stream_t stream;
+    Lz4Context() { LZ4_initStream(&stream, sizeof(stream)); }
+};
+static thread_local Lz4Context lz4_context;
+#endif
+
+#ifdef TCP_HAS_ZSTD
+struct ZstdContext
+{
+    ZSTD_CCtx* cctx = ZSTD_createCCtx();
+    ZSTD_DCtx* dctx = ZSTD_createDCtx();
+    ~ZstdContext() { ZSTD_freeCCtx(cctx); ZSTD_freeDCtx(dctx); }
+};
+static thread_local ZstdContext zstd_context;
+#endif
+
+Codec getCodec(const std::string& name)
+{
+    if(name.empty() || name == "none") return Codec::None;
+    if(name == "lz4") return Codec::Lz4;
+    if(name == "zstd") return Codec::Zstd;
+    throw std::invalid_argument("unknown compression codec " + name);
+}
+
+const char* toString(Codec codec)
+{
+    switch (codec)
+    {
+    case Codec::Lz4:
+        return "lz4";
+    case Codec::Zstd:
+        return "zstd";
+    default:
+        return "none";
+    }
+}
+
+bool isAvailable(Codec codec)
+{
+    switch (codec)
+    {
+    case Codec::None:
+        return true;
+#ifdef TCP_HAS_LZ4
+    case Codec::Lz4:
+        return true;
+#endif
+#ifdef TCP_HAS_ZSTD
+    case Codec::Zstd:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+Compressor::Compressor(const CompressionConfig& config_)
+    : config(config_), dictionary_id(0), lz4_dictionary(nullptr), zstd_cdict(nullptr), zstd_ddict(nullptr),
+      compressed_messages(0), skipped_messages(0), uncompressed_bytes(0), compressed_bytes(0),
+      decompressed_messages(0), compress_ns(0), decompress_ns(0)
+{
+    std::string function_id = getFunctionId(__func__, "Compressor");
+
+    if(!isAvailable(config.codec))
+    {
+        throw std::runtime_error(std::string("codec ") + toString(config.codec) + " is not compiled in");
+    }
+
+    if(config.dictionary_file.empty()) return;
+
+    std::ifstream file(config.dictionary_file, std::ios::binary);
+    if(!file)
+    {
+        throw std::runtime_error("cannot open compression dictionary " + config.dictionary_file);
+    }
+    dictionary.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    if(dictionary.empty())
+    {
+        throw std::runtime_error("compression dictionary " + config.dictionary_file + " is empty");
+    }
+    dictionary_id = getDictionaryHash(dictionary);
+
+#ifdef TCP_HAS_LZ4
+    if(config.codec == Codec::Lz4)
+    {
+        int size = 0;
+        const char* window = getLz4Window(dictionary, size);
+        LZ4_stream_t* stream = LZ4_createStream();
+        LZ4_loadDict(stream, window, size);
+        lz4_dictionary = stream;
+    }
+#endif
+#ifdef TCP_HAS_ZSTD
+    if(config.codec == Codec::Zstd)
+    {
+        int level = config.level ? config.level : ZSTD_CLEVEL_DEFAULT;
+        zstd_cdict = ZSTD_createCDict(dictionary.data(), dictionary.size(), level);
+        zstd_ddict = ZSTD_createDDict(dictionary.data(), dictionary.size());
+    }
+#endif
+
+    LOG_DEBUG << function_id << " Loaded " << dictionary.size() << " bytes dictionary " << config.dictionary_file
+              << " (id " << dictionary_id << ")";
+}
+
+Compressor::~Compressor()
+{
+#ifdef TCP_HAS_LZ4
+    LZ4_freeStream(static_cast<LZ4_stream_t*>(lz4_dictionary));
+#endif
+#ifdef TCP_HAS_ZSTD
+    ZSTD_freeCDict(static_cast<ZSTD_CDict*>(zstd_cdict));
+    ZSTD_freeDDict(static_cast<ZSTD_DDict*>(zstd_ddict));
+#endif
+}
+
+Codec Compressor::getCodec() const
+{
+    return config.codec;
+}
+
+uint32_t Compressor::getDictionaryId() const
+{
+    return dictionary_id;
+}
+
+void Compressor::encode(Codec codec_, const uint8_t* data, size_t bytes, Payload& frame_)
+{
+    FrameHeader header = {};
+    header.raw_length = (uint32_t)bytes;
+    size_t start = frame_.size();
+
+    if(codec_ != Codec::None && bytes >= config.threshold)
+    {
+        size_t capacity = bound(codec_, bytes);
+        frame_.resize(start + sizeof(header) + capacity);
+
+        uint64_t begin = threadCpuTimeNs();
+        size_t compressed = compress(codec_, data, bytes, frame_.data() + start + sizeof(header), capacity);
+        compress_ns += threadCpuTimeNs() - begin;
+
+        if(compressed > 0 && compressed < bytes)
+        {
+            header.length = (uint32_t)compressed;
+            header.flags = FrameCompressed;
+            std::memcpy(frame_.data() + start, &header, sizeof(header));
+            frame_.resize(start + sizeof(header) + compressed);
+
+            ++compressed_messages;
+            uncompressed_bytes += bytes;
+            compressed_bytes += compressed;
+            return;
+        }
+    }
+
+    ++skipped_messages;
+    header.length = (uint32_t)bytes;
+    frame_.resize(start + sizeof(header) + bytes);
+    std::memcpy(frame_.data() + start, &header, sizeof(header));
+    std::memcpy(frame_.data() + start + sizeof(header), data, bytes);
+}
+
+bool Compressor::decode(Codec codec_, const FrameHeader& header, const uint8_t* body, Payload& rxBuffer_)
+{
+    if(!(header.flags & FrameCompressed))
+    {
+        rxBuffer_.assign(body, body + header.length);
+        return true;
+    }
+
+    if(header.raw_length > max_frame_length) return false;
+    rxBuffer_.resize(header.raw_length);
+
+    uint64_t begin = threadCpuTimeNs();
+    bool decoded = false;
+    switch (codec_)
+    {
+#ifdef TCP_HAS_LZ4
+    case Codec::Lz4:
+    {
+        int size = 0;
+        const char* window = getLz4Window(dictionary, size);
+        int result = lz4_dictionary
+            ? LZ4_decompress_safe_usingDict(reinterpret_cast<const char*>(body), reinterpret_cast<char*>(rxBuffer_.data()),
+                                            (int)header.length, (int)header.raw_length, window, size)
+            : LZ4_decompress_safe(reinterpret_cast<const char*>(body), reinterpret_cast<char*>(rxBuffer_.data()),
+                                  (int)header.length, (int)header.raw_length);
+        decoded = (result == (int)header.raw_length);
+        break;
+    }
+#endif
+#ifdef TCP_HAS_ZSTD
+    case Codec::Zstd:
+    {
+        size_t result = zstd_ddict
+            ? ZSTD_decompress_usingDDict(zstd_context.dctx, rxBuffer_.data(), rxBuffer_.size(), body, header.length,
+                                         static_cast<const ZSTD_DDict*>(zstd_ddict))
+            : ZSTD_decompressDCtx(zstd_context.dctx, rxBuffer_.data(), rxBuffer_.size(), body, header.length);
+        decoded = !ZSTD_isError(result) && result == header.raw_length;
+        break;
+    }
+#endif
+    default:
+        break;
+    }
+    decompress_ns += threadCpuTimeNs() - begin;
+
+    if(decoded)
+    {
+        ++decompressed_messages;
+    }
+    return decoded;
+}
+
+CompressionStats Compressor::getStats() const
+{
+    CompressionStats stats;
+    stats.compressed_messages = compressed_messages;
+    stats.skipped_messages = skipped_messages;
+    stats.uncompressed_bytes = uncompressed_bytes;
+    stats.compressed_bytes = compressed_bytes;
+    stats.decompressed_messages = decompressed_messages;
+    stats.compress_cpu_time = std::chrono::nanoseconds(compress_ns);
+    stats.decompress_cpu_time = std::chrono::nanoseconds(decompress_ns);
+    return stats;
+}
+
+size_t Compressor::compress(Codec codec_, const uint8_t* data, size_t bytes, uint8_t* out, size_t capacity)
+{
+    switch (codec_)
+    {
+#ifdef TCP_HAS_LZ4
+    case Codec::Lz4:
+    {
+        int acceleration = config.level ? config.level : 1;
+        if(lz4_dictionary)
+        {
+#if TCP_LZ4_ATTACH_DICTIONARY
+            // the prepared dictionary stream is referenced, not copied or rebuilt
+            LZ4_resetStream_fast(&lz4_context.stream);
+            LZ4_attach_dictionary(&lz4_context.stream, static_cast<const LZ4_stream_t*>(lz4_dictionary));
+#else
+            int size = 0;
+            const char* window = getLz4Window(dictionary, size);
+            LZ4_loadDict(&lz4_context.stream, window, size);
+#endif
+            return (size_t)std::max(0, LZ4_compress_fast_continue(&lz4_context.stream, reinterpret_cast<const char*>(data),
+                                                                  reinterpret_cast<char*>(out), (int)bytes, (int)capacity, acceleration));
+        }
+        return (size_t)std::max(0, LZ4_compress_fast(reinterpret_cast<const char*>(data), reinterpret_cast<char*>(out),
+                                                     (int)bytes, (int)capacity, acceleration));
+    }
+#endif
+#ifdef TCP_HAS_ZSTD
+    case Codec::Zstd:
+    {
+        size_t result = zstd_cdict
+            ? ZSTD_compress_usingCDict(zstd_context.cctx, out, capacity, data, bytes, static_cast<const ZSTD_CDict*>(zstd_cdict))
+            : ZSTD_compressCCtx(zstd_context.cctx, out, capacity, data, bytes, config.level ? config.level : ZSTD_CLEVEL_DEFAULT);
+        return ZSTD_isError(result) ? 0 : result;
+    }
+#endif
+    default:
+        // nothing to compress with, also when no codec library is built in
+        (void)data;
+        (void)bytes;
+        (void)out;
+        (void)capacity;
+        return 0;
+    }
+}
+
+size_t Compressor::bound(Codec codec_, size_t bytes)
+{
+    switch (codec_)
+    {
+#ifdef TCP_HAS_LZ4
+    case Codec::Lz4:
+        return LZ4_compressBound((int)bytes);
+#endif
+#ifdef TCP_HAS_ZSTD
+    case Codec::Zstd:
+        return ZSTD_compressBound(bytes);
+#endif
+    default:
+        return bytes;
+    }
+}
+
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include "types.hpp"
+#include "framing.hpp"
+
+namespace tcp
+{
+
+// Codecs are compiled in when CMake finds the library (TCP_HAS_LZ4 / TCP_HAS_ZSTD),
+// values double as bits of the Hello offer mask
+enum class Codec : uint8_t
+{
+    None = 0x00,
+    Lz4 = 0x01,
+    Zstd = 0x02
+};
+
+struct CompressionConfig
+{
+    Codec codec = Codec::None;
+    size_t threshold = 256;         // smaller payloads are framed but sent as they are
+    int level = 0;                  // 0 = codec default (zstd level, lz4 acceleration)
+    std::string dictionary_file;    // both peers must use the same one, otherwise the connection stays uncompressed
+};
+
+struct CompressionStats
+{
+    uint64_t compressed_messages = 0;
+    uint64_t skipped_messages = 0;          // below threshold or did not shrink
+    uint64_t uncompressed_bytes = 0;        // input of the compressed messages
+    uint64_t compressed_bytes = 0;
+    uint64_t decompressed_messages = 0;
+    std::chrono::nanoseconds compress_cpu_time{0};
+    std::chrono::nanoseconds decompress_cpu_time{0};
+
+    double ratio() const { return compressed_bytes ? (double)uncompressed_bytes / compressed_bytes : 1.0; }
+};
+
+Codec getCodec(const std::string& name);    // "none", "lz4" or "zstd", throws std::invalid_argument
+const char* toString(Codec codec);
+bool isAvailable(Codec codec);
+
+// Shared by every connection of a Server (or by one Client), thread safe.
+// Contexts are thread local, dictionaries are prepared once.
+class Compressor
+{
+public:
+// throws std::runtime_error if the dictionary cannot be loaded
+explicit Compressor(const CompressionConfig& config_);
+~Compressor();
+
+Codec getCodec() const;
+uint32_t getDictionaryId() const;
+
+// appends one frame to frame_, compressed with codec_ when that is worth it
+void encode(Codec codec_, const uint8_t* data, size_t bytes, Payload& frame_);
+// false for a corrupt body
+bool decode(Codec codec_, const FrameHeader& header, const uint8_t* body, Payload& rxBuffer_);
+
+CompressionStats getStats() const;
+
+private:
+    const CompressionConfig config;
+    Payload dictionary;
+    uint32_t dictionary_id;
+    void* lz4_dictionary;   // LZ4_stream_t with the dictionary loaded once, attached to the thread's stream per compression
+                            // (lz4 before 1.10 loads the window into it again instead, see compress())
+    void* zstd_cdict;       // ZSTD_CDict
+    void* zstd_ddict;       // ZSTD_DDict
+
+    std::atomic<uint64_t> compressed_messages;
+    std::atomic<uint64_t> skipped_messages;
+    std::atomic<uint64_t> uncompressed_bytes;
+    std::atomic<uint64_t> compressed_bytes;
+    std::atomic<uint64_t> decompressed_messages;
+    std::atomic<uint64_t> compress_ns;
+    std::atomic<uint64_t> decompress_ns;
+
+    size_t compress(Codec codec_, const uint8_t* data, size_t bytes, uint8_t* out, size_t capacity);
+    static size_t bound(Codec codec_, size_t bytes);
+};
+
+}
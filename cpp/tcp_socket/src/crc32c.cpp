@@ -0,0 +1,267 @@
+#include "crc32c.hpp"
+
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+namespace tcp
+{
+
+namespace
+{
+
+// reflected Castagnoli polynomial
+constexpr uint32_t polynomial = 0x82f63b78;
+
+// the hardware paths run this many bytes through each of three streams before joining them,
+// long blocks while there is room for them, short ones for the rest
+constexpr size_t long_block = 4096;
+constexpr size_t short_block = 256;
+
+inline uint64_t read64(const uint8_t* data)
+{
+    uint64_t value;
+    std::memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+inline uint32_t read32(const uint8_t* data)
+{
+    uint32_t value;
+    std::memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+// a * b modulo the polynomial, both reflected (bit 31 is x^0)
+uint32_t multiplyModP(uint32_t a, uint32_t b)
+{
+    uint32_t m = 1u << 31;
+    uint32_t product = 0;
+    while(true)
+    {
+        if(a & m)
+        {
+            product ^= b;
+            if((a & (m - 1)) == 0) break;
+        }
+        m >>= 1;
+        b = (b & 1) ? (b >> 1) ^ polynomial : b >> 1;
+    }
+    return product;
+}
+
+// x^(8 * bytes) modulo the polynomial: multiplying a crc by it appends bytes zero bytes
+uint32_t shiftFor(size_t bytes)
+{
+    uint32_t square = 1u << 30;     // x^1
+    uint32_t result = 1u << 31;     // x^0
+    // x^(8 * bytes) = product of x^(2^k) over the set bits k of 8 * bytes
+    for(uint64_t bits = (uint64_t)bytes * 8; bits; bits >>= 1)
+    {
+        if(bits & 1)
+        {
+            result = multiplyModP(square, result);
+        }
+        square = multiplyModP(square, square);
+    }
+    return result;
+}
+
+struct Crc32cTables
+{
+    uint32_t slices[8][256];
+    // x^(8 * block) and x^(16 * block), to join three streams of block bytes each
+    uint32_t long_shift[2];
+    uint32_t short_shift[2];
+
+    Crc32cTables()
+    {
+        for(uint32_t i = 0; i < 256; ++i)
+        {
+            uint32_t crc = i;
+            for(int bit = 0; bit < 8; ++bit)
+            {
+                crc = (crc & 1) ? (crc >> 1) ^ polynomial : crc >> 1;
+            }
+            slices[0][i] = crc;
+        }
+        for(uint32_t i = 0; i < 256; ++i)
+        {
+            for(int slice = 1; slice < 8; ++slice)
+            {
+                slices[slice][i] = (slices[slice - 1][i] >> 8) ^ slices[0][slices[slice - 1][i] & 0xff];
+            }
+        }
+
+        long_shift[0] = shiftFor(long_block);
+        long_shift[1] = shiftFor(2 * long_block);
+        short_shift[0] = shiftFor(short_block);
+        short_shift[1] = shiftFor(2 * short_block);
+    }
+};
+
+const Crc32cTables tables;
+
+// all of these take and return the crc register, before the final inversion
+uint32_t updatePortable(uint32_t crc, const uint8_t* data, size_t bytes)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    // slicing by 8: one table lookup per byte, eight of them independent
+    for(; bytes >= 8; bytes -= 8, data += 8)
+    {
+        uint32_t low = crc ^ read32(data);
+        uint32_t high = read32(data + 4);
+        crc = tables.slices[7][low & 0xff] ^ tables.slices[6][(low >> 8) & 0xff] ^
+              tables.slices[5][(low >> 16) & 0xff] ^ tables.slices[4][low >> 24] ^
+              tables.slices[3][high & 0xff] ^ tables.slices[2][(high >> 8) & 0xff] ^
+              tables.slices[1][(high >> 16) & 0xff] ^ tables.slices[0][high >> 24];
+    }
+#endif
+    for(; bytes > 0; --bytes, ++data)
+    {
+        crc = (crc >> 8) ^ tables.slices[0][(crc ^ *data) & 0xff];
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+
+// carry-less a * b with the hardware, reduced by the crc32 instruction (a and b reflected, as multiplyModP)
+__attribute__((target("sse4.2,pclmul")))
+inline uint32_t multiplyModPClmul(uint32_t a, uint32_t b)
+{
+    __m128i product = _mm_clmulepi64_si128(_mm_cvtsi32_si128((int)a), _mm_cvtsi32_si128((int)b), 0x00);
+    // the reflected 63 bit product is one bit short of the 64 bits the reduction expects
+    product = _mm_slli_epi64(product, 1);
+    uint64_t value = (uint64_t)_mm_cvtsi128_si64(product);
+    return _mm_crc32_u32(0, (uint32_t)value) ^ (uint32_t)(value >> 32);
+}
+
+// crc32 has a latency of three cycles and a throughput of one, three independent streams keep it busy;
+// a stream that starts at 0 is joined by shifting the crc of everything before it over its bytes
+__attribute__((target("sse4.2,pclmul")))
+inline uint64_t updateStreams(uint64_t crc, const uint8_t*& data, size_t& bytes, size_t block, const uint32_t* shift)
+{
+    while(bytes >= 3 * block)
+    {
+        uint64_t crc1 = 0;
+        uint64_t crc2 = 0;
+        for(size_t offset = 0; offset < block; offset += 8)
+        {
+            crc = _mm_crc32_u64(crc, read64(data + offset));
+            crc1 = _mm_crc32_u64(crc1, read64(data + block + offset));
+            crc2 = _mm_crc32_u64(crc2, read64(data + 2 * block + offset));
+        }
+        crc = multiplyModPClmul(shift[1], (uint32_t)crc) ^ multiplyModPClmul(shift[0], (uint32_t)crc1) ^ crc2;
+        data += 3 * block;
+        bytes -= 3 * block;
+    }
+    return crc;
+}
+
+__attribute__((target("sse4.2,pclmul")))
+uint32_t updateSse42(uint32_t crc32, const uint8_t* data, size_t bytes)
+{
+    uint64_t crc = crc32;
+    for(; bytes > 0 && ((uintptr_t)data & 7); --bytes, ++data)
+    {
+        crc = _mm_crc32_u8((uint32_t)crc, *data);
+    }
+
+    crc = updateStreams(crc, data, bytes, long_block, tables.long_shift);
+    crc = updateStreams(crc, data, bytes, short_block, tables.short_shift);
+
+    for(; bytes >= 8; bytes -= 8, data += 8)
+    {
+        crc = _mm_crc32_u64(crc, read64(data));
+    }
+    for(; bytes > 0; --bytes, ++data)
+    {
+        crc = _mm_crc32_u8((uint32_t)crc, *data);
+    }
+    return (uint32_t)crc;
+}
+
+#elif defined(__aarch64__)
+
+// a single stream: the instruction is fast enough on its own for the message sizes sent here
+__attribute__((target("+crc")))
+uint32_t updateArmv8(uint32_t crc, const uint8_t* data, size_t bytes)
+{
+    for(; bytes > 0 && ((uintptr_t)data & 7); --bytes, ++data)
+    {
+        crc = __crc32cb(crc, *data);
+    }
+    for(; bytes >= 32; bytes -= 32, data += 32)
+    {
+        crc = __crc32cd(crc, read64(data));
+        crc = __crc32cd(crc, read64(data + 8));
+        crc = __crc32cd(crc, read64(data + 16));
+        crc = __crc32cd(crc, read64(data + 24));
+    }
+    for(; bytes >= 8; bytes -= 8, data += 8)
+    {
+        crc = __crc32cd(crc, read64(data));
+    }
+    for(; bytes > 0; --bytes, ++data)
+    {
+        crc = __crc32cb(crc, *data);
+    }
+    return crc;
+}
+
+#endif
+
+using Update = uint32_t (*)(uint32_t crc, const uint8_t* data, size_t bytes);
+
+struct Implementation
+{
+    Update update;
+    const char* name;
+};
+
+Implementation select()
+{
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("pclmul"))
+    {
+        return {updateSse42, "sse4.2+pclmul"};
+    }
+#elif defined(__aarch64__)
+    if(getauxval(AT_HWCAP) & HWCAP_CRC32)
+    {
+        return {updateArmv8, "armv8-crc"};
+    }
+#endif
+    return {updatePortable, "portable"};
+}
+
+// after tables, which the x86_64 path needs
+const Implementation implementation = select();
+
+}
+
+uint32_t crc32c(const uint8_t* data, size_t bytes, uint32_t crc)
+{
+    return ~implementation.update(~crc, data, bytes);
+}
+
+uint32_t crc32cPortable(const uint8_t* data, size_t bytes, uint32_t crc)
+{
+    return ~updatePortable(~crc, data, bytes);
+}
+
+const char* getCrc32cImplementation()
+{
+    return implementation.name;
+}
+
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace tcp
+{
+
+// CRC32C (Castagnoli) of bytes bytes, continuing crc (the result of an earlier call over the bytes before them,
+// 0 to start). Uses the SSE4.2 crc32 instruction on x86_64 (three interleaved streams, joined with PCLMULQDQ)
+// or the ARMv8 CRC instructions when the CPU has them, tables otherwise; the choice is made once at startup.
+uint32_t crc32c(const uint8_t* data, size_t bytes, uint32_t crc = 0);
+// the table implementation crc32c() falls back to, same results (for comparisons)
+uint32_t crc32cPortable(const uint8_t* data, size_t bytes, uint32_t crc = 0);
+// "sse4.2+pclmul", "armv8-crc" or "portable"
+const char* getCrc32cImplementation();
+
+}
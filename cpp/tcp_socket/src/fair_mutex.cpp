@@ -0,0 +1,41 @@
+#include "fair_mutex.hpp"
+
+#include <thread>
+
+namespace tcp
+{
+
+void FairMutex::lock()
+{
+    static const uint32_t spins_allowed = std::thread::hardware_concurrency() > 1 ? spin_limit : 0;
+
+    uint64_t ticket = next_ticket.fetch_add(1);
+
+    for(uint32_t spins = 0; spins < spins_allowed; ++spins)
+    {
+        if(serving.load(std::memory_order_acquire) == ticket) return;
+        std::this_thread::yield();
+    }
+
+    // counted before the last check, so unlock() either sees us sleeping or we see our turn
+    std::unique_lock<std::mutex> lock(mutex);
+    ++sleeping;
+    turn_cvs[ticket % slots].wait(lock, [this, ticket](){ return serving.load() == ticket; });
+    --sleeping;
+}
+
+void FairMutex::unlock()
+{
+    uint64_t next = serving.load(std::memory_order_relaxed) + 1;
+    serving.store(next);
+
+    if(sleeping.load() == 0) return;
+
+    {
+        // a waiter between its check and its wait holds the mutex, taking it here keeps the wakeup from being lost
+        std::lock_guard<std::mutex> lock(mutex);
+    }
+    turn_cvs[next % slots].notify_all();
+}
+
+}
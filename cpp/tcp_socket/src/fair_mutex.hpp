@@ -0,0 +1,33 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <condition_variable>
+
+namespace tcp
+{
+
+// Ticket lock: waiters get the lock in arrival order. A thread that takes it again right after
+// releasing it queues behind everybody already waiting, so busy callers take turns (round-robin)
+// instead of the last releaser winning most of the time as with std::mutex.
+// A waiter spins briefly on its turn (not on a single CPU, where it would only hold up the owner), then sleeps on the slot of its ticket; unlock() wakes that one slot
+// (shared only by tickets a multiple of slots apart), not every waiter.
+class FairMutex
+{
+public:
+void lock();
+void unlock();
+
+private:
+    static constexpr size_t slots = 16;
+    static constexpr uint32_t spin_limit = 8;
+
+    std::atomic<uint64_t> next_ticket{0};
+    std::atomic<uint64_t> serving{0};
+    std::atomic<uint32_t> sleeping{0};
+    std::mutex mutex;
+    std::condition_variable turn_cvs[slots];
+};
+
+}
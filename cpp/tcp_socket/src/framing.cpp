@@ -0,0 +1,243 @@
+#include "framing.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include "crc32c.hpp"
+
+namespace tcp
+{
+
+static const char hello_magic[4] = {'T', 'C', 'P', 'F'};
+static const uint8_t hello_version = 1;
+// Codec::Lz4 | Codec::Zstd (compression.hpp), an answer carries one of them or 0
+static const uint8_t hello_codecs = 0x03;
+static const uint8_t hello_features = HelloChunks | HelloChecksums;
+
+Hello makeHello(uint8_t codecs, uint32_t dictionary_id, uint8_t features)
+{
+    Hello hello = {};
+    std::memcpy(hello.magic, hello_magic, sizeof(hello.magic));
+    hello.version = hello_version;
+    hello.codecs = codecs;
+    hello.features = features;
+    hello.dictionary_id = dictionary_id;
+    return hello;
+}
+
+void markChunk(uint8_t* frame_, uint8_t lane, bool more)
+{
+    FrameHeader header;
+    std::memcpy(&header, frame_, sizeof(header));
+    header.lane = lane;
+    if(more)
+    {
+        header.flags |= FrameMore;
+    }
+    std::memcpy(frame_, &header, sizeof(header));
+}
+
+void sealFrame(Payload& frame_, size_t start)
+{
+    FrameHeader header;
+    std::memcpy(&header, frame_.data() + start, sizeof(header));
+    size_t body_bytes = header.length;
+    // the header as it goes out is covered too, so a flipped flag or lane is caught as well
+    header.length += sizeof(uint32_t);
+    header.flags |= FrameChecksum;
+    std::memcpy(frame_.data() + start, &header, sizeof(header));
+
+    uint32_t checksum = crc32c(frame_.data() + start + sizeof(header), body_bytes,
+                               crc32c(reinterpret_cast<const uint8_t*>(&header), sizeof(header)));
+    frame_.insert(frame_.end(), reinterpret_cast<const uint8_t*>(&checksum), reinterpret_cast<const uint8_t*>(&checksum) + sizeof(checksum));
+}
+
+bool verifyFrame(FrameHeader& header_, const uint8_t* body)
+{
+    uint32_t checksum;
+    if(!(header_.flags & FrameChecksum) || header_.length < sizeof(checksum)) return false;
+
+    std::memcpy(&checksum, body + header_.length - sizeof(checksum), sizeof(checksum));
+    if(crc32c(body, header_.length - sizeof(checksum), crc32c(reinterpret_cast<const uint8_t*>(&header_), sizeof(header_))) != checksum)
+    {
+        return false;
+    }
+
+    header_.length -= sizeof(checksum);
+    return true;
+}
+
+// the fields of a Hello that are in data (at most a whole one), the missing ones read as 0
+static bool isHelloPrefix(const uint8_t* data, size_t bytes)
+{
+    Hello hello = {};
+    std::memcpy(&hello, data, bytes);
+    return std::memcmp(hello.magic, hello_magic, std::min(bytes, sizeof(hello_magic))) == 0 &&
+           (bytes <= offsetof(Hello, version) || hello.version == hello_version) &&
+           (hello.codecs & ~hello_codecs) == 0 && (hello.features & ~hello_features) == 0 && hello.reserved == 0;
+}
+
+bool isHello(const uint8_t* data, size_t bytes)
+{
+    return bytes >= sizeof(Hello) && isHelloPrefix(data, sizeof(Hello));
+}
+
+bool mayBeHello(const uint8_t* data, size_t bytes)
+{
+    return isHelloPrefix(data, std::min(bytes, sizeof(Hello)));
+}
+
+bool FrameReader::feed(const uint8_t* data, size_t bytes, const FrameCallback& callback)
+{
+    // fast path: whole frames straight from the caller buffer, only leftovers are copied
+    if(pending.empty())
+    {
+        while(bytes >= sizeof(FrameHeader))
+        {
+            FrameHeader header;
+            std::memcpy(&header, data, sizeof(header));
+            if(header.length > max_frame_length) return false;
+            if(bytes < sizeof(header) + header.length) break;
+
+            callback(header, data + sizeof(header));
+            data += sizeof(header) + header.length;
+            bytes -= sizeof(header) + header.length;
+        }
+
+        pending.assign(data, data + bytes);
+        release();
+        return true;
+    }
+
+    pending.insert(pending.end(), data, data + bytes);
+
+    size_t offset = 0;
+    while(pending.size() - offset >= sizeof(FrameHeader))
+    {
+        FrameHeader header;
+        std::memcpy(&header, pending.data() + offset, sizeof(header));
+        if(header.length > max_frame_length) return false;
+        if(pending.size() - offset < sizeof(header) + header.length) break;
+
+        callback(header, pending.data() + offset + sizeof(header));
+        offset += sizeof(header) + header.length;
+    }
+
+    pending.erase(pending.begin(), pending.begin() + offset);
+    release();
+    return true;
+}
+
+void FrameReader::reset()
+{
+    pending.clear();
+    release();
+}
+
+Payload FrameReader::takePending()
+{
+    Payload taken;
+    taken.swap(pending);
+    return taken;
+}
+
+void FrameReader::restorePending(Payload pending_)
+{
+    pending.swap(pending_);
+}
+
+size_t FrameReader::getBufferedBytes() const
+{
+    return pending.capacity();
+}
+
+void FrameReader::release()
+{
+    // an idle connection should not keep the room its largest frame once needed
+    if(pending.empty() && pending.capacity() > release_threshold)
+    {
+        Payload().swap(pending);
+    }
+}
+
+bool ChunkAssembler::add(const FrameHeader& header, Payload& message_, bool& corrupt_)
+{
+    corrupt_ = false;
+    if(header.lane == 0) return true;
+
+    if(dropping.count(header.lane))
+    {
+        if(!(header.flags & FrameMore))
+        {
+            dropping.erase(header.lane);
+        }
+        return false;
+    }
+
+    auto lane = partial.find(header.lane);
+    if(lane == partial.end())
+    {
+        if(!(header.flags & FrameMore)) return true;
+        // the first chunk, kept without a copy
+        partial[header.lane].swap(message_);
+        return false;
+    }
+
+    if(lane->second.size() + message_.size() > max_chunked_length)
+    {
+        corrupt_ = true;
+        return false;
+    }
+    lane->second.insert(lane->second.end(), message_.begin(), message_.end());
+    if(header.flags & FrameMore) return false;
+
+    message_.swap(lane->second);
+    partial.erase(lane);
+    return true;
+}
+
+void ChunkAssembler::drop(const FrameHeader& header)
+{
+    if(header.lane == 0) return;
+
+    partial.erase(header.lane);
+    if(header.flags & FrameMore)
+    {
+        dropping.insert(header.lane);
+    }
+    else
+    {
+        dropping.erase(header.lane);
+    }
+}
+
+void ChunkAssembler::reset()
+{
+    partial.clear();
+    dropping.clear();
+}
+
+void ChunkAssembler::takeState(std::map<uint8_t, Payload>& partial_, std::set<uint8_t>& dropping_)
+{
+    partial_.swap(partial);
+    dropping_.swap(dropping);
+    reset();
+}
+
+void ChunkAssembler::restoreState(std::map<uint8_t, Payload> partial_, std::set<uint8_t> dropping_)
+{
+    partial.swap(partial_);
+    dropping.swap(dropping_);
+}
+
+size_t ChunkAssembler::getBufferedBytes() const
+{
+    size_t bytes = 0;
+    for(auto& lane : partial)
+    {
+        bytes += lane.second.capacity();
+    }
+    return bytes;
+}
+
+}
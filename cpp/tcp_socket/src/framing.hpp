@@ -0,0 +1,118 @@
+#pragma once
+
+#include <functional>
+#include <map>
+#include <set>
+#include "types.hpp"
+
+namespace tcp
+{
+
+// Wire format once a connection negotiated framing (see Hello): every message is a FrameHeader
+// followed by length body bytes. Connections that never negotiated keep the raw byte stream.
+enum FrameFlags : uint8_t
+{
+    FrameCompressed = 0x01,    // body holds raw_length bytes compressed with the negotiated codec
+    FrameMore = 0x02,          // a chunk, the message goes on in the next frame of the same lane
+    FrameChecksum = 0x04       // the last 4 body bytes are the CRC32C of the header and the body bytes before them
+};
+
+struct FrameHeader
+{
+    uint32_t length;        // body bytes on the wire
+    uint32_t raw_length;    // body bytes after decompression
+    uint8_t flags;
+    uint8_t lane;           // 0 = a whole message, otherwise the lane of a chunked one (see lanes.hpp)
+    uint8_t reserved[2];
+};
+
+static_assert(sizeof(FrameHeader) == 12, "FrameHeader is part of the wire format");
+
+// larger frames are treated as a corrupt stream
+static constexpr size_t max_frame_length = 64 * 1024 * 1024;
+// larger chunked messages too
+static constexpr size_t max_chunked_length = 256 * 1024 * 1024;
+
+// marks the frame starting at frame_ as a chunk of a message sent on lane (> 0)
+void markChunk(uint8_t* frame_, uint8_t lane, bool more);
+// appends the checksum to the frame starting at start (the last one in frame_), after any markChunk()
+void sealFrame(Payload& frame_, size_t start);
+// false when the checksum is missing or does not match; otherwise header_.length no longer counts it
+bool verifyFrame(FrameHeader& header_, const uint8_t* body);
+
+struct IntegrityStats
+{
+    uint64_t verified_frames = 0;
+    uint64_t failed_frames = 0;     // dropped with their message
+};
+
+enum HelloFeatures : uint8_t
+{
+    HelloChunks = 0x01,     // large messages may arrive in chunks (FrameMore), interleaved with other lanes
+    HelloChecksums = 0x02   // every frame carries a checksum (FrameChecksum), in both directions
+};
+
+// First message of a client that wants framing, the server answers with the same structure
+// carrying the codec it picked (0 = framed but uncompressed).
+struct Hello
+{
+    char magic[4];
+    uint8_t version;
+    uint8_t codecs;         // offer: bit mask of codecs, answer: the selected codec
+    uint8_t features;       // HelloFeatures, offer: supported, answer: accepted
+    uint8_t reserved;
+    uint32_t dictionary_id; // 0 = no dictionary
+};
+
+static_assert(sizeof(Hello) == 12, "Hello is part of the wire format");
+
+Hello makeHello(uint8_t codecs, uint32_t dictionary_id, uint8_t features = 0);
+// every field is checked, not only the magic: a raw client may well start with "TCPF"
+bool isHello(const uint8_t* data, size_t bytes);
+// false once the first bytes of a stream can no longer be a Hello, true while they may still become one
+bool mayBeHello(const uint8_t* data, size_t bytes);
+
+// Reassembles frames from arbitrary stream chunks
+class FrameReader
+{
+public:
+using FrameCallback = std::function<void(const FrameHeader& header, const uint8_t* body)>;
+
+// false when the stream is corrupt, the connection should be dropped
+bool feed(const uint8_t* data, size_t bytes, const FrameCallback& callback);
+void reset();
+// the bytes of a frame not complete yet, the reader is empty afterwards (to carry them over a hot restart)
+Payload takePending();
+void restorePending(Payload pending_);
+// memory held for a partial frame
+size_t getBufferedBytes() const;
+
+private:
+    static constexpr size_t release_threshold = 64 * 1024;
+
+    Payload pending;
+
+    void release();
+};
+
+// Joins the chunks of messages sent over several frames, one partial message per lane
+class ChunkAssembler
+{
+public:
+// message_ holds a decoded frame body. True when it completes a message, which is then in message_,
+// false for a chunk that was kept or, with corrupt_ set, for a chunked message above max_chunked_length.
+bool add(const FrameHeader& header, Payload& message_, bool& corrupt_);
+// the frame could not be read (bad checksum): its message is lost, the chunks still to come on its lane are dropped
+void drop(const FrameHeader& header);
+void reset();
+// the messages in progress and the lanes being dropped, the assembler is empty afterwards (hot restart)
+void takeState(std::map<uint8_t, Payload>& partial_, std::set<uint8_t>& dropping_);
+void restoreState(std::map<uint8_t, Payload> partial_, std::set<uint8_t> dropping_);
+size_t getBufferedBytes() const;
+
+private:
+    std::map<uint8_t, Payload> partial;
+    std::set<uint8_t> dropping;
+};
+
+}
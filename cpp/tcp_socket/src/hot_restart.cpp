@@ -0,0 +1,426 @@
+#include "hot_restart.hpp"
+#include "framing.hpp"
+#include "logger.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+namespace tcp
+{
+
+namespace
+{
+
+const char handoff_magic[4] = {'T', 'C', 'P', 'R'};
+const uint8_t handoff_version = 1;
+
+// the old process may need a while to let its connections go quiet, it bounds that itself
+const int handoff_receive_timeout_seconds = 30;
+
+enum RecordKind : uint8_t
+{
+    RecordListener = 1,     // carries the listening socket
+    RecordConnection = 2,   // carries a connection, followed by its partial frame and lanes
+    RecordEnd = 3
+};
+
+enum RecordFlags : uint8_t
+{
+    RecordHelloPending = 0x01,
+    RecordFramed = 0x02
+};
+
+struct RecordHeader
+{
+    char magic[4];
+    uint8_t version;
+    uint8_t kind;
+    uint8_t flags;
+    uint8_t codec;
+    uint8_t features;
+    uint8_t reserved;
+    uint16_t port;
+    uint32_t dictionary_id;
+    uint32_t partial_frame_bytes;
+    uint32_t lanes;
+};
+
+static_assert(sizeof(RecordHeader) == 24, "RecordHeader is read by another build of the server");
+
+// one per partial chunked message or dropped lane, followed by bytes bytes of the message
+struct LaneHeader
+{
+    uint8_t lane;
+    uint8_t dropped;
+    uint8_t reserved[2];
+    uint32_t bytes;
+};
+
+static_assert(sizeof(LaneHeader) == 8, "LaneHeader is read by another build of the server");
+
+RecordHeader makeRecord(RecordKind kind)
+{
+    RecordHeader header = {};
+    std::memcpy(header.magic, handoff_magic, sizeof(header.magic));
+    header.version = handoff_version;
+    header.kind = kind;
+    return header;
+}
+
+void sendAll(int fd, const void* data, size_t bytes)
+{
+    const uint8_t* next = static_cast<const uint8_t*>(data);
+    while(bytes > 0)
+    {
+        ssize_t sent = ::send(fd, next, bytes, MSG_NOSIGNAL);
+        if(sent < 0)
+        {
+            if(errno == EINTR) continue;
+            throw std::runtime_error(std::string("hand-off send failed: ") + std::strerror(errno));
+        }
+        next += sent;
+        bytes -= (size_t)sent;
+    }
+}
+
+// header plus, when passed_fd >= 0, a copy of passed_fd for the receiver
+void sendRecord(int fd, const RecordHeader& header, int passed_fd)
+{
+    iovec iov = {const_cast<RecordHeader*>(&header), sizeof(header)};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if(passed_fd >= 0)
+    {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(sizeof(int));
+        std::memcpy(CMSG_DATA(cm), &passed_fd, sizeof(int));
+    }
+
+    ssize_t sent;
+    do
+    {
+        sent = ::sendmsg(fd, &msg, MSG_NOSIGNAL);
+    }
+    while(sent < 0 && errno == EINTR);
+    if(sent < 0)
+    {
+        throw std::runtime_error(std::string("hand-off sendmsg failed: ") + std::strerror(errno));
+    }
+    // the fd went with the first byte, the rest of the header is plain data
+    sendAll(fd, reinterpret_cast<const uint8_t*>(&header) + sent, sizeof(header) - (size_t)sent);
+}
+
+// fds that arrive with the data are added to passed_fds_
+void receiveAll(int fd, void* data, size_t bytes, std::vector<int>& passed_fds_)
+{
+    uint8_t* next = static_cast<uint8_t*>(data);
+    while(bytes > 0)
+    {
+        iovec iov = {next, bytes};
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * 4)];
+        msghdr msg = {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        ssize_t received = ::recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+        if(received < 0)
+        {
+            if(errno == EINTR) continue;
+            throw std::runtime_error(std::string("hand-off receive failed: ") + std::strerror(errno));
+        }
+
+        for(cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != nullptr; cm = CMSG_NXTHDR(&msg, cm))
+        {
+            if(cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) continue;
+            size_t count = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for(size_t i = 0; i < count; ++i)
+            {
+                int passed_fd;
+                std::memcpy(&passed_fd, CMSG_DATA(cm) + i * sizeof(int), sizeof(int));
+                passed_fds_.push_back(passed_fd);
+            }
+        }
+        if(received == 0)
+        {
+            throw std::runtime_error("hand-off closed by the old process");
+        }
+        next += received;
+        bytes -= (size_t)received;
+    }
+}
+
+sockaddr_un makeAddress(const std::string& path)
+{
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if(path.size() >= sizeof(address.sun_path))
+    {
+        throw std::runtime_error("hand-off path too long: " + path);
+    }
+    std::memcpy(address.sun_path, path.c_str(), path.size());
+    return address;
+}
+
+}
+
+void HandoffState::close()
+{
+    if(listener_fd >= 0)
+    {
+        ::close(listener_fd);
+        listener_fd = -1;
+    }
+    for(auto& connection : connections)
+    {
+        if(connection.fd >= 0)
+        {
+            ::close(connection.fd);
+            connection.fd = -1;
+        }
+    }
+}
+
+HandoffListener::HandoffListener(const std::string& path_, Handler handler_)
+    : path(path_), handler(std::move(handler_)), listen_fd(-1), wake_fd(-1), unlinked(false)
+{
+    sockaddr_un address = makeAddress(path);
+
+    listen_fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    wake_fd = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if(listen_fd < 0 || wake_fd < 0)
+    {
+        int error = errno;
+        if(listen_fd >= 0) ::close(listen_fd);
+        if(wake_fd >= 0) ::close(wake_fd);
+        throw std::runtime_error(std::string("hand-off socket failed: ") + std::strerror(error));
+    }
+
+    // left behind by a process that did not exit cleanly
+    ::unlink(path.c_str());
+    if(::bind(listen_fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || ::listen(listen_fd, 1) != 0)
+    {
+        int error = errno;
+        ::close(listen_fd);
+        ::close(wake_fd);
+        throw std::runtime_error("hand-off listen on " + path + " failed: " + std::strerror(error));
+    }
+
+    listen_thread = std::thread([this](){ run(); });
+}
+
+HandoffListener::~HandoffListener()
+{
+    uint64_t one = 1;
+    ssize_t ignored = ::write(wake_fd, &one, sizeof(one));
+    (void)ignored;
+    listen_thread.join();
+
+    ::close(listen_fd);
+    ::close(wake_fd);
+    // the successor may listen on the path by now
+    if(!unlinked)
+    {
+        ::unlink(path.c_str());
+    }
+}
+
+void HandoffListener::run()
+{
+    std::string function_id = getFunctionId(__func__, "HandoffListener");
+
+    pollfd fds[2] = {{listen_fd, POLLIN, 0}, {wake_fd, POLLIN, 0}};
+    while(true)
+    {
+        if(::poll(fds, 2, -1) < 0)
+        {
+            if(errno == EINTR) continue;
+            LOG_ERROR << function_id << " poll failed: " << std::strerror(errno);
+            return;
+        }
+        if(fds[1].revents & POLLIN) return;
+        if(!(fds[0].revents & POLLIN)) continue;
+
+        int successor_fd = ::accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if(successor_fd < 0) continue;
+
+        // the connected sockets go to whoever asks, only to a process of our own user
+        ucred peer = {};
+        socklen_t peer_length = sizeof(peer);
+        if(::getsockopt(successor_fd, SOL_SOCKET, SO_PEERCRED, &peer, &peer_length) != 0 || peer.uid != ::getuid())
+        {
+            LOG_WARNING << function_id << " Refusing the hand-off to pid " << peer.pid << " of uid " << peer.uid;
+            ::close(successor_fd);
+            continue;
+        }
+
+        ::unlink(path.c_str());
+        unlinked = true;
+
+        LOG_DEBUG << function_id << " Successor connected on " << path << ", handing off";
+        try
+        {
+            handler(successor_fd);
+        }
+        catch(const std::exception& e)
+        {
+            LOG_ERROR << function_id << " Hand-off failed: " << e.what();
+        }
+        ::close(successor_fd);
+        // one successor per process
+        return;
+    }
+}
+
+void sendHandoff(int successor_fd, const HandoffState& state)
+{
+    if(state.listener_fd >= 0)
+    {
+        sendRecord(successor_fd, makeRecord(RecordListener), state.listener_fd);
+    }
+
+    for(const auto& connection : state.connections)
+    {
+        RecordHeader header = makeRecord(RecordConnection);
+        header.flags = (connection.hello_pending ? RecordHelloPending : 0) | (connection.framed ? RecordFramed : 0);
+        header.codec = (uint8_t)connection.codec;
+        header.features = connection.features;
+        header.port = connection.port;
+        header.dictionary_id = connection.dictionary_id;
+        header.partial_frame_bytes = (uint32_t)connection.partial_frame.size();
+        header.lanes = (uint32_t)(connection.partial_messages.size() + connection.dropped_lanes.size());
+        sendRecord(successor_fd, header, connection.fd);
+
+        sendAll(successor_fd, connection.partial_frame.data(), connection.partial_frame.size());
+        for(const auto& message : connection.partial_messages)
+        {
+            LaneHeader lane = {message.first, 0, {0, 0}, (uint32_t)message.second.size()};
+            sendAll(successor_fd, &lane, sizeof(lane));
+            sendAll(successor_fd, message.second.data(), message.second.size());
+        }
+        for(uint8_t dropped : connection.dropped_lanes)
+        {
+            LaneHeader lane = {dropped, 1, {0, 0}, 0};
+            sendAll(successor_fd, &lane, sizeof(lane));
+        }
+    }
+
+    sendRecord(successor_fd, makeRecord(RecordEnd), -1);
+}
+
+bool requestHandoff(const std::string& path, HandoffState& state_)
+{
+    std::string function_id = getFunctionId(__func__);
+
+    state_ = HandoffState();
+    sockaddr_un address = makeAddress(path);
+    int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd < 0)
+    {
+        throw std::runtime_error(std::string("hand-off socket failed: ") + std::strerror(errno));
+    }
+    if(::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0)
+    {
+        int error = errno;
+        ::close(fd);
+        if(error == ENOENT || error == ECONNREFUSED) return false;
+        throw std::runtime_error("hand-off connect to " + path + " failed: " + std::strerror(error));
+    }
+
+    timeval timeout = {handoff_receive_timeout_seconds, 0};
+    ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    std::vector<int> passed_fds;
+    try
+    {
+        while(true)
+        {
+            RecordHeader header;
+            receiveAll(fd, &header, sizeof(header), passed_fds);
+            if(std::memcmp(header.magic, handoff_magic, sizeof(header.magic)) != 0 || header.version != handoff_version)
+            {
+                throw std::runtime_error("hand-off from an incompatible server");
+            }
+            if(header.kind == RecordEnd) break;
+
+            // exactly one fd came with the header
+            if(passed_fds.size() != 1)
+            {
+                throw std::runtime_error("hand-off record without its socket");
+            }
+            int passed_fd = passed_fds.front();
+            passed_fds.clear();
+
+            if(header.kind == RecordListener)
+            {
+                state_.listener_fd = passed_fd;
+                continue;
+            }
+
+            state_.connections.emplace_back();
+            HandedOffConnection& connection = state_.connections.back();
+            connection.fd = passed_fd;
+            connection.port = header.port;
+            connection.hello_pending = (header.flags & RecordHelloPending) != 0;
+            connection.framed = (header.flags & RecordFramed) != 0;
+            connection.codec = (Codec)header.codec;
+            connection.dictionary_id = header.dictionary_id;
+            connection.features = header.features;
+
+            // the sizes come from another process, bound them as the frame reader and the assembler do
+            if(header.partial_frame_bytes >= sizeof(FrameHeader) + max_frame_length || header.lanes > 2 * 256)
+            {
+                throw std::runtime_error("hand-off record out of bounds");
+            }
+            connection.partial_frame.resize(header.partial_frame_bytes);
+            receiveAll(fd, connection.partial_frame.data(), connection.partial_frame.size(), passed_fds);
+            for(uint32_t i = 0; i < header.lanes; ++i)
+            {
+                LaneHeader lane;
+                receiveAll(fd, &lane, sizeof(lane), passed_fds);
+                if(lane.dropped)
+                {
+                    connection.dropped_lanes.insert(lane.lane);
+                    continue;
+                }
+                if(lane.bytes > max_chunked_length)
+                {
+                    throw std::runtime_error("hand-off record out of bounds");
+                }
+                Payload& message = connection.partial_messages[lane.lane];
+                message.resize(lane.bytes);
+                receiveAll(fd, message.data(), message.size(), passed_fds);
+            }
+        }
+    }
+    catch(const std::exception&)
+    {
+        for(int passed_fd : passed_fds)
+        {
+            ::close(passed_fd);
+        }
+        state_.close();
+        ::close(fd);
+        throw;
+    }
+
+    ::close(fd);
+    LOG_DEBUG << function_id << " Took over " << ((state_.listener_fd >= 0) ? "the listening socket and " : "")
+             << state_.connections.size() << " connections from " << path;
+    return true;
+}
+
+}
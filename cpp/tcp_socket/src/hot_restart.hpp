@@ -0,0 +1,73 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include "types.hpp"
+#include "compression.hpp"
+
+namespace tcp
+{
+
+// One live connection a server passes to its successor, with what it read of it but could not deliver yet
+struct HandedOffConnection
+{
+    int fd = -1;
+    uint16_t port = 0;
+    bool hello_pending = true;      // the first data may still be a Hello
+    bool framed = false;
+    Codec codec = Codec::None;
+    uint32_t dictionary_id = 0;
+    uint8_t features = 0;           // HelloFeatures negotiated
+    Payload partial_frame;          // bytes of a frame that is not complete yet, or of a Hello while hello_pending
+    std::map<uint8_t, Payload> partial_messages;    // chunked messages by lane (see ChunkAssembler)
+    std::set<uint8_t> dropped_lanes;                // lanes whose current message is being dropped
+};
+
+// What a hot restart hands over: the listening socket and the connections that can move (TCP or unix sockets
+// without TLS). Kernel socket buffers move with the fds, so nothing queued there is lost either way.
+struct HandoffState
+{
+    int listener_fd = -1;
+    std::vector<HandedOffConnection> connections;
+
+    // closes every fd still held (the ones not sent or adopted)
+    void close();
+};
+
+// Old process: waits on a unix socket at path for its successor. handler_ runs on a thread of its own, once,
+// with the connected successor: it hands the server off with sendHandoff(). The path is removed before the
+// handler runs, so the successor can listen on it for the next restart.
+class HandoffListener
+{
+public:
+using Handler = std::function<void(int successor_fd)>;
+
+// throws std::runtime_error if the socket can not be created, a stale socket file at path is replaced
+HandoffListener(const std::string& path_, Handler handler_);
+~HandoffListener();
+
+private:
+    std::string path;
+    Handler handler;
+    int listen_fd;
+    int wake_fd;
+    std::atomic<bool> unlinked;
+    std::thread listen_thread;
+
+    void run();
+};
+
+// Old process: sends state over the connected unix socket (fds as SCM_RIGHTS), throws std::runtime_error on failure.
+// The fds stay open here, the successor gets copies of its own.
+void sendHandoff(int successor_fd, const HandoffState& state);
+
+// New process: false when no server waits at path (first start, or the old one is gone), then state_ is empty;
+// throws std::runtime_error when one answers but the transfer breaks off
+bool requestHandoff(const std::string& path, HandoffState& state_);
+
+}
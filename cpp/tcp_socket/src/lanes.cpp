@@ -0,0 +1,112 @@
+#include <algorithm>
+#include "lanes.hpp"
+
+namespace tcp
+{
+
+OutboundLanes::OutboundLanes() : queued_bytes(0)
+{
+
+}
+
+OutboundLanes::Ticket OutboundLanes::push(Priority priority, std::vector<Frame> frames)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    Lane& lane = lanes[(size_t)priority];
+    for(auto& frame : frames)
+    {
+        queued_bytes += frame->size();
+        lane.frames.push_back(std::move(frame));
+    }
+    lane.pushed += frames.size();
+    return {priority, lane.pushed};
+}
+
+bool OutboundLanes::next(Frame& frame)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    for(Lane& lane : lanes)
+    {
+        if(lane.frames.empty()) continue;
+
+        frame = std::move(lane.frames.front());
+        lane.frames.pop_front();
+        ++lane.taken;
+        queued_bytes -= frame->size();
+        return true;
+    }
+    return false;
+}
+
+bool OutboundLanes::done(const Ticket& ticket) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return lanes[(size_t)ticket.priority].taken >= ticket.sequence;
+}
+
+bool OutboundLanes::empty() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return queued_bytes == 0;
+}
+
+void OutboundLanes::clear()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    for(Lane& lane : lanes)
+    {
+        lane.frames.clear();
+        lane.taken = lane.pushed;
+    }
+    queued_bytes = 0;
+}
+
+size_t OutboundLanes::getQueuedBytes() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return queued_bytes;
+}
+
+std::vector<OutboundLanes::Frame> makeFrames(Compressor* compressor, Codec codec, bool chunked, bool checksummed,
+                                             Priority priority, const uint8_t* data, size_t bytes)
+{
+    std::vector<OutboundLanes::Frame> frames;
+    if(!compressor)
+    {
+        frames.push_back(std::make_shared<const Payload>(data, data + bytes));
+        return frames;
+    }
+
+    if(!chunked || bytes <= chunk_bytes)
+    {
+        std::shared_ptr<Payload> frame = std::make_shared<Payload>();
+        compressor->encode(codec, data, bytes, *frame);
+        if(checksummed)
+        {
+            sealFrame(*frame, 0);
+        }
+        frames.push_back(frame);
+        return frames;
+    }
+
+    // every chunk is a frame of its own, compressed on its own
+    frames.reserve((bytes + chunk_bytes - 1) / chunk_bytes);
+    for(size_t offset = 0; offset < bytes; offset += chunk_bytes)
+    {
+        size_t length = std::min(chunk_bytes, bytes - offset);
+        std::shared_ptr<Payload> frame = std::make_shared<Payload>();
+        compressor->encode(codec, data + offset, length, *frame);
+        markChunk(frame->data(), toLane(priority), offset + length < bytes);
+        if(checksummed)
+        {
+            sealFrame(*frame, 0);
+        }
+        frames.push_back(frame);
+    }
+    return frames;
+}
+
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "types.hpp"
+#include "compression.hpp"
+
+namespace tcp
+{
+
+// Priority class of an outbound message, every connection keeps one lane per class
+enum class Priority : uint8_t
+{
+    Control = 0,    // small latency sensitive messages, written first
+    Normal = 1,
+    Bulk = 2
+};
+
+static constexpr size_t priority_count = 3;
+
+// on connections that negotiated chunking (HelloChunks) larger messages are split into chunks of this size,
+// a message of a higher lane may go out between two of them
+static constexpr size_t chunk_bytes = 64 * 1024;
+
+// the wire lane of a chunked message (FrameHeader::lane), 0 is for whole messages
+inline uint8_t toLane(Priority priority) { return (uint8_t)priority + 1; }
+
+// Outbound lanes of one connection.
+//
+// Senders push the frames of a message on its lane and then take turns on the connection write lock:
+// each turn writes the frame next() hands out, which is the oldest of the highest lane. A sender returns once
+// its own frames are out, so a Control message waits for at most one frame of a Bulk transfer, whichever
+// thread writes it. next() and the write that follows must happen under the connection write lock, which
+// keeps the frames of a lane in order.
+class OutboundLanes
+{
+public:
+using Frame = std::shared_ptr<const Payload>;
+
+// position of a pushed message in its lane
+struct Ticket
+{
+    Priority priority;
+    uint64_t sequence;
+};
+
+OutboundLanes();
+
+Ticket push(Priority priority, std::vector<Frame> frames);
+// false when every lane is empty
+bool next(Frame& frame);
+// true once every frame of the message was handed out by next() or dropped
+bool done(const Ticket& ticket) const;
+bool empty() const;
+// drops every queued frame (broken connection, reconnect)
+void clear();
+size_t getQueuedBytes() const;
+
+private:
+    struct Lane
+    {
+        std::deque<Frame> frames;
+        uint64_t pushed = 0;
+        uint64_t taken = 0;
+    };
+
+    mutable std::mutex mutex;
+    Lane lanes[priority_count];
+    size_t queued_bytes;
+};
+
+// The frames of one message: one raw copy without a compressor (unframed connection), otherwise encoded
+// with codec and, when chunked, split into chunks of chunk_bytes marked with the lane of priority;
+// every frame sealed with a checksum when checksummed
+std::vector<OutboundLanes::Frame> makeFrames(Compressor* compressor, Codec codec, bool chunked, bool checksummed,
+                                             Priority priority, const uint8_t* data, size_t bytes);
+
+}
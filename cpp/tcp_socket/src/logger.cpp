@@ -34,31 +34,44 @@ namespace tcp
 
 std::string getFunctionId(const std::string& function_name, const std::string& class_name)
 {
-    std::stringstream log_id;
-    uint16_t thread_id = (uint16_t)std::hash<std::thread::id>{}(std::this_thread::get_id());
+    // built on every call of most functions, plain appends are much cheaper than a stringstream
+    static thread_local const std::string thread_id = std::to_string((uint16_t)std::hash<std::thread::id>{}(std::this_thread::get_id()));
 
-    std::string classIdColumn = (class_name.size() > 0) ? "::" : std::string();
-
-    // log_id << COLOR_CONTEXT << class_name << classIdColumn << function_name << "(" << (int)thread_id << ")" << COLOR_RESET;
-    log_id << COLOR_CONTEXT << class_name << classIdColumn << function_name << "(" << (int)thread_id << ")" << COLOR_RESET;
-    // log_id << class_name << classIdColumn << function_name << "(" << (int)thread_id << "): ";
+    std::string log_id;
+    log_id.reserve(sizeof(COLOR_CONTEXT) + class_name.size() + function_name.size() + thread_id.size() + sizeof(COLOR_RESET) + 4);
+    log_id += COLOR_CONTEXT;
+    if(class_name.size() > 0)
+    {
+        log_id += class_name;
+        log_id += "::";
+    }
+    log_id += function_name;
+    log_id += "(";
+    log_id += thread_id;
+    log_id += ")";
+    log_id += COLOR_RESET;
 
-    return log_id.str();
+    return log_id;
 }
 
 std::mutex Logger::mutex__;
 
-Logger::Logger(LogLevel level) : level_(level), std::ostream(&buffer_), when_(std::chrono::system_clock::now())
+Logger::Logger(LogLevel level, uint64_t suppressed) : std::ostream(&buffer_), level_(level), suppressed_(suppressed), when_(std::chrono::system_clock::now())
 {
 
 }
 
 Logger::~Logger()
 {
-    std::lock_guard<std::mutex> its_lock(mutex__);
-
     if(level_ > maxLevel_) return;
 
+    if(suppressed_ > 0)
+    {
+        buffer_.data_ << " (suppressed " << suppressed_ << " similar messages)";
+    }
+
+    std::lock_guard<std::mutex> its_lock(mutex__);
+
     // time stamp
     auto its_time_t = std::chrono::system_clock::to_time_t(when_);
     auto its_time = std::localtime(&its_time_t);
@@ -106,6 +119,45 @@ void Logger::setMaximumLogLevel(LogLevel level)
     maxLevel_ = level;
 }
 
+bool Logger::isEnabled(LogLevel level)
+{
+    return level <= maxLevel_;
+}
+
+LogSite::LogSite(uint32_t per_second_, uint32_t sample_every_)
+    : per_second(per_second_), sample_every(sample_every_ > 0 ? sample_every_ : 1), calls(0), window(0), window_lines(0), suppressed(0)
+{
+
+}
+
+bool LogSite::allow()
+{
+    if(sample_every > 1 && calls.fetch_add(1, std::memory_order_relaxed) % sample_every != 0)
+    {
+        suppressed.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    if(per_second == 0) return true;
+
+    int64_t now = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    int64_t current = window.load(std::memory_order_relaxed);
+    // one thread opens the new second, a line racing with it may count against either one
+    if(now != current && window.compare_exchange_strong(current, now, std::memory_order_relaxed))
+    {
+        window_lines.store(0, std::memory_order_relaxed);
+    }
+
+    if(window_lines.fetch_add(1, std::memory_order_relaxed) < per_second) return true;
+
+    suppressed.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+uint64_t LogSite::takeSuppressed()
+{
+    return suppressed.exchange(0, std::memory_order_relaxed);
+}
+
 
 std::streambuf::int_type Logger::buffer::overflow(std::streambuf::int_type c) {
     if (c != EOF) {
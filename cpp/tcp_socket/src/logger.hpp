@@ -6,6 +6,7 @@
 #include <streambuf>
 #include <thread>
 #include <mutex>
+#include <atomic>
 #include <chrono>
 #include <iomanip>
 
@@ -28,10 +29,13 @@ enum class LogLevel : uint8_t
 class Logger : public std::ostream
 {
 public:
-Logger(LogLevel level);
+// suppressed: lines the call site dropped before this one (see LogSite), reported at the end of the line
+Logger(LogLevel level, uint64_t suppressed = 0);
 ~Logger();
 
 static void setMaximumLogLevel(LogLevel level);
+// lets callers skip building messages that would be dropped anyway
+static bool isEnabled(LogLevel level);
 
 private:
     class buffer : public std::streambuf {
@@ -43,6 +47,7 @@ private:
     };
 
 LogLevel level_;
+uint64_t suppressed_;
 static LogLevel maxLevel_;
 buffer buffer_;
 std::chrono::system_clock::time_point when_;
@@ -50,9 +55,50 @@ static std::mutex mutex__;
 
 };
 
-#define LOG_DEBUG   tcp::Logger(tcp::LogLevel::DEBUG)
-#define LOG_WARNING tcp::Logger(tcp::LogLevel::WARNING)
-#define LOG_ERROR   tcp::Logger(tcp::LogLevel::ERROR)
+// State of one rate limited or sampled call site (see LOG_*_LIMITED and LOG_*_SAMPLED below).
+// Lock free, a line under the limit costs a clock read and a few relaxed atomics.
+class LogSite
+{
+public:
+// at most per_second_ lines per second (0 = no limit), of which only every sample_every_-th call is a candidate
+LogSite(uint32_t per_second_, uint32_t sample_every_ = 1);
+
+bool allow();
+// dropped since the last allowed line, resets the count
+uint64_t takeSuppressed();
+
+private:
+    const uint32_t per_second;
+    const uint32_t sample_every;
+    std::atomic<uint64_t> calls;
+    std::atomic<int64_t> window;    // steady clock second the count belongs to
+    std::atomic<uint32_t> window_lines;
+    std::atomic<uint64_t> suppressed;
+};
+
+// lines below the maximum log level are not even formatted
+#define TCP_LOG(level) \
+    if(!tcp::Logger::isEnabled(level)) {} else tcp::Logger(level)
+
+// one LogSite per call site; the first line let through after drops tells how many were dropped
+#define TCP_LOG_SITE(level, per_second, sample_every) \
+    if(!tcp::Logger::isEnabled(level)) {} \
+    else if(static tcp::LogSite tcp_log_site(per_second, sample_every); !tcp_log_site.allow()) {} \
+    else tcp::Logger(level, tcp_log_site.takeSuppressed())
+
+#define LOG_DEBUG   TCP_LOG(tcp::LogLevel::DEBUG)
+#define LOG_WARNING TCP_LOG(tcp::LogLevel::WARNING)
+#define LOG_ERROR   TCP_LOG(tcp::LogLevel::ERROR)
+
+// for lines that may fire once per message or per connection: at most per_second of them per second
+#define LOG_DEBUG_LIMITED(per_second)   TCP_LOG_SITE(tcp::LogLevel::DEBUG, per_second, 1)
+#define LOG_WARNING_LIMITED(per_second) TCP_LOG_SITE(tcp::LogLevel::WARNING, per_second, 1)
+#define LOG_ERROR_LIMITED(per_second)   TCP_LOG_SITE(tcp::LogLevel::ERROR, per_second, 1)
+
+// only every n-th call logs
+#define LOG_DEBUG_SAMPLED(n)    TCP_LOG_SITE(tcp::LogLevel::DEBUG, 0, n)
+#define LOG_WARNING_SAMPLED(n)  TCP_LOG_SITE(tcp::LogLevel::WARNING, 0, n)
+#define LOG_ERROR_SAMPLED(n)    TCP_LOG_SITE(tcp::LogLevel::ERROR, 0, n)
 
 
 }
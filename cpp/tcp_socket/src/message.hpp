@@ -0,0 +1,218 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include "types.hpp"
+
+namespace tcp
+{
+
+// Typed messages read and written in place over a Payload.
+//
+// A schema is a plain struct with fixed size fields, its layout is the wire layout:
+//
+//     struct Order
+//     {
+//         static constexpr uint16_t message_type = 1;
+//         static constexpr uint16_t message_version = 1;
+//
+//         uint64_t id;
+//         double price;
+//         uint32_t quantity;
+//         FixedString<12> symbol;
+//         Span note;              // variable length bytes after the struct
+//     };
+//
+// Receiving:  a Server/Client handler taking a MessageView<Order> (see BasicServer) reads the receive buffer in place,
+//                 Server server(ip, port, [](uint16_t clientPort, MessageView<Order> order){ use(order->price, order.str(order->note)); });
+//             or on any bytes: if(MessageView<Order> order = MessageView<Order>::from(data, bytes)) use(order->price);
+// Sending:    MessageBuilder<Order> order(*txBuffer_, 64); order->price = 1.5; order->note = order.append(text, size);
+//
+// Both peers must share the schema, byte order is the host one (little endian on every supported target).
+// Views need the whole message in one buffer: use them on framed connections (see framing.hpp),
+// a raw stream may hand a message to the handler in pieces.
+
+struct MessageHeader
+{
+    uint16_t type;
+    uint16_t version;
+    uint32_t length;    // schema struct + variable length area
+};
+
+static_assert(sizeof(MessageHeader) == 8, "MessageHeader is part of the wire format");
+
+// Reference to bytes in the variable length area, offsets are relative to the schema struct
+struct Span
+{
+    uint32_t offset;
+    uint32_t length;
+};
+
+template<size_t N>
+struct FixedString
+{
+    char data[N];
+
+    // not null terminated when the string uses all N bytes
+    std::string str() const { return std::string(data, strnlen(data, N)); }
+    void assign(const std::string& value)
+    {
+        std::memset(data, 0, N);
+        std::memcpy(data, value.data(), std::min(value.size(), N));
+    }
+};
+
+template<typename Schema>
+struct MessageSchema
+{
+    static_assert(std::is_trivially_copyable<Schema>::value && std::is_standard_layout<Schema>::value,
+                  "a message schema must be a plain struct");
+    static_assert(alignof(Schema) <= alignof(MessageHeader) * 2, "a message schema can not be aligned above 16 bytes");
+    static_assert(std::is_same<decltype(Schema::message_type), const uint16_t>::value, "a message schema needs a uint16_t message_type");
+    static_assert(std::is_same<decltype(Schema::message_version), const uint16_t>::value, "a message schema needs a uint16_t message_version");
+
+    // the schema struct starts right after the header, padded to its own alignment
+    static constexpr size_t offset = (sizeof(MessageHeader) + alignof(Schema) - 1) / alignof(Schema) * alignof(Schema);
+};
+
+// type of the message in data, false if it is too short to be a typed message
+inline bool peekMessageType(const uint8_t* data, size_t bytes, uint16_t& type_)
+{
+    if(bytes < sizeof(MessageHeader)) return false;
+
+    MessageHeader header;
+    std::memcpy(&header, data, sizeof(header));
+    type_ = header.type;
+    return true;
+}
+
+inline bool peekMessageType(const Payload& payload, uint16_t& type_)
+{
+    return peekMessageType(payload.data(), payload.size(), type_);
+}
+
+// Read-only view, valid as long as the underlying buffer is
+template<typename Schema>
+class MessageView
+{
+public:
+// empty view when the buffer holds another type/version, is truncated or misaligned
+static MessageView from(const uint8_t* data, size_t bytes)
+{
+    constexpr size_t offset = MessageSchema<Schema>::offset;
+
+    if(bytes < offset + sizeof(Schema)) return MessageView();
+    if(reinterpret_cast<uintptr_t>(data + offset) % alignof(Schema) != 0) return MessageView();
+
+    MessageHeader header;
+    std::memcpy(&header, data, sizeof(header));
+    if(header.type != Schema::message_type || header.version != Schema::message_version) return MessageView();
+    if(header.length < sizeof(Schema) || offset + header.length > bytes) return MessageView();
+
+    return MessageView(reinterpret_cast<const Schema*>(data + offset), header.length);
+}
+
+static MessageView from(const Payload& payload)
+{
+    return from(payload.data(), payload.size());
+}
+
+MessageView() : message(nullptr), length(0) {}
+
+explicit operator bool() const { return message != nullptr; }
+const Schema* operator->() const { return message; }
+const Schema& operator*() const { return *message; }
+
+// nullptr for a span outside the message
+const uint8_t* bytes(const Span& span) const
+{
+    if(span.length == 0 || span.offset < sizeof(Schema) || (uint64_t)span.offset + span.length > length) return nullptr;
+    return reinterpret_cast<const uint8_t*>(message) + span.offset;
+}
+
+std::string str(const Span& span) const
+{
+    const uint8_t* data = bytes(span);
+    return data ? std::string(reinterpret_cast<const char*>(data), span.length) : std::string();
+}
+
+private:
+    MessageView(const Schema* message_, uint32_t length_) : message(message_), length(length_) {}
+
+    const Schema* message;
+    uint32_t length;
+};
+
+// Schema of a handler whose call operator takes a MessageView<Schema> (after the client port on a server),
+// void for any other handler (a generic lambda, a std::function, one taking bytes)
+template<typename Function>
+struct MessageViewArgument { using type = void; };
+
+template<typename Result, typename Class, typename Schema>
+struct MessageViewArgument<Result (Class::*)(MessageView<Schema>)> { using type = Schema; };
+template<typename Result, typename Class, typename Schema>
+struct MessageViewArgument<Result (Class::*)(MessageView<Schema>) const> { using type = Schema; };
+template<typename Result, typename Class, typename Schema>
+struct MessageViewArgument<Result (Class::*)(uint16_t, MessageView<Schema>)> { using type = Schema; };
+template<typename Result, typename Class, typename Schema>
+struct MessageViewArgument<Result (Class::*)(uint16_t, MessageView<Schema>) const> { using type = Schema; };
+
+template<typename Handler, typename = void>
+struct HandlerSchema { using type = void; };
+
+template<typename Handler>
+struct HandlerSchema<Handler, std::void_t<decltype(&Handler::operator())>>
+{
+    using type = typename MessageViewArgument<decltype(&Handler::operator())>::type;
+};
+
+// Writes a message straight into buffer_ (which is cleared), fields are set through operator->.
+// The Payload can then be handed to Server::send()/Client::send() as it is.
+template<typename Schema>
+class MessageBuilder
+{
+public:
+// variable_capacity_ reserves room for append() so it does not reallocate (which would move the message)
+MessageBuilder(Payload& buffer_, size_t variable_capacity_ = 0) : buffer(buffer_)
+{
+    constexpr size_t offset = MessageSchema<Schema>::offset;
+
+    buffer.reserve(offset + sizeof(Schema) + variable_capacity_);
+    buffer.assign(offset + sizeof(Schema), 0);
+
+    MessageHeader header = {Schema::message_type, Schema::message_version, (uint32_t)sizeof(Schema)};
+    std::memcpy(buffer.data(), &header, sizeof(header));
+}
+
+Schema* operator->() { return message(); }
+Schema& operator*() { return *message(); }
+
+// copies data into the variable length area, store the result in a Span field
+Span append(const void* data, size_t bytes)
+{
+    constexpr size_t offset = MessageSchema<Schema>::offset;
+
+    Span span = {(uint32_t)(buffer.size() - offset), (uint32_t)bytes};
+    const uint8_t* begin = static_cast<const uint8_t*>(data);
+    buffer.insert(buffer.end(), begin, begin + bytes);
+
+    uint32_t length = (uint32_t)(buffer.size() - offset);
+    std::memcpy(buffer.data() + offsetof(MessageHeader, length), &length, sizeof(length));
+    return span;
+}
+
+Span append(const std::string& value)
+{
+    return append(value.data(), value.size());
+}
+
+private:
+    Payload& buffer;
+
+    Schema* message() { return reinterpret_cast<Schema*>(buffer.data() + MessageSchema<Schema>::offset); }
+};
+
+}
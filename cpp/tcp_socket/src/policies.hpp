@@ -0,0 +1,43 @@
+#pragma once
+
+#include <type_traits>
+#include "logger.hpp"
+
+namespace tcp
+{
+
+// Compile time policies of BasicServer (server.hpp) and BasicClient (client.hpp).
+//
+// LogPolicy decides whether the per-message path logs at all, connection level logs always follow Logger:
+//
+//     struct MyLog { static bool enabled(LogLevel level); };
+//
+// A constexpr false compiles the per-message logging away, including the copy of the payload it prints.
+
+// follows Logger::setMaximumLogLevel(), the default
+struct RuntimeLog
+{
+    static bool enabled(LogLevel level) { return Logger::isEnabled(level); }
+};
+
+struct NoLog
+{
+    static constexpr bool enabled(LogLevel) { return false; }
+};
+
+// Handlers that may be empty (std::function, function pointers) fall back to the default PING/PONG,
+// any other callable is always called
+template<typename Handler>
+bool isSet(const Handler& handler)
+{
+    if constexpr(std::is_constructible<bool, const Handler&>::value)
+    {
+        return static_cast<bool>(handler);
+    }
+    else
+    {
+        return true;
+    }
+}
+
+}
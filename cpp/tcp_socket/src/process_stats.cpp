@@ -0,0 +1,65 @@
+#include "process_stats.hpp"
+
+#include <fstream>
+#include <string>
+#include <dirent.h>
+#include <malloc.h>
+#include <unistd.h>
+
+namespace tcp
+{
+
+static size_t countOpenFds()
+{
+    DIR* directory = ::opendir("/proc/self/fd");
+    if(!directory) return 0;
+
+    size_t count = 0;
+    while(dirent* entry = ::readdir(directory))
+    {
+        if(entry->d_name[0] != '.') ++count;
+    }
+    ::closedir(directory);
+
+    // the descriptor opendir() used itself
+    return (count > 0) ? count - 1 : 0;
+}
+
+ProcessStats getProcessStats()
+{
+    ProcessStats stats;
+
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while(std::getline(status, line))
+    {
+        if(line.compare(0, 8, "Threads:") == 0)
+        {
+            stats.threads = std::stoul(line.substr(8));
+        }
+    }
+
+    // second field: resident pages
+    std::ifstream statm("/proc/self/statm");
+    size_t size_pages = 0;
+    size_t resident_pages = 0;
+    if(statm >> size_pages >> resident_pages)
+    {
+        stats.rss_bytes = resident_pages * (size_t)::sysconf(_SC_PAGESIZE);
+    }
+
+    stats.open_fds = countOpenFds();
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    struct mallinfo2 heap = ::mallinfo2();
+#else
+    // int fields, wrap above 2GiB
+    struct mallinfo heap = ::mallinfo();
+#endif
+    stats.heap_in_use_bytes = (size_t)heap.uordblks + (size_t)heap.hblkhd;
+    stats.heap_free_bytes = (size_t)heap.fordblks;
+
+    return stats;
+}
+
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstddef>
+
+namespace tcp
+{
+
+// Resource usage of this process, read from /proc and the allocator
+struct ProcessStats
+{
+    size_t threads = 0;
+    size_t open_fds = 0;
+    size_t rss_bytes = 0;
+    // glibc main arena (mallinfo), threads allocating from their own arenas only show up in rss
+    size_t heap_in_use_bytes = 0;   // malloc'ed and not freed yet
+    size_t heap_free_bytes = 0;     // held by the allocator for reuse, part of rss
+};
+
+ProcessStats getProcessStats();
+
+}
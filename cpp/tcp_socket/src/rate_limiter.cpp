@@ -0,0 +1,75 @@
+#include "rate_limiter.hpp"
+
+#include <algorithm>
+
+namespace tcp
+{
+
+TokenBucket::TokenBucket(double rate_, double burst_)
+    : rate(rate_), burst(std::max(burst_, 1.0)), tokens(burst), last_refill(std::chrono::steady_clock::now())
+{
+
+}
+
+std::chrono::nanoseconds TokenBucket::reserve(double count)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    refill(std::chrono::steady_clock::now());
+    tokens -= count;
+    if(tokens >= 0)
+    {
+        return std::chrono::nanoseconds(0);
+    }
+
+    // in debt: the caller may go once the bucket has refilled up to zero
+    return std::chrono::nanoseconds((int64_t)(-tokens / rate * 1e9));
+}
+
+bool TokenBucket::tryAcquire(double count)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    refill(std::chrono::steady_clock::now());
+    if(tokens < count)
+    {
+        return false;
+    }
+    tokens -= count;
+    return true;
+}
+
+void TokenBucket::refill(std::chrono::steady_clock::time_point now)
+{
+    double elapsed = std::chrono::duration<double>(now - last_refill).count();
+    tokens = std::min(burst, tokens + elapsed * rate);
+    last_refill = now;
+}
+
+RateLimiter::RateLimiter(const RateLimit& limit)
+{
+    if(limit.messages_per_second > 0)
+    {
+        message_bucket = std::make_unique<TokenBucket>(limit.messages_per_second, limit.messages_per_second * limit.burst_seconds);
+    }
+    if(limit.bytes_per_second > 0)
+    {
+        byte_bucket = std::make_unique<TokenBucket>(limit.bytes_per_second, limit.bytes_per_second * limit.burst_seconds);
+    }
+}
+
+std::chrono::nanoseconds RateLimiter::reserve(size_t messages, size_t bytes)
+{
+    std::chrono::nanoseconds delay(0);
+    if(message_bucket && messages > 0)
+    {
+        delay = std::max(delay, message_bucket->reserve((double)messages));
+    }
+    if(byte_bucket && bytes > 0)
+    {
+        delay = std::max(delay, byte_bucket->reserve((double)bytes));
+    }
+    return delay;
+}
+
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+
+namespace tcp
+{
+
+// Thread safe token bucket: rate_ tokens per second, at most burst_ saved up.
+// reserve() never refuses, it hands out tokens in advance and tells the caller how long to wait,
+// so concurrent callers are spread out evenly instead of retrying together.
+class TokenBucket
+{
+public:
+TokenBucket(double rate_, double burst_);
+
+std::chrono::nanoseconds reserve(double count = 1.0);
+bool tryAcquire(double count = 1.0);
+
+private:
+    const double rate;
+    const double burst;
+    double tokens;
+    std::chrono::steady_clock::time_point last_refill;
+    std::mutex mutex;
+
+    void refill(std::chrono::steady_clock::time_point now);
+};
+
+// 0 = unlimited
+struct RateLimit
+{
+    double messages_per_second = 0;
+    double bytes_per_second = 0;
+    double burst_seconds = 0.1;     // how much unused rate may be saved up
+
+    bool enabled() const { return messages_per_second > 0 || bytes_per_second > 0; }
+};
+
+// Messages/s and bytes/s buckets, reserve() returns how long the caller has to wait for both
+class RateLimiter
+{
+public:
+explicit RateLimiter(const RateLimit& limit);
+
+std::chrono::nanoseconds reserve(size_t messages, size_t bytes);
+
+private:
+    std::unique_ptr<TokenBucket> message_bucket;
+    std::unique_ptr<TokenBucket> byte_bucket;
+};
+
+}
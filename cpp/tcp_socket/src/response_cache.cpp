@@ -0,0 +1,224 @@
+#include "response_cache.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+namespace tcp
+{
+
+namespace
+{
+
+constexpr uint64_t seed0 = 0xa0761d6478bd642full;
+constexpr uint64_t seed1 = 0xe7037ed1a0b428dbull;
+constexpr uint64_t seed2 = 0x8ebc6af09c88c6e3ull;
+
+// bookkeeping of one entry on top of the payload bytes (map node, slot, shared payload control blocks)
+constexpr size_t entry_overhead = 128;
+
+inline uint64_t mix(uint64_t a, uint64_t b)
+{
+    __uint128_t product = (__uint128_t)a * b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+inline uint64_t read64(const uint8_t* data)
+{
+    uint64_t value;
+    std::memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+// the last 1 to 8 bytes, zero padded
+inline uint64_t readTail(const uint8_t* data, size_t bytes)
+{
+    uint64_t value = 0;
+    std::memcpy(&value, data, bytes);
+    return value;
+}
+
+}
+
+uint64_t hashPayload(const uint8_t* data, size_t bytes)
+{
+    uint64_t hash = seed0 ^ mix(bytes ^ seed1, seed2);
+    size_t left = bytes;
+    for(; left >= 16; left -= 16, data += 16)
+    {
+        hash = mix(read64(data) ^ seed1, read64(data + 8) ^ hash);
+    }
+    if(left > 8)
+    {
+        hash = mix(read64(data) ^ seed1, readTail(data + 8, left - 8) ^ hash);
+    }
+    else if(left > 0)
+    {
+        hash = mix(readTail(data, left) ^ seed1, hash ^ seed2);
+    }
+    return mix(hash ^ seed0, bytes ^ seed2);
+}
+
+ResponseCache::ResponseCache(const ResponseCacheConfig& config_)
+    : config(config_), shard_bytes(config_.max_bytes / std::max<size_t>(config_.shards, 1)),
+      hits(0), misses(0), insertions(0), evictions(0), expirations(0)
+{
+    for(size_t i = 0; i < std::max<size_t>(config.shards, 1); ++i)
+    {
+        shards.emplace_back(std::make_unique<Shard>());
+    }
+}
+
+bool ResponseCache::isCacheable(const uint8_t* data, size_t bytes) const
+{
+    return !config.cacheable || config.cacheable(data, bytes);
+}
+
+bool ResponseCache::lookup(uint64_t hash, const uint8_t* data, size_t bytes, std::vector<CachedResponse>& responses_)
+{
+    Shard& shard = getShard(hash);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    auto found = shard.index.find(hash);
+    if(found == shard.index.end())
+    {
+        ++misses;
+        return false;
+    }
+
+    Entry& entry = shard.slots[found->second];
+    if(entry.request.size() != bytes || std::memcmp(entry.request.data(), data, bytes) != 0)
+    {
+        // another request with the same hash, the next insert replaces it
+        ++misses;
+        return false;
+    }
+    if(config.ttl.count() > 0 && std::chrono::steady_clock::now() >= entry.expires)
+    {
+        remove(shard, found->second);
+        ++expirations;
+        ++misses;
+        return false;
+    }
+
+    entry.referenced = true;
+    responses_ = entry.responses;
+    ++hits;
+    return true;
+}
+
+void ResponseCache::insert(uint64_t hash, const uint8_t* data, size_t bytes, std::vector<CachedResponse> responses)
+{
+    size_t entry_bytes = entry_overhead + bytes;
+    for(auto& response : responses)
+    {
+        entry_bytes += response.payload->size();
+    }
+    if(entry_bytes > shard_bytes) return;
+
+    Shard& shard = getShard(hash);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    auto found = shard.index.find(hash);
+    if(found != shard.index.end())
+    {
+        remove(shard, found->second);
+    }
+    while(shard.bytes + entry_bytes > shard_bytes)
+    {
+        evictOne(shard);
+    }
+
+    size_t slot;
+    if(!shard.free_slots.empty())
+    {
+        slot = shard.free_slots.back();
+        shard.free_slots.pop_back();
+    }
+    else
+    {
+        slot = shard.slots.size();
+        shard.slots.emplace_back();
+    }
+
+    Entry& entry = shard.slots[slot];
+    entry.used = true;
+    // a new entry has to be hit once before it survives a sweep
+    entry.referenced = false;
+    entry.hash = hash;
+    entry.request.assign(data, data + bytes);
+    entry.responses = std::move(responses);
+    entry.expires = std::chrono::steady_clock::now() + config.ttl;
+    entry.bytes = entry_bytes;
+
+    shard.index[hash] = slot;
+    shard.bytes += entry_bytes;
+    ++insertions;
+}
+
+void ResponseCache::clear()
+{
+    for(auto& shard : shards)
+    {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        shard->index.clear();
+        shard->slots.clear();
+        shard->free_slots.clear();
+        shard->hand = 0;
+        shard->bytes = 0;
+    }
+}
+
+ResponseCacheStats ResponseCache::getStats() const
+{
+    ResponseCacheStats stats;
+    stats.hits = hits;
+    stats.misses = misses;
+    stats.insertions = insertions;
+    stats.evictions = evictions;
+    stats.expirations = expirations;
+    for(auto& shard : shards)
+    {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        stats.entries += shard->index.size();
+        stats.bytes += shard->bytes;
+    }
+    return stats;
+}
+
+ResponseCache::Shard& ResponseCache::getShard(uint64_t hash)
+{
+    // the low bits pick the unordered_map bucket, the high ones the shard
+    return *shards[(hash >> 48) % shards.size()];
+}
+
+void ResponseCache::remove(Shard& shard, size_t slot)
+{
+    Entry& entry = shard.slots[slot];
+    shard.index.erase(entry.hash);
+    shard.bytes -= entry.bytes;
+    entry = Entry();
+    shard.free_slots.push_back(slot);
+}
+
+void ResponseCache::evictOne(Shard& shard)
+{
+    // every used entry is passed at most twice: once to clear its bit, once to take it
+    while(true)
+    {
+        size_t slot = shard.hand;
+        shard.hand = (shard.hand + 1) % shard.slots.size();
+
+        Entry& entry = shard.slots[slot];
+        if(!entry.used) continue;
+        if(entry.referenced)
+        {
+            entry.referenced = false;
+            continue;
+        }
+        remove(shard, slot);
+        ++evictions;
+        return;
+    }
+}
+
+}
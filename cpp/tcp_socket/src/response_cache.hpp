@@ -0,0 +1,103 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "types.hpp"
+#include "lanes.hpp"
+
+namespace tcp
+{
+
+// 64 bit hash of a message, a few multiplies per 16 bytes (not for untrusted keys that must not collide,
+// the cache compares the whole request on a hit)
+uint64_t hashPayload(const uint8_t* data, size_t bytes);
+
+// max_bytes = 0 turns the cache off
+struct ResponseCacheConfig
+{
+    size_t max_bytes = 0;           // requests and responses held, split evenly over the shards
+    std::chrono::milliseconds ttl = std::chrono::milliseconds(1000);    // 0 = entries only leave when evicted
+    size_t shards = 16;             // each with a lock of its own
+    // which requests are idempotent, nullptr = every request
+    std::function<bool(const uint8_t* data, size_t bytes)> cacheable;
+
+    bool enabled() const { return max_bytes > 0; }
+};
+
+struct ResponseCacheStats
+{
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t insertions = 0;
+    uint64_t evictions = 0;         // pushed out to make room
+    uint64_t expirations = 0;       // found past their ttl
+    // current content
+    size_t entries = 0;
+    size_t bytes = 0;
+};
+
+// one message the handler sent back
+struct CachedResponse
+{
+    std::shared_ptr<const Payload> payload;
+    Priority priority;
+};
+
+// Thread safe request -> responses cache. Sharded by hash, every shard is a CLOCK: a hit only sets
+// the referenced bit of its entry, eviction sweeps the hand past referenced entries once before taking one.
+class ResponseCache
+{
+public:
+explicit ResponseCache(const ResponseCacheConfig& config_);
+
+bool isCacheable(const uint8_t* data, size_t bytes) const;
+// true on a hit, responses_ then holds what the handler sent for the same request
+bool lookup(uint64_t hash, const uint8_t* data, size_t bytes, std::vector<CachedResponse>& responses_);
+// replaces an entry with the same hash, nothing is stored if request and responses do not fit in a shard
+void insert(uint64_t hash, const uint8_t* data, size_t bytes, std::vector<CachedResponse> responses);
+void clear();
+ResponseCacheStats getStats() const;
+
+private:
+    struct Entry
+    {
+        bool used = false;
+        bool referenced = false;
+        uint64_t hash = 0;
+        Payload request;
+        std::vector<CachedResponse> responses;
+        std::chrono::steady_clock::time_point expires;
+        size_t bytes = 0;
+    };
+
+    struct Shard
+    {
+        std::mutex mutex;
+        std::unordered_map<uint64_t, size_t> index;     // hash -> slot
+        std::vector<Entry> slots;
+        std::vector<size_t> free_slots;
+        size_t hand = 0;
+        size_t bytes = 0;
+    };
+
+    const ResponseCacheConfig config;
+    const size_t shard_bytes;
+    std::vector<std::unique_ptr<Shard>> shards;
+    std::atomic<uint64_t> hits;
+    std::atomic<uint64_t> misses;
+    std::atomic<uint64_t> insertions;
+    std::atomic<uint64_t> evictions;
+    std::atomic<uint64_t> expirations;
+
+    Shard& getShard(uint64_t hash);
+    // both with the shard lock held
+    void remove(Shard& shard, size_t slot);
+    void evictOne(Shard& shard);
+};
+
+}
@@ -1,19 +1,108 @@
 #include "server.hpp"
 #include "logger.hpp"
+#include "crc32c.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <tuple>
+#include <boost/asio/write.hpp>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
 
 namespace tcp
 {
 
-Server::Server(std::string ip_, uint16_t port_, std::function<void(uint16_t clientPort, std::unique_ptr<Payload> rxBuffer_)> handler_) : handler(handler_)
+namespace
+{
+
+// responses sent to the client whose request is being dispatched on this thread, for the response cache
+struct ResponseCapture
+{
+    uint16_t clientPort;
+    std::vector<CachedResponse> responses;
+    bool uncacheable;
+};
+
+thread_local ResponseCapture* response_capture = nullptr;
+
+// the handler did something a cached answer would not repeat (a file, a broadcast, a buffer it wants back,
+// a message to another client): nothing of this request is cached
+void abandonResponseCapture()
+{
+    if(!response_capture) return;
+    response_capture->uncacheable = true;
+    response_capture->responses.clear();
+}
+
+// the capture only lives as long as the dispatch() call, also when the handler throws
+class ResponseCaptureScope
+{
+public:
+    explicit ResponseCaptureScope(ResponseCapture* capture_) { response_capture = capture_; }
+    ~ResponseCaptureScope() { response_capture = nullptr; }
+};
+
+// continues crc_ over count bytes of the file from offset (read through the page cache), false if they can not be read
+bool checksumFile(int fd, off_t offset, size_t count, uint32_t& crc_)
+{
+    static thread_local Payload block(256 * 1024);
+    while(count > 0)
+    {
+        ssize_t bytes = ::pread(fd, block.data(), std::min(count, block.size()), offset);
+        if(bytes < 0 && errno == EINTR) continue;
+        if(bytes <= 0) return false;
+
+        crc_ = crc32c(block.data(), (size_t)bytes, crc_);
+        offset += bytes;
+        count -= (size_t)bytes;
+    }
+    return true;
+}
+
+}
+
+ServerBase::ServerBase(std::string ip_, uint16_t port_, DispatchFunction dispatch_) : server_address(ip_), transport(getTransport(ip_)), next_anonymous_port(0), zerocopy_threshold(64 * 1024), throttled_reads(0), paused_reads(0), admission(std::make_shared<AdmissionControl>()), timestamping(false), integrity(false), verified_frames(0), failed_frames(0), io_threads(0), next_pool_context(0), listening(false), stopped(false), stopping(false), accept_wakeup(-1), shut_down(false), dispatch(dispatch_)
+{
+    server_endpoint = makeEndpoint(ip_, port_);
+    acceptor = std::make_unique<Acceptor>(io);
+
+    accept_wakeup = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if(accept_wakeup < 0)
+    {
+        throw boost::system::system_error(errno, boost::system::system_category(), "eventfd");
+    }
+}
+
+ServerBase::~ServerBase()
 {
-    server_endpoint = Endpoint(boost::asio::ip::make_address_v4(ip_), port_);
+    shutdown();
+    ::close(accept_wakeup);
+    // never started
+    adopted.close();
 }
 
-Server::~Server()
+void ServerBase::shutdown()
 {
     std::string function_id = getFunctionId(__func__, "Server");
 
-    connections.clear();
+    if(shut_down) return;
+    shut_down = true;
+
+    stop();
+    // no callback may run while the connections go away
+    stop_io_pool();
+
+    {
+        std::lock_guard<std::mutex> lock(connections_mutex);
+        connections.clear();
+        groups.clear();
+    }
+    // pending operations still hold their connection, destroying the contexts releases them
+    io_pool.clear();
 
     try
     {
@@ -28,205 +117,2318 @@ Server::~Server()
     }
 }
 
-void Server::start()
+void ServerBase::start()
 {
     status_future = std::async(std::launch::async, [=](){this->start_up();});
 }
 
-std::future_status Server::status() const
+void ServerBase::stop()
+{
+    stopping = true;
+    admission->interrupt();
+    if(!status_future.valid()) return;
+
+    // stays readable, a thread that was not waiting yet wakes up right away
+    uint64_t wake = 1;
+    if(::write(accept_wakeup, &wake, sizeof(wake)) < 0 && errno != EAGAIN)
+    {
+        LOG_ERROR << getFunctionId(__func__, "Server") << " Could not wake up the accept thread: " << std::strerror(errno);
+    }
+    status_future.wait();
+}
+
+void ServerBase::setStoppedCallback(std::function<void()> callback_)
+{
+    stopped_callback = callback_;
+}
+
+std::future_status ServerBase::status() const
 {
     return status_future.wait_for(std::chrono::milliseconds(0));
 }
 
-void Server::send(uint16_t clientPort, std::unique_ptr<Payload> txBuffer_)
+bool ServerBase::waitUntilListening(std::chrono::milliseconds timeout) const
+{
+    std::unique_lock<std::mutex> lock(state_mutex);
+    return state_cv.wait_for(lock, timeout, [this](){ return listening || stopped; }) && listening;
+}
+
+void ServerBase::send(uint16_t clientPort, std::unique_ptr<Payload> txBuffer_, Priority priority)
 {
     std::string function_id = getFunctionId(__func__, "Server");
 
     if(txBuffer_->size() == 0)
     {
-        LOG_WARNING << function_id <<  " Empty Payload, will ignore!";
+        LOG_WARNING_LIMITED(10) << function_id <<  " Empty Payload, will ignore!";
+        return;
+    }
+
+    if(response_capture && response_capture->clientPort != clientPort)
+    {
+        abandonResponseCapture();
+    }
+    else if(response_capture && !response_capture->uncacheable)
+    {
+        response_capture->responses.push_back({std::make_shared<const Payload>(*txBuffer_), priority});
+    }
+
+    std::shared_ptr<Connection> connection = getConnection(clientPort);
+    if(connection && !connection->isFramed() && zerocopy_threshold > 0 && txBuffer_->size() >= zerocopy_threshold)
+    {
+        // framed messages stay on the lanes, so they keep their priority and are chunked
+        send_zero_copy(clientPort, std::move(txBuffer_), nullptr);
         return;
     }
 
-    if(connections.find(clientPort) != connections.end())
+    if(connection)
     {
         LOG_DEBUG << function_id <<  " Sending Payload with " << txBuffer_->size() << " bytes to Client(" << clientPort << ")";
-        connections.at(clientPort)->getTxBuffer() = *txBuffer_;
-        connections.at(clientPort)->getSocket().send(boost::asio::buffer(connections.at(clientPort)->getTxBuffer()));
+        uint64_t trace_id = Tracer::current();
+        Tracer::stamp(trace_id, TraceStage::WriteQueued, clientPort);
+        // we own txBuffer_, no need to stage it in the connection tx_buffer
+        connection->writeMessage(txBuffer_->data(), txBuffer_->size(), priority);
+        Tracer::stamp(trace_id, TraceStage::WriteComplete, clientPort);
     }
     else
     {
-        LOG_WARNING << function_id <<  " No Connection available to client with port " << clientPort;   
+        LOG_WARNING_LIMITED(10) << function_id <<  " No Connection available to client with port " << clientPort;   
     }
 }
 
-void Server::start_up()
+void ServerBase::sendZeroCopy(uint16_t clientPort, std::unique_ptr<Payload> txBuffer_, ZeroCopySender::Completion completion_)
 {
-    std::string function_id = getFunctionId(__func__, "Server");
+    abandonResponseCapture();
+    send_zero_copy(clientPort, std::move(txBuffer_), std::move(completion_));
+}
 
-    LOG_DEBUG << function_id <<  " Starting SERVER thread";
-    acceptor = std::make_unique<Acceptor>(io);
+void ServerBase::send_zero_copy(uint16_t clientPort, std::unique_ptr<Payload> txBuffer_, ZeroCopySender::Completion completion_)
+{
+    std::string function_id = getFunctionId(__func__, "Server");
 
-    try
+    std::shared_ptr<Connection> connection = getConnection(clientPort);
+    if(!connection)
     {
-        LOG_DEBUG << function_id <<  " OPEN ip_v4 socket";
-        acceptor->open(server_endpoint.protocol().v4());
-
-        LOG_DEBUG << function_id <<  " SET_OPTION reuse_address(true)";
-        acceptor->set_option(Acceptor::reuse_address(true));
-        
-        LOG_DEBUG << function_id <<  " BIND [" << server_endpoint.address().to_string() << ":" 
-                              << server_endpoint.port() << "]";
-        acceptor->bind(server_endpoint);
+        LOG_WARNING_LIMITED(10) << function_id <<  " No Connection available to client with port " << clientPort;   
+        if(completion_)
+        {
+            completion_(std::move(txBuffer_));
+        }
+        return;
+    }
 
-        LOG_DEBUG << function_id <<  " LISTEN start";
-        acceptor->listen(boost::asio::socket_base::max_connections);    
+    if(connection->isFramed())
+    {
+        // the frame is a new buffer, the caller gets its payload back right away
+        std::unique_ptr<Payload> frame = std::make_unique<Payload>();
+        connection->encode(txBuffer_->data(), txBuffer_->size(), *frame);
+        if(completion_)
+        {
+            completion_(std::move(txBuffer_));
+            completion_ = nullptr;
+        }
+        txBuffer_ = std::move(frame);
+    }
 
-        while(true)
+    uint64_t trace_id = Tracer::current();
+    if(trace_id)
+    {
+        // complete once the kernel gives the buffer back, not when the call returns
+        Tracer::stamp(trace_id, TraceStage::WriteQueued, clientPort);
+        completion_ = [trace_id, clientPort, completion_](std::unique_ptr<Payload> txBuffer_)
         {
-            if (acceptor->is_open())
+            Tracer::stamp(trace_id, TraceStage::WriteComplete, clientPort);
+            if(completion_)
             {
-                LOG_DEBUG << function_id <<  " ACCEPTOR is open ... start waiting for a new connections";
+                completion_(std::move(txBuffer_));
+            }
+        };
+    }
 
-                std::shared_ptr<Connection> connection = std::make_shared<Connection>();
-                
-                connection->getTxBuffer() = {'P','O','N','G'}; 
-                connection->getRxBuffer() = Payload(4090); 
-                
-                acceptor->accept(connection->getSocket());
+    if(connection->isShm() || connection->hasTls() || connection->writesAsync() || !connection->getZeroCopySender().enable())
+    {
+        // no kernel support, not a plain TCP socket or written asynchronously from the lanes: plain (copying) send
+        connection->write(boost::asio::buffer(*txBuffer_));
+        if(completion_)
+        {
+            completion_(std::move(txBuffer_));
+        }
+        return;
+    }
 
-                LOG_DEBUG << function_id <<  " New connection accepted with Client(" << connection->getSocket().remote_endpoint().port() << ")";
-                {
-                    std::lock_guard<std::mutex> lock(rx_mutex);
-                    connections.emplace(connection->getSocket().remote_endpoint().port(), connection);
-                }
+    // completions and tx stamps would share the error queue, the stamps give way
+    connection->getTimestamps().disableTx();
 
-                LOG_DEBUG << function_id <<  " Setting Async Rx Callback for Client(" << connection->getSocket().remote_endpoint().port() << ")";
-                connection->getSocket().async_receive(boost::asio::buffer(connection->getRxBuffer()), 
-                    [=](const boost::system::error_code& ec, size_t bytes)
-                    {
-                        rx_callback(ec, bytes, connection);
-                    });
-                
-                connection->start();
+    LOG_DEBUG << function_id <<  " Sending zerocopy Payload with " << txBuffer_->size() << " bytes to Client(" << clientPort << ")";
+    connection->sendZeroCopy(std::move(txBuffer_), completion_);
+}
 
-                // LOG_DEBUG << function_id <<  " Starting io_context run";
-                // io.run();
-                
-            }
-            else
+void ServerBase::sendFile(uint16_t clientPort, int fd, off_t offset, size_t count)
+{
+    std::string function_id = getFunctionId(__func__, "Server");
+
+    abandonResponseCapture();
+
+    std::shared_ptr<Connection> connection = getConnection(clientPort);
+    if(!connection)
+    {
+        LOG_WARNING_LIMITED(10) << function_id <<  " No Connection available to client with port " << clientPort;   
+        return;
+    }
+
+    LOG_DEBUG << function_id <<  " Sending " << count << " bytes from fd " << fd << " to Client(" << clientPort << ")";
+    if(!connection->isShm() && !connection->writesAsync())
+    {
+        // the kernel writes bytes we do not count, the tx stamp ids would be off from here on
+        connection->getTimestamps().disableTx();
+        connection->sendFile(fd, offset, count);
+        return;
+    }
+
+    // the shared memory rings are already in our address space, a read + ring copy is the best we can do;
+    // on the shared pool sendfile() would block a pool thread, the chunks are queued for the async writes instead
+    Payload chunk(std::min(count, ShmChannel::ring_capacity / 2));
+    while(count > 0)
+    {
+        ssize_t bytes = ::pread(fd, chunk.data(), std::min(count, chunk.size()), offset);
+        if(bytes <= 0)
+        {
+            LOG_WARNING << function_id << " pread stopped with " << count << " bytes left";
+            return;
+        }
+        connection->write(boost::asio::buffer(chunk.data(), bytes));
+        offset += bytes;
+        count -= bytes;
+    }
+}
+
+void ServerBase::broadcast(std::shared_ptr<const Payload> txBuffer_, Priority priority)
+{
+    std::vector<std::shared_ptr<Connection>> targets;
+    {
+        std::lock_guard<std::mutex> lock(connections_mutex);
+        targets.reserve(connections.size());
+        for(auto& connection : connections)
+        {
+            targets.push_back(connection.second);
+        }
+    }
+
+    fan_out(targets, txBuffer_, priority);
+}
+
+void ServerBase::broadcast(const std::vector<uint16_t>& clientPorts, std::shared_ptr<const Payload> txBuffer_, Priority priority)
+{
+    std::vector<std::shared_ptr<Connection>> targets;
+    {
+        std::lock_guard<std::mutex> lock(connections_mutex);
+        targets.reserve(clientPorts.size());
+        for(uint16_t clientPort : clientPorts)
+        {
+            auto connection = connections.find(clientPort);
+            if(connection != connections.end())
             {
-                LOG_ERROR << function_id <<  " ACCEPTOR is closed";
-                exit (EXIT_FAILURE);
+                targets.push_back(connection->second);
             }
         }
-    
     }
-    catch(const std::exception& e)
+
+    fan_out(targets, txBuffer_, priority);
+}
+
+void ServerBase::broadcast(const std::string& group, std::shared_ptr<const Payload> txBuffer_, Priority priority)
+{
+    std::vector<std::shared_ptr<Connection>> targets;
     {
-        LOG_ERROR << function_id << " " << e.what();
-        exit (EXIT_FAILURE);
-    }    
+        std::lock_guard<std::mutex> lock(connections_mutex);
+        auto members = groups.find(group);
+        if(members != groups.end())
+        {
+            targets.reserve(members->second.size());
+            for(uint16_t clientPort : members->second)
+            {
+                auto connection = connections.find(clientPort);
+                if(connection != connections.end())
+                {
+                    targets.push_back(connection->second);
+                }
+            }
+        }
+    }
 
+    fan_out(targets, txBuffer_, priority);
 }
 
-void Server::rx_callback(const boost::system::error_code& ec, size_t bytes, std::shared_ptr<Connection> client_connection)
+void ServerBase::joinGroup(const std::string& group, uint16_t clientPort)
 {
-    std::lock_guard<std::mutex> lock(rx_mutex);
+    std::lock_guard<std::mutex> lock(connections_mutex);
+    groups[group].insert(clientPort);
+}
 
-    std::string function_id = getFunctionId(__func__, "Server");
-    uint16_t clientPort = client_connection->getSocket().remote_endpoint().port();
-    LOG_DEBUG << function_id <<  " Got something from Client(" << clientPort << ")";
-    
-    if(ec)
+void ServerBase::leaveGroup(const std::string& group, uint16_t clientPort)
+{
+    std::lock_guard<std::mutex> lock(connections_mutex);
+    auto members = groups.find(group);
+    if(members != groups.end())
     {
-        LOG_WARNING << function_id <<  " Erro code: " << ec.message();
-        if(ec == boost::asio::error::eof)
+        members->second.erase(clientPort);
+        if(members->second.empty())
         {
-            LOG_DEBUG << function_id <<  " Client(" << clientPort << ") closed the connection!";
-            connections.erase(clientPort);
+            groups.erase(members);
         }
-        return;
     }
+}
 
-    LOG_DEBUG << function_id <<  " Received " << bytes << " bytes";
-    if(bytes)
+void ServerBase::fan_out(const std::vector<std::shared_ptr<Connection>>& targets, std::shared_ptr<const Payload> txBuffer_, Priority priority)
+{
+    abandonResponseCapture();
+    std::string function_id = getFunctionId(__func__, "Server");
+
+    if(!txBuffer_ || txBuffer_->size() == 0)
     {
-        std::string payload(client_connection->getRxBuffer().begin(), client_connection->getRxBuffer().end());
-        LOG_DEBUG << function_id <<  " Rx Payload: " << payload;
+        LOG_WARNING_LIMITED(10) << function_id <<  " Empty Payload, will ignore!";
+        return;
+    }
+
+    LOG_DEBUG << function_id <<  " Broadcasting Payload with " << txBuffer_->size() << " bytes to " << targets.size() << " Clients";
 
-        if(handler)
+    // encoded once per negotiated codec (chunking, checksums), not once per connection
+    std::map<std::tuple<Codec, bool, bool>, std::vector<OutboundLanes::Frame>> frames;
+
+    // every connection only takes a reference, the write runs on the connection own thread
+    for(auto& connection : targets)
+    {
+        if(!connection->isFramed())
         {
-            std::unique_ptr<Payload> rxPayload = std::make_unique<Payload>(client_connection->getRxBuffer());
-            handler(clientPort, std::move(rxPayload));
+            connection->enqueue({txBuffer_}, txBuffer_->size(), priority);
+            continue;
         }
-        else
+
+        std::vector<OutboundLanes::Frame>& encoded = frames[std::make_tuple(connection->getCodec(), connection->isChunked(), connection->isChecksummed())];
+        if(encoded.empty())
         {
-            // if no hadnler is defined simply Pong the client (use as default impl - maybe be comment out this section later)
-            LOG_DEBUG << function_id <<  " Sending PONG to Client(" << clientPort << ")";
-            client_connection->getSocket().send(boost::asio::buffer(client_connection->getTxBuffer()));
+            encoded = connection->makeFrames(txBuffer_->data(), txBuffer_->size(), priority);
         }
+        connection->enqueue(encoded, txBuffer_->size(), priority);
+    }
+}
 
-        LOG_DEBUG << function_id <<  " Setting Async Rx Callback for Client(" << clientPort << ")";
-        client_connection->getSocket().async_receive(boost::asio::buffer(client_connection->getRxBuffer()), 
-            [=](const boost::system::error_code& ec, size_t bytes)
-            {
-                rx_callback(ec, bytes, client_connection);
-            });
+std::shared_ptr<ServerBase::Connection> ServerBase::getConnection(uint16_t clientPort)
+{
+    std::lock_guard<std::mutex> lock(connections_mutex);
+    auto connection = connections.find(clientPort);
+    return (connection != connections.end()) ? connection->second : nullptr;
+}
+
+void ServerBase::remove_connection(uint16_t clientPort)
+{
+    std::shared_ptr<Connection> connection;
+    {
+        std::lock_guard<std::mutex> lock(connections_mutex);
+        auto it = connections.find(clientPort);
+        if(it == connections.end()) return;
+
+        connection = it->second;
+        connections.erase(it);
+
+        for(auto members = groups.begin(); members != groups.end(); )
+        {
+            members->second.erase(clientPort);
+            members = members->second.empty() ? groups.erase(members) : std::next(members);
+        }
     }
+    // connection is released here, outside connections_mutex
+}
+
+void ServerBase::setTls(const TlsConfig& config)
+{
+    tls_config = config;
+}
+
+void ServerBase::setCompression(const CompressionConfig& config)
+{
+    compression_config = config;
+}
 
+CompressionStats ServerBase::getCompressionStats() const
+{
+    return compressor ? compressor->getStats() : CompressionStats();
 }
 
+void ServerBase::setRateLimits(const RateLimit& per_connection, const RateLimit& per_source_address)
+{
+    connection_rate_limit = per_connection;
+    source_rate_limit = per_source_address;
+}
 
-Server::Connection::Connection()
-    : socket(std::make_shared<Socket>(context_io))
+uint64_t ServerBase::getThrottledReads() const
 {
+    return throttled_reads;
+}
 
+void ServerBase::setAdmissionLimits(const AdmissionLimits& limits)
+{
+    admission = std::make_shared<AdmissionControl>(limits);
 }
 
-Server::Connection::~Connection()
+AdmissionStats ServerBase::getAdmissionStats() const
 {
-    std::string function_id = getFunctionId(__func__, "Server");
+    return admission->getStats();
+}
 
-    rx_buffer.resize(0);
-    tx_buffer.resize(0);
+void ServerBase::setIoThreads(size_t threads)
+{
+    io_threads = threads;
+}
 
-    try
+void ServerBase::setInboundCredits(const InboundCredits& credits)
+{
+    inbound_credits = credits;
+}
+
+void ServerBase::acknowledge(uint16_t clientPort, size_t bytes)
+{
+    if(!inbound_credits.enabled()) return;
+
+    std::shared_ptr<Connection> connection = getConnection(clientPort);
+    if(connection)
     {
-        uint16_t port = socket->remote_endpoint().port();
-        LOG_DEBUG << function_id <<  " Deleting endpoint: " << port;
-        socket->cancel();
-        socket->close();
-        
-        context_io.stop();
-        LOG_DEBUG << function_id <<  " Endpoint(" << port << ") context_io stopped: " << std::boolalpha << context_io.stopped();
-        _thread.detach(); // cannot use join since this is most likely being executted in the same context (Server::rx_callback() uses this thread context)
-        LOG_DEBUG << function_id <<  " Endpoint(" << port << ") thread detached";
+        connection->returnCredit(bytes);
     }
-    catch(const std::exception& e)
+}
+
+uint64_t ServerBase::getPausedReads() const
+{
+    return paused_reads;
+}
+
+void ServerBase::start_io_pool()
+{
+    if(io_threads == 0 || !io_pool.empty()) return;
+
+    for(size_t i = 0; i < io_threads; ++i)
     {
-        LOG_ERROR << function_id << e.what();
+        io_pool.emplace_back(std::make_unique<Context>(1));
+        io_pool_work.emplace_back(boost::asio::make_work_guard(*io_pool.back()));
+    }
+    for(auto& context : io_pool)
+    {
+        Context* pool_context = context.get();
+        io_pool_threads.emplace_back([pool_context](){ pool_context->run(); });
     }
 }
 
-void Server::Connection::start()
+void ServerBase::stop_io_pool()
 {
-    _thread = std::thread([=](){ context_io.run(); });
+    io_pool_work.clear();
+    for(auto& context : io_pool)
+    {
+        context->stop();
+    }
+    for(auto& thread : io_pool_threads)
+    {
+        thread.join();
+    }
+    io_pool_threads.clear();
 }
 
-Socket& Server::Connection::getSocket()
+Context* ServerBase::next_io_context()
 {
-    return *socket;
+    // only the accept thread hands out contexts
+    if(io_pool.empty()) return nullptr;
+    return io_pool[next_pool_context++ % io_pool.size()].get();
 }
 
-Payload& Server::Connection::getRxBuffer()
+ConnectionFootprint& ConnectionFootprint::operator+=(const ConnectionFootprint& other)
 {
-    return rx_buffer;
+    object_bytes += other.object_bytes;
+    buffer_bytes += other.buffer_bytes;
+    context_bytes += other.context_bytes;
+    stack_bytes += other.stack_bytes;
+    fds += other.fds;
+    return *this;
 }
 
-Payload& Server::Connection::getTxBuffer()
+bool ServerBase::getConnectionFootprint(uint16_t clientPort, ConnectionFootprint& footprint_) const
 {
-    return tx_buffer;
+    std::lock_guard<std::mutex> lock(connections_mutex);
+    auto connection = connections.find(clientPort);
+    if(connection == connections.end()) return false;
+
+    footprint_ = connection->second->getFootprint();
+    return true;
+}
+
+MemoryUsage ServerBase::getMemoryUsage() const
+{
+    MemoryUsage usage;
+    usage.io_threads = io_pool.size();
+
+    std::lock_guard<std::mutex> lock(connections_mutex);
+    usage.connections = connections.size();
+    for(auto& connection : connections)
+    {
+        usage.total += connection.second->getFootprint();
+    }
+    return usage;
+}
+
+void ServerBase::setCapture(std::shared_ptr<CaptureWriter> capture_)
+{
+    capture = capture_;
+}
+
+void ServerBase::setTimestamping(bool enabled)
+{
+    timestamping = enabled;
+}
+
+TimestampStats ServerBase::getTimestampStats() const
+{
+    TimestampStats stats;
+    stats.kernel_to_handler = kernel_to_handler.getSummary();
+    stats.send_to_wire = send_to_wire.getSummary();
+    return stats;
+}
+
+void ServerBase::setIntegrity(bool enabled)
+{
+    integrity = enabled;
+}
+
+IntegrityStats ServerBase::getIntegrityStats() const
+{
+    IntegrityStats stats;
+    stats.verified_frames = verified_frames;
+    stats.failed_frames = failed_frames;
+    return stats;
+}
+
+bool ServerBase::getIntegrityStats(uint16_t clientPort, IntegrityStats& stats_) const
+{
+    std::lock_guard<std::mutex> lock(connections_mutex);
+    auto connection = connections.find(clientPort);
+    if(connection == connections.end()) return false;
+
+    stats_ = connection->second->getIntegrityStats();
+    return true;
+}
+
+void ServerBase::setResponseCache(const ResponseCacheConfig& config)
+{
+    response_cache = config.enabled() ? std::make_unique<ResponseCache>(config) : nullptr;
+}
+
+ResponseCacheStats ServerBase::getResponseCacheStats() const
+{
+    return response_cache ? response_cache->getStats() : ResponseCacheStats();
+}
+
+void ServerBase::clearResponseCache()
+{
+    if(response_cache)
+    {
+        response_cache->clear();
+    }
+}
+
+std::shared_ptr<RateLimiter> ServerBase::getSourceLimiter(const std::string& source_address)
+{
+    if(!source_rate_limit.enabled()) return nullptr;
+
+    std::lock_guard<std::mutex> lock(connections_mutex);
+
+    // shared by every connection from that address, gone with the last of them
+    std::shared_ptr<RateLimiter> limiter = source_limiters[source_address].lock();
+    if(!limiter)
+    {
+        for(auto it = source_limiters.begin(); it != source_limiters.end(); )
+        {
+            it = it->second.expired() ? source_limiters.erase(it) : std::next(it);
+        }
+        limiter = std::make_shared<RateLimiter>(source_rate_limit);
+        source_limiters[source_address] = limiter;
+    }
+    return limiter;
+}
+
+void ServerBase::setZeroCopyThreshold(size_t bytes)
+{
+    zerocopy_threshold = bytes;
+}
+
+HandoffState ServerBase::handOff(std::chrono::milliseconds timeout)
+{
+    std::string function_id = getFunctionId(__func__, "Server");
+
+    stop();
+
+    HandoffState state;
+    if(acceptor->is_open())
+    {
+        // ours is closed with the Server, the successor keeps listening on its copy
+        state.listener_fd = ::fcntl(acceptor->native_handle(), F_DUPFD_CLOEXEC, 0);
+        if(state.listener_fd < 0)
+        {
+            LOG_ERROR << function_id << " Could not duplicate the listening socket: " << std::strerror(errno);
+        }
+    }
+
+    std::vector<std::pair<std::shared_ptr<Connection>, std::future<void>>> stopping_reads;
+    {
+        std::lock_guard<std::mutex> lock(connections_mutex);
+        for(auto& connection : connections)
+        {
+            // OpenSSL state and shared memory rings live in this process
+            if(connection.second->hasTls() || connection.second->isShm()) continue;
+            stopping_reads.emplace_back(connection.second, connection.second->stopReading());
+        }
+    }
+
+    // a connection not done in time stays here, it is not read from any more and closes with this process;
+    // the answers its handlers still send go out first
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + timeout;
+    std::vector<std::shared_ptr<Connection>> quiet;
+    for(auto& connection : stopping_reads)
+    {
+        if(connection.second.wait_until(deadline) != std::future_status::ready || !connection.first->waitUntilIdle(deadline))
+        {
+            LOG_WARNING << function_id <<  " Client(" << connection.first->getPort() << ") still has messages in flight, it is not handed off";
+            continue;
+        }
+        quiet.push_back(connection.first);
+    }
+
+    std::vector<std::future<HandedOffConnection>> detaching;
+    for(auto& connection : quiet)
+    {
+        detaching.push_back(connection->detach());
+    }
+    for(size_t i = 0; i < quiet.size(); ++i)
+    {
+        uint16_t clientPort = quiet[i]->getPort();
+        if(detaching[i].wait_until(deadline) != std::future_status::ready)
+        {
+            LOG_WARNING << function_id <<  " Client(" << clientPort << ") did not let go of its socket in time, it is not handed off";
+            continue;
+        }
+
+        try
+        {
+            state.connections.push_back(detaching[i].get());
+        }
+        catch(const std::exception& e)
+        {
+            LOG_WARNING << function_id <<  " Client(" << clientPort << ") is not handed off: " << e.what();
+        }
+        remove_connection(clientPort);
+    }
+
+    LOG_DEBUG << function_id <<  " Handing off " << state.connections.size() << " of " << stopping_reads.size() << " connections";
+    return state;
+}
+
+void ServerBase::adopt(HandoffState state)
+{
+    adopted.close();
+    adopted = std::move(state);
+}
+
+bool ServerBase::wait_for_accept()
+{
+    pollfd fds[2] = {{acceptor->native_handle(), POLLIN, 0}, {accept_wakeup, POLLIN, 0}};
+    while(!stopping)
+    {
+        if(::poll(fds, 2, -1) < 0)
+        {
+            if(errno == EINTR) continue;
+            throw boost::system::system_error(errno, boost::system::system_category(), "poll");
+        }
+        return !stopping && fds[0].revents != 0;
+    }
+    return false;
+}
+
+std::shared_ptr<ServerBase::Connection> ServerBase::make_connection()
+{
+    std::shared_ptr<Connection> connection = std::make_shared<Connection>(next_io_context());
+
+    connection->getTxBuffer() = {'P','O','N','G'}; 
+    if(io_pool.empty())
+    {
+        // pooled connections read into the buffer of their pool thread instead
+        connection->getRxBuffer() = Payload(4090); 
+        connection->registerRxBuffer();
+        connection->sampleFootprint();
+    }
+    return connection;
+}
+
+bool ServerBase::admit_connection(std::shared_ptr<Connection> connection, const Endpoint& remote_endpoint)
+{
+    std::string function_id = getFunctionId(__func__, "Server");
+
+    // checked before any handshake so an overloaded server sheds connections as cheaply as it can
+    size_t footprint = connection->getFootprint().total();
+    if(!admission->admitConnection(footprint))
+    {
+        admission->countRejected();
+        LOG_WARNING_LIMITED(10) << function_id <<  " Overloaded, rejecting Client(" << connection->getPort() << ")";
+        boost::system::error_code ignored;
+        connection->getSocket().set_option(boost::asio::socket_base::linger(true, 0), ignored);
+        connection->getSocket().close(ignored);
+        return false;
+    }
+    connection->setAdmission(admission, footprint);
+    connection->setCredits(inbound_credits);
+    if(timestamping && transport == Transport::Tcp && !tls_context)
+    {
+        // OpenSSL reads and writes the socket itself, TLS connections go without
+        connection->enableTimestamps(&send_to_wire);
+    }
+    connection->setRateLimiters(connection_rate_limit.enabled() ? std::make_shared<RateLimiter>(connection_rate_limit) : nullptr,
+                                getSourceLimiter(getSourceAddress(remote_endpoint)));
+    return true;
+}
+
+void ServerBase::activate_connection(std::shared_ptr<Connection> connection)
+{
+    std::string function_id = getFunctionId(__func__, "Server");
+    uint16_t clientPort = connection->getPort();
+
+    {
+        std::lock_guard<std::mutex> lock(connections_mutex);
+        connections.emplace(clientPort, connection);
+    }
+
+    if(!connection->hasTls())
+    {
+        start_receiving(connection);
+    }
+    else
+    {
+        LOG_DEBUG << function_id <<  " TLS handshake with Client(" << clientPort << ")";
+        // registered already, so shutdown() releases it; the handshake must not keep it alive
+        std::weak_ptr<Connection> weak_connection = connection;
+        connection->asyncHandshake([this, weak_connection](const boost::system::error_code& ec)
+            {
+                std::shared_ptr<Connection> connection = weak_connection.lock();
+                if(!connection) return;
+
+                if(ec)
+                {
+                    LOG_WARNING_LIMITED(10) << getFunctionId("activate_connection", "Server") <<  " Dropping Client(" << connection->getPort() << "): " << ec.message();
+                    remove_connection(connection->getPort());
+                    return;
+                }
+                start_receiving(connection);
+            });
+    }
+    
+    connection->start();
+}
+
+void ServerBase::start_receiving(std::shared_ptr<Connection> connection)
+{
+    LOG_DEBUG << getFunctionId(__func__, "Server") <<  " Setting Async Rx Callback for Client(" << connection->getPort() << ")";
+    connection->asyncReceive(
+        [=](const boost::system::error_code& ec, const uint8_t* data, size_t bytes)
+        {
+            rx_callback(ec, data, bytes, connection);
+        });
+}
+
+void ServerBase::adopt_connections()
+{
+    std::string function_id = getFunctionId(__func__, "Server");
+
+    for(HandedOffConnection& handed : adopted.connections)
+    {
+        std::shared_ptr<Connection> connection = make_connection();
+        Endpoint remote_endpoint;
+        try
+        {
+            connection->getSocket().assign(server_endpoint.protocol(), handed.fd);
+            handed.fd = -1;
+            remote_endpoint = connection->getSocket().remote_endpoint();
+        }
+        catch(const std::exception& e)
+        {
+            LOG_WARNING_LIMITED(10) << function_id <<  " Dropping handed off Client(" << handed.port << "): " << e.what();
+            continue;
+        }
+
+        connection->setPort(handed.port);
+        if(getPort(remote_endpoint) == 0)
+        {
+            // unbound unix clients keep their ids, new ones get ids past them
+            next_anonymous_port = std::max(next_anonymous_port, handed.port);
+        }
+        if(!admit_connection(connection, remote_endpoint)) continue;
+
+        if(!connection->restore(handed, compressor))
+        {
+            LOG_WARNING_LIMITED(10) << function_id <<  " Dropping handed off Client(" << handed.port << "): its frames use another codec or dictionary";
+            continue;
+        }
+
+        LOG_DEBUG << function_id <<  " Handed off connection adopted with Client(" << handed.port << ")";
+        activate_connection(connection);
+    }
+    adopted.close();
+}
+
+void ServerBase::start_up()
+{
+    std::string function_id = getFunctionId(__func__, "Server");
+
+    LOG_DEBUG << function_id <<  " Starting SERVER thread";
+
+    try
+    {
+        if(adopted.listener_fd >= 0)
+        {
+            // already bound (and listening) in the process we take over from
+            LOG_DEBUG << function_id <<  " ADOPT listening socket [" << toString(server_endpoint) << "]";
+            acceptor->assign(server_endpoint.protocol(), adopted.listener_fd);
+            adopted.listener_fd = -1;
+        }
+        else
+        {
+            LOG_DEBUG << function_id <<  " OPEN " << ((transport == Transport::Tcp) ? "ip_v4" : "unix") << " socket";
+            acceptor->open(server_endpoint.protocol());
+
+            if(transport == Transport::Tcp)
+            {
+                LOG_DEBUG << function_id <<  " SET_OPTION reuse_address(true)";
+                acceptor->set_option(Acceptor::reuse_address(true));
+            }
+            else
+            {
+                // unix sockets have no reuse_address, remove the stale socket file instead
+                ::unlink(getTransportPath(server_address).c_str());
+            }
+            
+            LOG_DEBUG << function_id <<  " BIND [" << toString(server_endpoint) << "]";
+            acceptor->bind(server_endpoint);
+        }
+
+        if(tls_config.enabled)
+        {
+            if(transport == Transport::SharedMemory)
+            {
+                LOG_WARNING << function_id <<  " TLS is not used on the shared memory transport";
+            }
+            else
+            {
+                LOG_DEBUG << function_id <<  " Loading TLS certificate " << tls_config.certificate_file;
+                tls_context = makeServerTlsContext(tls_config);
+            }
+        }
+
+        // always there: clients may ask for framing even when we do not compress
+        compressor = std::make_shared<Compressor>(compression_config);
+        start_io_pool();
+
+        LOG_DEBUG << function_id <<  " LISTEN start";
+        acceptor->listen(boost::asio::socket_base::max_connections);    
+        // accept() only once poll() saw a connection, stop() wakes the poll up through accept_wakeup
+        acceptor->non_blocking(true);
+
+        adopt_connections();
+
+        {
+            std::lock_guard<std::mutex> lock(state_mutex);
+            listening = true;
+        }
+        state_cv.notify_all();
+
+        while(!stopping)
+        {
+            if (acceptor->is_open())
+            {
+                if(admission->getLimits().policy == OverloadPolicy::PauseAccept && !admission->waitForCapacity())
+                {
+                    break;
+                }
+
+                LOG_DEBUG << function_id <<  " ACCEPTOR is open ... start waiting for a new connections";
+                if(!wait_for_accept()) break;
+
+                std::shared_ptr<Connection> connection = make_connection();
+                
+                boost::system::error_code ec;
+                acceptor->accept(connection->getSocket(), ec);
+                if(ec == boost::asio::error::would_block || ec == boost::asio::error::try_again)
+                {
+                    // taken by the successor sharing the listening socket, or gone again
+                    continue;
+                }
+                if(ec)
+                {
+                    throw boost::system::system_error(ec);
+                }
+
+                Endpoint remote_endpoint = connection->getSocket().remote_endpoint();
+                uint16_t clientPort = getPort(remote_endpoint);
+                if(clientPort == 0)
+                {
+                    // unbound unix client, give it an id of its own
+                    clientPort = ++next_anonymous_port;
+                }
+                connection->setPort(clientPort);
+
+                if(!admit_connection(connection, remote_endpoint)) continue;
+
+                LOG_DEBUG << function_id <<  " New connection accepted with Client(" << clientPort << ")";
+
+                try
+                {
+                    if(transport == Transport::SharedMemory)
+                    {
+                        // the client created the segment before connecting
+                        std::shared_ptr<ShmChannel> shm = ShmChannel::open(getShmName(server_address, clientPort));
+                        std::weak_ptr<Connection> weak_connection = connection;
+                        shm->start([this, weak_connection](const uint8_t* data, size_t bytes)
+                            {
+                                std::shared_ptr<Connection> client_connection = weak_connection.lock();
+                                if(!client_connection) return;
+
+                                Tracer::stamp(Tracer::sample(), TraceStage::ReadComplete, client_connection->getPort());
+                                size_t messages = 0;
+                                if(!receive(data, bytes, client_connection, messages))
+                                {
+                                    remove_connection(client_connection->getPort());
+                                    return;
+                                }
+
+                                // this is the reader thread of the ring, waiting here leaves the data in the ring
+                                std::chrono::nanoseconds delay = client_connection->throttle(messages, bytes);
+                                if(delay.count() > 0)
+                                {
+                                    ++throttled_reads;
+                                    std::this_thread::sleep_for(delay);
+                                }
+
+                                if(!client_connection->waitForCredit(std::chrono::milliseconds(0)))
+                                {
+                                    ++paused_reads;
+                                    // the connection may go away meanwhile, its acknowledgements with it
+                                    while(!client_connection->waitForCredit(std::chrono::milliseconds(100)))
+                                    {
+                                        if(getConnection(client_connection->getPort()) != client_connection) return;
+                                    }
+                                }
+                            },
+                            [this, weak_connection]()
+                            {
+                                // the client broke the ring format, it reconnects with a fresh segment
+                                std::shared_ptr<Connection> client_connection = weak_connection.lock();
+                                if(client_connection) remove_connection(client_connection->getPort());
+                            });
+                        connection->attachShm(shm);
+                    }
+                    else if(tls_context)
+                    {
+                        // the handshake runs on the connection thread (see activate_connection), a slow client only holds up itself
+                        connection->attachTls(std::make_unique<TlsChannel>(*tls_context, connection->getSocket(), true));
+                    }
+                }
+                catch(const std::exception& e)
+                {
+                    // only this client is affected, keep accepting
+                    LOG_WARNING_LIMITED(10) << function_id <<  " Dropping Client(" << clientPort << "): " << e.what();
+                    continue;
+                }
+
+                activate_connection(connection);
+
+                // LOG_DEBUG << function_id <<  " Starting io_context run";
+                // io.run();
+                
+            }
+            else
+            {
+                LOG_ERROR << function_id <<  " ACCEPTOR is closed";
+                break;
+            }
+        }
+    
+    }
+    catch(const std::exception& e)
+    {
+        if(!stopping)
+        {
+            LOG_ERROR << function_id << " " << e.what();
+        }
+    }    
+
+    {
+        std::lock_guard<std::mutex> lock(state_mutex);
+        listening = false;
+        stopped = true;
+    }
+    state_cv.notify_all();
+
+    LOG_DEBUG << function_id <<  " SERVER thread stopped";
+    if(!stopping && stopped_callback)
+    {
+        stopped_callback();
+    }
+}
+
+void ServerBase::rx_callback(const boost::system::error_code& ec, const uint8_t* data, size_t bytes, std::shared_ptr<Connection> client_connection)
+{
+    std::string function_id = getFunctionId(__func__, "Server");
+    uint16_t clientPort = client_connection->getPort();
+    
+    if(ec)
+    {
+        std::lock_guard<FairMutex> lock(rx_mutex);
+
+        if(ec == boost::asio::error::operation_aborted) return; // we are shutting the connection down
+
+        if(ec == boost::asio::error::eof)
+        {
+            // the normal way for a client to leave, not worth a warning
+            LOG_DEBUG << function_id <<  " Client(" << clientPort << ") closed the connection!";
+        }
+        else
+        {
+            LOG_WARNING_LIMITED(10) << function_id <<  " Erro code: " << ec.message();
+        }
+        // the connection is unusable either way (eof, reset, TLS failure)
+        remove_connection(clientPort);
+        return;
+    }
+
+    if(bytes)
+    {
+        Tracer::stamp(Tracer::sample(), TraceStage::ReadComplete, clientPort);
+
+        setReceiveTimestamp(client_connection->getTimestamps().getReceiveTime());
+        size_t messages = 0;
+        bool valid = receive(data, bytes, client_connection, messages);
+        setReceiveTimestamp(std::chrono::system_clock::time_point());
+        client_connection->sampleFootprint();
+        if(!valid)
+        {
+            remove_connection(clientPort);
+            return;
+        }
+        // stamps of replies the connection is not writing after
+        client_connection->reapTimestamps();
+
+        // over the limit: read later instead of dropping, the client sees TCP backpressure meanwhile
+        std::chrono::nanoseconds delay = client_connection->throttle(messages, bytes);
+        if(delay.count() > 0)
+        {
+            ++throttled_reads;
+            LOG_DEBUG << function_id <<  " Client(" << clientPort << ") over its rate limit, next read in " 
+                      << std::chrono::duration_cast<std::chrono::microseconds>(delay).count() << "us";
+        }
+
+        // the handler is behind, leave the data in the socket until it acknowledges enough messages;
+        // the parked read must not keep the connection alive, it is kept by the connection itself
+        std::weak_ptr<Connection> weak_connection = client_connection;
+        if(client_connection->hasCredits() && client_connection->parkIfOutOfCredit(
+            [this, weak_connection](const boost::system::error_code& ec, const uint8_t* data, size_t bytes)
+            {
+                std::shared_ptr<Connection> client_connection = weak_connection.lock();
+                if(client_connection)
+                {
+                    rx_callback(ec, data, bytes, client_connection);
+                }
+            }))
+        {
+            ++paused_reads;
+            LOG_DEBUG << function_id <<  " Client(" << clientPort << ") out of credit, reading resumes on acknowledge()";
+            return;
+        }
+
+        LOG_DEBUG << function_id <<  " Setting Async Rx Callback for Client(" << clientPort << ")";
+        client_connection->asyncReceive(
+            [=](const boost::system::error_code& ec, const uint8_t* data, size_t bytes)
+            {
+                rx_callback(ec, data, bytes, client_connection);
+            }, delay);
+    }
+
+}
+
+bool ServerBase::receive(const uint8_t* data, size_t bytes, std::shared_ptr<Connection> client_connection, size_t& messages)
+{
+    std::string function_id = getFunctionId(__func__, "Server");
+
+    Payload first_bytes;
+    if(client_connection->awaitsHello())
+    {
+        Payload& prefix = client_connection->getHelloPrefix();
+        if(!prefix.empty() || bytes < sizeof(Hello))
+        {
+            size_t taken = std::min(bytes, sizeof(Hello) - prefix.size());
+            prefix.insert(prefix.end(), data, data + taken);
+            if(prefix.size() < sizeof(Hello) && mayBeHello(prefix.data(), prefix.size()))
+            {
+                // the rest of the Hello is in a later read
+                return true;
+            }
+            // a raw client gets what was held back in front of the rest
+            prefix.insert(prefix.end(), data + taken, data + bytes);
+            first_bytes.swap(prefix);
+            data = first_bytes.data();
+            bytes = first_bytes.size();
+        }
+        client_connection->settleHello();
+
+        if(isHello(data, bytes))
+        {
+            Hello offer;
+            std::memcpy(&offer, data, sizeof(offer));
+            negotiate(offer, client_connection);
+
+            data += sizeof(offer);
+            bytes -= sizeof(offer);
+        }
+    }
+
+    if(!client_connection->isFramed())
+    {
+        if(bytes)
+        {
+            process_payload(data, bytes, client_connection);
+            ++messages;
+        }
+        return true;
+    }
+
+    bool valid = true;
+    Payload message;
+    bool complete = client_connection->readFrames(data, bytes, [&](const FrameHeader& header, const uint8_t* body)
+        {
+            if(!valid) return;
+            FrameHeader frame = header;
+            if(client_connection->isChecksummed())
+            {
+                if(!client_connection->verify(frame, body))
+                {
+                    ++failed_frames;
+                    LOG_WARNING_LIMITED(10) << function_id <<  " Checksum mismatch in a frame from Client(" << client_connection->getPort() << "), dropping its message";
+                    return;
+                }
+                ++verified_frames;
+            }
+            valid = client_connection->decode(frame, body, message);
+            bool corrupt = false;
+            if(valid && client_connection->assemble(frame, message, corrupt))
+            {
+                process_payload(message.data(), message.size(), client_connection);
+                ++messages;
+            }
+            valid = valid && !corrupt;
+        });
+
+    if(!complete || !valid)
+    {
+        LOG_WARNING_LIMITED(10) << function_id <<  " Corrupt frame from Client(" << client_connection->getPort() << "), dropping it";
+        return false;
+    }
+    return true;
+}
+
+void ServerBase::negotiate(const Hello& offer, std::shared_ptr<Connection> client_connection)
+{
+    std::string function_id = getFunctionId(__func__, "Server");
+    uint16_t clientPort = client_connection->getPort();
+
+    Codec codec = Codec::None;
+    Codec preferred = compressor->getCodec();
+    if(preferred != Codec::None && (offer.codecs & (uint8_t)preferred))
+    {
+        if(offer.dictionary_id == compressor->getDictionaryId())
+        {
+            codec = preferred;
+        }
+        else
+        {
+            LOG_WARNING << function_id <<  " Client(" << clientPort << ") uses another compression dictionary, sending uncompressed";
+        }
+    }
+
+    LOG_DEBUG << function_id <<  " Client(" << clientPort << ") framing negotiated, compression: " << toString(codec);
+    // chunks are always understood, they are only sent to clients that can join them
+    uint8_t features = offer.features & (HelloChunks | (integrity ? HelloChecksums : 0));
+    client_connection->enableFraming(codec, compressor, makeHello((uint8_t)codec, (codec == Codec::None) ? 0 : compressor->getDictionaryId(),
+                                                                  features));
+}
+
+void ServerBase::process_payload(const uint8_t* data, size_t bytes, std::shared_ptr<Connection> client_connection)
+{
+    uint16_t clientPort = client_connection->getPort();
+
+    if(capture)
+    {
+        capture->record(clientPort, data, bytes);
+    }
+
+    // pending from here on, including the time spent waiting for the other connections to take their turn
+    if(!admission->beginMessage(data, bytes))
+    {
+        std::string function_id = getFunctionId(__func__, "Server");
+        LOG_DEBUG << function_id <<  " Overloaded, shedding " << bytes << " bytes from Client(" << clientPort << ")";
+        // the next message of this thread must not be stamped as this one
+        Tracer::setCurrent(0);
+        return;
+    }
+    PendingMessage pending(*admission, *client_connection, bytes);
+
+    // hits skip the handler lock, they never wait for the handlers of other connections
+    bool cacheable = response_cache && response_cache->isCacheable(data, bytes);
+    uint64_t hash = cacheable ? hashPayload(data, bytes) : 0;
+    if(cacheable && serve_cached(hash, data, bytes, *client_connection))
+    {
+        Tracer::setCurrent(0);
+        return;
+    }
+
+    ResponseCapture capture_state{clientPort, {}, false};
+    {
+        std::lock_guard<FairMutex> lock(rx_mutex);
+
+        // only the first message of a sampled read is traced
+        uint64_t trace_id = Tracer::current();
+        Tracer::stamp(trace_id, TraceStage::LockAcquired, clientPort);
+
+        Tracer::stamp(trace_id, TraceStage::HandlerStart, clientPort);
+        std::chrono::system_clock::time_point received = getReceiveTimestamp();
+        if(received != std::chrono::system_clock::time_point())
+        {
+            kernel_to_handler.record(std::chrono::system_clock::now() - received);
+        }
+        ResponseCaptureScope capture_scope(cacheable ? &capture_state : nullptr);
+        // taken before the call, the handler may acknowledge right away
+        if(client_connection->hasCredits())
+        {
+            pending.takeCredit();
+        }
+        if(dispatch(*this, clientPort, data, bytes))
+        {
+            pending.keepCredit();
+        }
+        else
+        {
+            // no handler to acknowledge it, the credit goes back with pending
+            // if no hadnler is defined simply Pong the client (use as default impl - maybe be comment out this section later)
+            LOG_DEBUG << getFunctionId(__func__, "Server") <<  " Sending PONG to Client(" << clientPort << ")";
+            Payload& pong = client_connection->getTxBuffer();
+            Tracer::stamp(trace_id, TraceStage::WriteQueued, clientPort);
+            client_connection->writeMessage(pong.data(), pong.size(), Priority::Control);
+            Tracer::stamp(trace_id, TraceStage::WriteComplete, clientPort);
+        }
+        Tracer::stamp(trace_id, TraceStage::HandlerEnd, clientPort);
+        Tracer::setCurrent(0);
+    }
+
+    if(!capture_state.uncacheable && !capture_state.responses.empty())
+    {
+        response_cache->insert(hash, data, bytes, std::move(capture_state.responses));
+    }
+}
+
+ServerBase::PendingMessage::PendingMessage(AdmissionControl& admission_, Connection& connection_, size_t bytes_)
+    : admission(admission_), connection(connection_), bytes(bytes_), credit(false)
+{
+    connection.beginMessage();
+}
+
+ServerBase::PendingMessage::~PendingMessage()
+{
+    if(credit)
+    {
+        connection.returnCredit(bytes);
+    }
+    connection.finishMessage();
+    admission.finishMessage(bytes);
+}
+
+void ServerBase::PendingMessage::takeCredit()
+{
+    connection.takeCredit(bytes);
+    credit = true;
+}
+
+void ServerBase::PendingMessage::keepCredit()
+{
+    credit = false;
+}
+
+bool ServerBase::serve_cached(uint64_t hash, const uint8_t* data, size_t bytes, Connection& client_connection)
+{
+    std::vector<CachedResponse> responses;
+    if(!response_cache->lookup(hash, data, bytes, responses)) return false;
+
+    LOG_DEBUG << getFunctionId(__func__, "Server") <<  " Answering Client(" << client_connection.getPort() << ") from the response cache";
+    for(auto& response : responses)
+    {
+        client_connection.writeMessage(response.payload->data(), response.payload->size(), response.priority);
+    }
+    return true;
+}
+
+
+ServerBase::Connection::Connection(Context* shared_context_)
+    : own_context(shared_context_ ? nullptr : std::make_shared<Context>()), context_io(shared_context_ ? *shared_context_ : *own_context),
+      socket(std::make_shared<Socket>(context_io)), port(0), zerocopy(std::make_unique<ZeroCopySender>(*socket)), zerocopy_reaper_armed(false),
+      framed(false), codec(Codec::None), first_receive(true), chunked(false), checksummed(false),
+      verified_frames(0), failed_frames(0), throttle_timer(context_io), admitted_bytes(0),
+      inflight_messages(0), inflight_bytes(0), pending_messages(0), send_to_wire(nullptr), detaching(false), handed_off(false),
+      async_writing(false), receive_buffer_bytes(0)
+{
+
+}
+
+ServerBase::Connection::~Connection()
+{
+    std::string function_id = getFunctionId(__func__, "Server");
+
+    rx_buffer.resize(0);
+    tx_buffer.resize(0);
+
+    if(shm)
+    {
+        shm->stop();
+    }
+
+    if(admission)
+    {
+        admission->releaseConnection(admitted_bytes);
+    }
+
+    try
+    {
+        LOG_DEBUG << function_id <<  " Deleting endpoint: " << port;
+        // never opened if we were stopped while waiting in accept()
+        boost::system::error_code ignored;
+        socket->cancel(ignored);
+        socket->close(ignored);
+        
+        // a shared pool context keeps serving the other connections
+        if(own_context)
+        {
+            context_io.stop();
+            LOG_DEBUG << function_id <<  " Endpoint(" << port << ") context_io stopped: " << std::boolalpha << context_io.stopped();
+            if(_thread.joinable()) _thread.detach(); // cannot use join since this is most likely being executted in the same context (ServerBase::rx_callback() uses this thread context)
+            LOG_DEBUG << function_id <<  " Endpoint(" << port << ") thread detached";
+        }
+    }
+    catch(const std::exception& e)
+    {
+        LOG_ERROR << function_id << e.what();
+    }
+}
+
+void ServerBase::Connection::start()
+{
+    if(own_context)
+    {
+        // the last reference to a connection is often dropped by one of its own handlers, the destructor then
+        // stops the context and detaches while run() is still on the stack, so the thread keeps the context alive
+        std::shared_ptr<Context> context = own_context;
+        _thread = std::thread([context](){ context->run(); });
+    }
+}
+
+void ServerBase::Connection::attachShm(std::shared_ptr<ShmChannel> shm_)
+{
+    shm = shm_;
+}
+
+void ServerBase::Connection::attachTls(std::unique_ptr<TlsChannel> tls_)
+{
+    tls = std::move(tls_);
+}
+
+bool ServerBase::Connection::hasTls() const
+{
+    return (bool)tls;
+}
+
+void ServerBase::Connection::asyncHandshake(HandshakeCallback callback)
+{
+    std::weak_ptr<Connection> weak_connection = shared_from_this();
+
+    // the reads have not started yet, the timer is free until they do
+    throttle_timer.expires_after(tls_handshake_timeout);
+    throttle_timer.async_wait([weak_connection](const boost::system::error_code& ec)
+    {
+        std::shared_ptr<Connection> connection = weak_connection.lock();
+        if(!connection || ec) return;
+
+        boost::system::error_code ignored;
+        connection->socket->cancel(ignored);
+    });
+
+    boost::asio::post(context_io, [weak_connection, callback]()
+    {
+        std::shared_ptr<Connection> connection = weak_connection.lock();
+        if(connection)
+        {
+            connection->continueHandshake(callback);
+        }
+    });
+}
+
+void ServerBase::Connection::continueHandshake(HandshakeCallback callback)
+{
+    Socket::wait_type wait = Socket::wait_read;
+    try
+    {
+        if(tls->handshakeStep(wait))
+        {
+            throttle_timer.cancel();
+            callback(boost::system::error_code());
+            return;
+        }
+    }
+    catch(const std::exception& e)
+    {
+        LOG_DEBUG << getFunctionId(__func__, "Server") <<  " Client(" << port << ") " << e.what();
+        throttle_timer.cancel();
+        callback(boost::asio::error::connection_aborted);
+        return;
+    }
+
+    std::weak_ptr<Connection> weak_connection = shared_from_this();
+    socket->async_wait(wait, [weak_connection, callback](const boost::system::error_code& ec)
+    {
+        std::shared_ptr<Connection> connection = weak_connection.lock();
+        if(!connection) return;
+
+        if(ec)
+        {
+            // cancelled by the timer
+            callback((ec == boost::asio::error::operation_aborted) ? boost::asio::error::timed_out : ec);
+            return;
+        }
+        connection->continueHandshake(callback);
+    });
+}
+
+void ServerBase::Connection::enableFraming(Codec codec_, std::shared_ptr<Compressor> compressor_, const Hello& answer)
+{
+    std::lock_guard<std::mutex> lock(tx_mutex);
+
+    compressor = compressor_;
+    codec = codec_;
+    chunked = (answer.features & HelloChunks) != 0;
+    checksummed = (answer.features & HelloChecksums) != 0;
+
+    // the answer is the last raw message, no writer may slip in between
+    if(tls)
+    {
+        tls->write(reinterpret_cast<const uint8_t*>(&answer), sizeof(answer));
+    }
+    else if(writesAsync())
+    {
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&answer);
+        lanes.push(Priority::Control, {std::make_shared<const Payload>(bytes, bytes + sizeof(answer))});
+        writeNextLocked();
+    }
+    else
+    {
+        boost::asio::write(*socket, boost::asio::buffer(&answer, sizeof(answer)));
+    }
+    framed = true;
+}
+
+bool ServerBase::Connection::isFramed() const
+{
+    return framed;
+}
+
+bool ServerBase::Connection::isChunked() const
+{
+    return chunked;
+}
+
+bool ServerBase::Connection::isChecksummed() const
+{
+    return checksummed;
+}
+
+bool ServerBase::Connection::awaitsHello() const
+{
+    return first_receive && !shm;
+}
+
+Payload& ServerBase::Connection::getHelloPrefix()
+{
+    return hello_prefix;
+}
+
+void ServerBase::Connection::settleHello()
+{
+    first_receive = false;
+}
+
+Codec ServerBase::Connection::getCodec() const
+{
+    return codec;
+}
+
+void ServerBase::Connection::encode(const uint8_t* data, size_t bytes, Payload& frame_)
+{
+    size_t start = frame_.size();
+    compressor->encode(codec, data, bytes, frame_);
+    if(checksummed)
+    {
+        sealFrame(frame_, start);
+    }
+}
+
+bool ServerBase::Connection::decode(const FrameHeader& header, const uint8_t* body, Payload& rxBuffer_)
+{
+    return compressor->decode(codec, header, body, rxBuffer_);
+}
+
+bool ServerBase::Connection::verify(FrameHeader& header_, const uint8_t* body)
+{
+    if(!checksummed) return true;
+
+    if(!verifyFrame(header_, body))
+    {
+        ++failed_frames;
+        // only called from the reading thread, as assemble()
+        chunk_assembler.drop(header_);
+        return false;
+    }
+    ++verified_frames;
+    return true;
+}
+
+IntegrityStats ServerBase::Connection::getIntegrityStats() const
+{
+    IntegrityStats stats;
+    stats.verified_frames = verified_frames;
+    stats.failed_frames = failed_frames;
+    return stats;
+}
+
+bool ServerBase::Connection::readFrames(const uint8_t* data, size_t bytes, const FrameReader::FrameCallback& callback)
+{
+    return frame_reader.feed(data, bytes, callback);
+}
+
+bool ServerBase::Connection::assemble(const FrameHeader& header, Payload& message_, bool& corrupt_)
+{
+    return chunk_assembler.add(header, message_, corrupt_);
+}
+
+void ServerBase::Connection::write(boost::asio::const_buffer buffer)
+{
+    if(writesAsync())
+    {
+        const uint8_t* data = static_cast<const uint8_t*>(buffer.data());
+        writeFrames(Priority::Normal, {std::make_shared<const Payload>(data, data + buffer.size())});
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(tx_mutex);
+    writeLocked(buffer);
+}
+
+bool ServerBase::Connection::writesAsync() const
+{
+    return !own_context && !shm && !tls;
+}
+
+void ServerBase::Connection::writeNextLocked()
+{
+    OutboundLanes::Frame frame;
+    if(async_writing || handed_off || !lanes.next(frame)) return;
+
+    async_writing = true;
+    std::chrono::system_clock::time_point started = timestamps.isEnabled() ? std::chrono::system_clock::now() : std::chrono::system_clock::time_point();
+    std::shared_ptr<Connection> connection = shared_from_this();
+    boost::asio::async_write(*socket, boost::asio::buffer(*frame),
+        [connection, frame, started](const boost::system::error_code& ec, size_t bytes)
+        {
+            std::lock_guard<std::mutex> lock(connection->tx_mutex);
+            connection->async_writing = false;
+            if(ec)
+            {
+                // the connection is broken, its read fails and removes it
+                connection->lanes.clear();
+                return;
+            }
+            if(started != std::chrono::system_clock::time_point())
+            {
+                connection->timestamps.sent(bytes, started);
+                connection->timestamps.reap(*connection->send_to_wire);
+            }
+            connection->writeNextLocked();
+        });
+}
+
+void ServerBase::Connection::writeLocked(boost::asio::const_buffer buffer)
+{
+    // the socket belongs to the successor now
+    if(handed_off) return;
+
+    if(shm)
+    {
+        shm->write(static_cast<const uint8_t*>(buffer.data()), buffer.size());
+        return;
+    }
+
+    if(tls)
+    {
+        tls->write(static_cast<const uint8_t*>(buffer.data()), buffer.size());
+        return;
+    }
+
+    if(!timestamps.isEnabled())
+    {
+        boost::asio::write(*socket, buffer);
+        return;
+    }
+
+    std::chrono::system_clock::time_point started = std::chrono::system_clock::now();
+    boost::asio::write(*socket, buffer);
+    timestamps.sent(buffer.size(), started);
+    timestamps.reap(*send_to_wire);
+}
+
+void ServerBase::Connection::writeMessage(const uint8_t* data, size_t bytes, Priority priority)
+{
+    if(framed && chunked && bytes > chunk_bytes)
+    {
+        writeFrames(priority, makeFrames(data, bytes, priority));
+        return;
+    }
+
+    // reused per thread, frames are built and written before the next one
+    static thread_local Payload frame;
+    if(framed)
+    {
+        frame.clear();
+        encode(data, bytes, frame);
+        data = frame.data();
+        bytes = frame.size();
+    }
+
+    if(!writesAsync())
+    {
+        // nothing waiting on any lane: straight out, without a copy
+        std::lock_guard<std::mutex> lock(tx_mutex);
+        if(lanes.empty())
+        {
+            writeLocked(boost::asio::buffer(data, bytes));
+            return;
+        }
+    }
+    writeFrames(priority, {std::make_shared<const Payload>(data, data + bytes)});
+}
+
+std::vector<OutboundLanes::Frame> ServerBase::Connection::makeFrames(const uint8_t* data, size_t bytes, Priority priority)
+{
+    return tcp::makeFrames(framed ? compressor.get() : nullptr, codec, chunked, checksummed, priority, data, bytes);
+}
+
+void ServerBase::Connection::writeFrames(Priority priority, std::vector<OutboundLanes::Frame> frames)
+{
+    OutboundLanes::Ticket ticket = lanes.push(priority, std::move(frames));
+
+    if(writesAsync())
+    {
+        std::lock_guard<std::mutex> lock(tx_mutex);
+        writeNextLocked();
+        return;
+    }
+
+    // one frame per turn on the lock, so a sender of a higher lane gets in between
+    while(true)
+    {
+        std::lock_guard<std::mutex> lock(tx_mutex);
+        OutboundLanes::Frame frame;
+        if(lanes.done(ticket) || !lanes.next(frame)) return;
+
+        try
+        {
+            writeLocked(boost::asio::buffer(*frame));
+        }
+        catch(...)
+        {
+            // the connection is broken, the other senders must not wait for their frames
+            lanes.clear();
+            throw;
+        }
+    }
+}
+
+void ServerBase::Connection::enqueue(std::vector<OutboundLanes::Frame> frames, size_t bytes, Priority priority)
+{
+    // the payload is shared, each receiver is charged for it while it waits on its own queue
+    if(admission && !admission->charge(bytes, priority))
+    {
+        return;
+    }
+
+    std::weak_ptr<Connection> weak_connection = shared_from_this();
+    std::shared_ptr<AdmissionControl> charged = admission;
+    boost::asio::post(context_io, [weak_connection, frames, bytes, priority, charged]()
+    {
+        std::shared_ptr<Connection> connection = weak_connection.lock();
+        if(connection)
+        {
+            try
+            {
+                connection->writeFrames(priority, frames);
+            }
+            catch(const std::exception& e)
+            {
+                LOG_WARNING_LIMITED(10) << getFunctionId("enqueue", "Server") << " Client(" << connection->getPort() << ") " << e.what();
+            }
+        }
+
+        if(charged)
+        {
+            charged->release(bytes);
+        }
+    });
+}
+
+void ServerBase::Connection::setAdmission(std::shared_ptr<AdmissionControl> admission_, size_t admitted_bytes_)
+{
+    admission = admission_;
+    admitted_bytes = admitted_bytes_;
+}
+
+static size_t getDefaultStackSize()
+{
+    static const size_t stack_size = []()
+    {
+        size_t size = 0;
+        pthread_attr_t attributes;
+        if(pthread_attr_init(&attributes) == 0)
+        {
+            pthread_attr_getstacksize(&attributes, &size);
+            pthread_attr_destroy(&attributes);
+        }
+        return size;
+    }();
+    return stack_size;
+}
+
+ConnectionFootprint ServerBase::Connection::getFootprint() const
+{
+    ConnectionFootprint footprint;
+    footprint.object_bytes = sizeof(Connection) + sizeof(Socket) + sizeof(ZeroCopySender);
+    footprint.buffer_bytes = receive_buffer_bytes + tx_buffer.capacity() + lanes.getQueuedBytes() + zerocopy->pendingBytes();
+    footprint.fds = 1;
+    if(own_context)
+    {
+        footprint.context_bytes = sizeof(Context);
+        footprint.stack_bytes = getDefaultStackSize();
+        footprint.fds += 3;
+    }
+    return footprint;
+}
+
+void ServerBase::Connection::sampleFootprint()
+{
+    receive_buffer_bytes = rx_buffer.capacity() + hello_prefix.capacity() + frame_reader.getBufferedBytes() +
+                           chunk_assembler.getBufferedBytes();
+}
+
+void ServerBase::Connection::sendZeroCopy(std::unique_ptr<Payload> txBuffer_, ZeroCopySender::Completion completion_)
+{
+    {
+        std::lock_guard<std::mutex> lock(tx_mutex);
+        if(handed_off)
+        {
+            if(completion_)
+            {
+                completion_(std::move(txBuffer_));
+            }
+            return;
+        }
+        zerocopy->send(std::move(txBuffer_), completion_);
+    }
+    armZeroCopyReaper();
+}
+
+void ServerBase::Connection::sendFile(int fd, off_t offset, size_t count)
+{
+    std::string function_id = getFunctionId(__func__, "Connection");
+
+    std::lock_guard<std::mutex> lock(tx_mutex);
+    if(handed_off) return;
+
+    while(count > 0)
+    {
+        // framed peers get the file as uncompressed frames, the body still goes out with sendfile
+        size_t chunk = framed ? std::min(count, max_frame_length) : count;
+        uint32_t checksum = 0;
+        if(framed)
+        {
+            FrameHeader header = {};
+            header.length = header.raw_length = (uint32_t)chunk;
+            if(checksummed)
+            {
+                // the body is read once more to checksum it, nothing goes out if that fails
+                header.length += sizeof(checksum);
+                header.flags = FrameChecksum;
+                checksum = crc32c(reinterpret_cast<const uint8_t*>(&header), sizeof(header));
+                if(!checksumFile(fd, offset, chunk, checksum))
+                {
+                    LOG_ERROR_LIMITED(10) << function_id << " Could not read the file to checksum it: " << std::strerror(errno);
+                    return;
+                }
+            }
+            if(tls)
+            {
+                tls->write(reinterpret_cast<const uint8_t*>(&header), sizeof(header));
+            }
+            else
+            {
+                boost::asio::write(*socket, boost::asio::buffer(&header, sizeof(header)));
+            }
+        }
+
+        if(tls)
+        {
+            // SSL_sendfile when the kernel does the encryption, read + encrypt otherwise
+            tls->sendFile(fd, offset, chunk);
+        }
+        else
+        {
+            zerocopy->sendFile(fd, offset, chunk);
+        }
+
+        if(checksummed)
+        {
+            if(tls)
+            {
+                tls->write(reinterpret_cast<const uint8_t*>(&checksum), sizeof(checksum));
+            }
+            else
+            {
+                boost::asio::write(*socket, boost::asio::buffer(&checksum, sizeof(checksum)));
+            }
+        }
+
+        offset += chunk;
+        count -= chunk;
+    }
+}
+
+std::future<void> ServerBase::Connection::stopReading()
+{
+    std::future<void> result = reads_stopped.get_future();
+    detach_work = std::make_unique<boost::asio::executor_work_guard<Context::executor_type>>(context_io.get_executor());
+
+    // reads run on the connection thread, stopping them there leaves none half done
+    std::shared_ptr<Connection> connection = shared_from_this();
+    boost::asio::post(context_io, [connection]()
+    {
+        connection->detaching = true;
+
+        boost::system::error_code ignored;
+        connection->throttle_timer.cancel();
+        connection->socket->cancel(ignored);
+        {
+            std::lock_guard<std::mutex> lock(connection->credit_mutex);
+            connection->parked_read = nullptr;
+            connection->parked_work.reset();
+        }
+
+        // after the completions the cancel queued: a read that already got data delivers it first
+        boost::asio::post(connection->context_io, [connection](){ connection->reads_stopped.set_value(); });
+    });
+    return result;
+}
+
+bool ServerBase::Connection::waitUntilIdle(std::chrono::steady_clock::time_point deadline)
+{
+    // a handler still holding a message may answer it any time, the answer must go out on this socket
+    std::unique_lock<std::mutex> lock(credit_mutex);
+    return credit_cv.wait_until(lock, deadline, [this](){ return pending_messages == 0 && inflight_messages == 0; });
+}
+
+std::future<HandedOffConnection> ServerBase::Connection::detach()
+{
+    std::future<HandedOffConnection> result = detached.get_future();
+
+    std::shared_ptr<Connection> connection = shared_from_this();
+    boost::asio::post(context_io, [connection](){ connection->finishDetach(); });
+    return result;
+}
+
+void ServerBase::Connection::finishDetach()
+{
+    std::string function_id = getFunctionId(__func__, "Server");
+
+    HandedOffConnection state;
+    try
+    {
+        {
+            std::lock_guard<std::mutex> lock(tx_mutex);
+            if(async_writing)
+            {
+                // the frame in flight goes out first, its completion needs a pool thread, not one waiting here
+                std::shared_ptr<Connection> connection = shared_from_this();
+                boost::asio::post(context_io, [connection](){ connection->finishDetach(); });
+                return;
+            }
+            OutboundLanes::Frame frame;
+            while(lanes.next(frame))
+            {
+                writeLocked(boost::asio::buffer(*frame));
+            }
+            handed_off = true;
+        }
+
+        // the kernel still reads the pages of zero-copy sends, their completions must not reach the successor
+        for(int i = 0; i < 100 && zerocopy->pending() > 0; ++i)
+        {
+            pollfd fds = {socket->native_handle(), POLLERR, 0};
+            ::poll(&fds, 1, 10);
+            zerocopy->reap();
+        }
+        timestamps.disable();
+        alignas(cmsghdr) char control[256];
+        msghdr msg = {};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        while(::recvmsg(socket->native_handle(), &msg, MSG_ERRQUEUE | MSG_DONTWAIT) >= 0)
+        {
+            msg.msg_controllen = sizeof(control);
+        }
+
+        state.port = port;
+        state.hello_pending = first_receive;
+        state.framed = framed;
+        state.codec = codec;
+        state.dictionary_id = (framed && codec != Codec::None) ? compressor->getDictionaryId() : 0;
+        state.features = (chunked ? HelloChunks : 0) | (checksummed ? HelloChecksums : 0);
+        state.partial_frame = framed ? frame_reader.takePending() : std::move(hello_prefix);
+        chunk_assembler.takeState(state.partial_messages, state.dropped_lanes);
+
+        // pending operations (a reaper wait) finish with operation_aborted
+        state.fd = socket->release();
+    }
+    catch(const std::exception& e)
+    {
+        LOG_WARNING_LIMITED(10) << function_id <<  " Client(" << port << ") " << e.what();
+        {
+            std::lock_guard<std::mutex> lock(tx_mutex);
+            handed_off = true;
+        }
+        detached.set_exception(std::current_exception());
+        detach_work.reset();
+        return;
+    }
+
+    LOG_DEBUG << function_id <<  " Client(" << port << ") detached with " << state.partial_frame.size() << " bytes of a frame pending";
+    detached.set_value(std::move(state));
+    detach_work.reset();
+}
+
+bool ServerBase::Connection::restore(HandedOffConnection& handed_, std::shared_ptr<Compressor> compressor_)
+{
+    first_receive = handed_.hello_pending;
+    if(!handed_.framed)
+    {
+        hello_prefix = std::move(handed_.partial_frame);
+        sampleFootprint();
+        return true;
+    }
+
+    if(handed_.codec != Codec::None && (handed_.codec != compressor_->getCodec() || handed_.dictionary_id != compressor_->getDictionaryId()))
+    {
+        return false;
+    }
+
+    compressor = compressor_;
+    codec = handed_.codec;
+    chunked = (handed_.features & HelloChunks) != 0;
+    checksummed = (handed_.features & HelloChecksums) != 0;
+    frame_reader.restorePending(std::move(handed_.partial_frame));
+    chunk_assembler.restoreState(std::move(handed_.partial_messages), std::move(handed_.dropped_lanes));
+    framed = true;
+    sampleFootprint();
+    return true;
+}
+
+void ServerBase::Connection::setPort(uint16_t port_)
+{
+    port = port_;
+}
+
+uint16_t ServerBase::Connection::getPort() const
+{
+    return port;
+}
+
+bool ServerBase::Connection::isShm() const
+{
+    return (bool)shm;
+}
+
+void ServerBase::Connection::registerRxBuffer()
+{
+#ifdef TCP_IO_URING_BACKEND
+    std::string function_id = getFunctionId(__func__, "Server");
+
+    try
+    {
+        rx_registration = std::make_unique<boost::asio::buffer_registration<std::vector<boost::asio::mutable_buffer>>>(
+            boost::asio::register_buffers(context_io, std::vector<boost::asio::mutable_buffer>{boost::asio::buffer(rx_buffer)}));
+    }
+    catch(const std::exception& e)
+    {
+        LOG_WARNING << function_id << " Failed to register rx buffer, will use plain reads: " << e.what();
+        rx_registration.reset();
+    }
+#endif
+}
+
+void ServerBase::Connection::setRateLimiters(std::shared_ptr<RateLimiter> connection_limiter_, std::shared_ptr<RateLimiter> source_limiter_)
+{
+    connection_limiter = connection_limiter_;
+    source_limiter = source_limiter_;
+}
+
+std::chrono::nanoseconds ServerBase::Connection::throttle(size_t messages, size_t bytes)
+{
+    std::chrono::nanoseconds delay(0);
+    if(connection_limiter)
+    {
+        delay = connection_limiter->reserve(messages, bytes);
+    }
+    if(source_limiter)
+    {
+        delay = std::max(delay, source_limiter->reserve(messages, bytes));
+    }
+    return delay;
+}
+
+void ServerBase::Connection::setCredits(const InboundCredits& credits_)
+{
+    credits = credits_;
+}
+
+bool ServerBase::Connection::hasCredits() const
+{
+    return credits.enabled();
+}
+
+void ServerBase::Connection::beginMessage()
+{
+    std::lock_guard<std::mutex> lock(credit_mutex);
+    ++pending_messages;
+}
+
+void ServerBase::Connection::finishMessage()
+{
+    {
+        std::lock_guard<std::mutex> lock(credit_mutex);
+        --pending_messages;
+    }
+    credit_cv.notify_all();
+}
+
+void ServerBase::Connection::takeCredit(size_t bytes)
+{
+    std::lock_guard<std::mutex> lock(credit_mutex);
+    ++inflight_messages;
+    inflight_bytes += bytes;
+}
+
+void ServerBase::Connection::returnCredit(size_t bytes)
+{
+    ReceiveCallback resume;
+    std::unique_ptr<boost::asio::executor_work_guard<Context::executor_type>> work;
+    {
+        std::lock_guard<std::mutex> lock(credit_mutex);
+        // a handler acknowledging more than it got must not wrap the counts around
+        inflight_messages -= std::min<size_t>(inflight_messages, 1);
+        inflight_bytes -= std::min(inflight_bytes, bytes);
+        if(outOfCredit()) return;
+        // wakes waitUntilIdle() as well, a connection is never out of credit with nothing in flight
+
+        resume = std::move(parked_read);
+        parked_read = nullptr;
+        work = std::move(parked_work);
+    }
+    credit_cv.notify_all();
+
+    if(resume)
+    {
+        // reads belong to the connection thread (and its rx buffer), not to the acknowledging one
+        std::weak_ptr<Connection> weak_connection = shared_from_this();
+        boost::asio::post(context_io, [weak_connection, resume]()
+            {
+                std::shared_ptr<Connection> connection = weak_connection.lock();
+                if(connection)
+                {
+                    connection->asyncReceive(resume);
+                }
+            });
+    }
+}
+
+bool ServerBase::Connection::parkIfOutOfCredit(ReceiveCallback callback)
+{
+    if(!credits.enabled()) return false;
+
+    std::lock_guard<std::mutex> lock(credit_mutex);
+    if(!outOfCredit()) return false;
+
+    parked_read = std::move(callback);
+    parked_work = std::make_unique<boost::asio::executor_work_guard<Context::executor_type>>(context_io.get_executor());
+    return true;
+}
+
+bool ServerBase::Connection::waitForCredit(std::chrono::milliseconds timeout)
+{
+    if(!credits.enabled()) return true;
+
+    std::unique_lock<std::mutex> lock(credit_mutex);
+    return credit_cv.wait_for(lock, timeout, [this](){ return !outOfCredit(); });
+}
+
+bool ServerBase::Connection::outOfCredit() const
+{
+    return (credits.max_messages > 0 && inflight_messages >= credits.max_messages) ||
+           (credits.max_bytes > 0 && inflight_bytes >= credits.max_bytes);
+}
+
+void ServerBase::Connection::asyncReceive(ReceiveCallback callback, std::chrono::nanoseconds delay)
+{
+    // whatever is left in the socket is read by the successor
+    if(detaching) return;
+
+    if(delay.count() > 0)
+    {
+        std::weak_ptr<Connection> weak_connection = shared_from_this();
+        throttle_timer.expires_after(delay);
+        throttle_timer.async_wait([weak_connection, callback](const boost::system::error_code& ec)
+        {
+            std::shared_ptr<Connection> connection = weak_connection.lock();
+            if(!connection) return;
+
+            if(ec)
+            {
+                callback(ec, nullptr, 0);
+                return;
+            }
+            connection->asyncReceive(callback);
+        });
+        return;
+    }
+
+    if(!own_context)
+    {
+        // OpenSSL may already hold decrypted bytes, try reading first (on the pool thread, which owns the buffer)
+        std::weak_ptr<Connection> weak_connection = shared_from_this();
+        auto read = [weak_connection, callback](const boost::system::error_code& ec)
+        {
+            std::shared_ptr<Connection> connection = weak_connection.lock();
+            if(!connection) return;
+
+            if(ec)
+            {
+                callback(ec, nullptr, 0);
+                return;
+            }
+            connection->readReady(callback);
+        };
+
+        if(tls)
+        {
+            boost::asio::post(context_io, [read](){ read(boost::system::error_code()); });
+        }
+        else
+        {
+            socket->async_wait(Socket::wait_read, read);
+        }
+        return;
+    }
+
+    if(tls)
+    {
+        // OpenSSL may already hold decrypted bytes, only wait on the socket when it has none
+        boost::system::error_code ec;
+        size_t bytes = tls->read_some(rx_buffer.data(), rx_buffer.size(), ec);
+        if(ec || bytes > 0)
+        {
+            const uint8_t* data = rx_buffer.data();
+            boost::asio::post(context_io, [callback, ec, data, bytes](){ callback(ec, data, bytes); });
+            return;
+        }
+
+        std::weak_ptr<Connection> weak_connection = shared_from_this();
+        socket->async_wait(Socket::wait_read, [weak_connection, callback](const boost::system::error_code& ec)
+        {
+            std::shared_ptr<Connection> connection = weak_connection.lock();
+            if(!connection) return;
+
+            if(ec)
+            {
+                callback(ec, nullptr, 0);
+                return;
+            }
+            connection->asyncReceive(callback);
+        });
+        return;
+    }
+
+    if(timestamps.isEnabled())
+    {
+        // async_receive() drops the control messages carrying the receive time, read with recvmsg() once ready
+        std::weak_ptr<Connection> weak_connection = shared_from_this();
+        socket->async_wait(Socket::wait_read, [weak_connection, callback](const boost::system::error_code& ec)
+        {
+            std::shared_ptr<Connection> connection = weak_connection.lock();
+            if(!connection) return;
+
+            if(ec)
+            {
+                callback(ec, nullptr, 0);
+                return;
+            }
+            connection->readReady(callback);
+        });
+        return;
+    }
+
+    // the buffer lives as long as the connection, which the callback holds on to
+    const uint8_t* data = rx_buffer.data();
+    auto received = [callback, data](const boost::system::error_code& ec, size_t bytes){ callback(ec, data, bytes); };
+#ifdef TCP_IO_URING_BACKEND
+    if(rx_registration)
+    {
+        socket->async_read_some(*rx_registration->begin(), received);
+        return;
+    }
+#endif
+    socket->async_receive(boost::asio::buffer(rx_buffer), received);
+}
+
+void ServerBase::Connection::readReady(ReceiveCallback callback)
+{
+    // one buffer per pool thread instead of one per connection, the callback consumes it before the next read
+    static thread_local Payload pool_buffer(64 * 1024);
+    Payload& buffer = own_context ? rx_buffer : pool_buffer;
+
+    boost::system::error_code ec;
+    size_t bytes = 0;
+    if(tls)
+    {
+        bytes = tls->read_some(buffer.data(), buffer.size(), ec);
+    }
+    else
+    {
+        ssize_t result = timestamps.isEnabled() ? timestamps.receive(buffer.data(), buffer.size())
+                                                : ::recv(socket->native_handle(), buffer.data(), buffer.size(), MSG_DONTWAIT);
+        if(result > 0)
+        {
+            bytes = (size_t)result;
+        }
+        else if(result == 0)
+        {
+            ec = boost::asio::error::eof;
+        }
+        else if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        {
+            ec = boost::system::error_code(errno, boost::system::system_category());
+        }
+    }
+
+    if(!ec && bytes == 0)
+    {
+        // spurious wake up, or a TLS record that is not complete yet
+        std::weak_ptr<Connection> weak_connection = shared_from_this();
+        socket->async_wait(Socket::wait_read, [weak_connection, callback](const boost::system::error_code& ec)
+        {
+            std::shared_ptr<Connection> connection = weak_connection.lock();
+            if(!connection) return;
+
+            if(ec)
+            {
+                callback(ec, nullptr, 0);
+                return;
+            }
+            connection->readReady(callback);
+        });
+        return;
+    }
+
+    callback(ec, buffer.data(), bytes);
+}
+
+void ServerBase::Connection::enableTimestamps(LatencyHistogram* send_to_wire_)
+{
+    std::string function_id = getFunctionId(__func__, "Server");
+
+    send_to_wire = send_to_wire_;
+    if(!timestamps.enable(socket->native_handle(), true))
+    {
+        LOG_WARNING_LIMITED(10) << function_id <<  " SO_TIMESTAMPING refused for Client(" << port << "): " << std::strerror(errno);
+    }
+}
+
+SocketTimestamps& ServerBase::Connection::getTimestamps()
+{
+    return timestamps;
+}
+
+void ServerBase::Connection::reapTimestamps()
+{
+    if(timestamps.isEnabled())
+    {
+        timestamps.reap(*send_to_wire);
+    }
+}
+
+Socket& ServerBase::Connection::getSocket()
+{
+    return *socket;
+}
+
+Payload& ServerBase::Connection::getRxBuffer()
+{
+    return rx_buffer;
+}
+
+Payload& ServerBase::Connection::getTxBuffer()
+{
+    return tx_buffer;
+}
+
+ZeroCopySender& ServerBase::Connection::getZeroCopySender()
+{
+    return *zerocopy;
+}
+
+void ServerBase::Connection::armZeroCopyReaper()
+{
+    if(zerocopy->pending() == 0 || zerocopy_reaper_armed.exchange(true)) return;
+
+    // completion notifications land on the error queue, which wakes up wait_error
+    std::weak_ptr<Connection> weak_connection = shared_from_this();
+    socket->async_wait(Socket::wait_error, [weak_connection](const boost::system::error_code& ec)
+    {
+        std::shared_ptr<Connection> connection = weak_connection.lock();
+        if(!connection) return;
+
+        connection->zerocopy_reaper_armed = false;
+        if(ec) return;
+
+        connection->zerocopy->reap();
+        connection->armZeroCopyReaper();
+    });
 }
 
 
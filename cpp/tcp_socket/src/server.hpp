@@ -3,56 +3,479 @@
 #include <iostream>
 #include <thread>
 #include <future>
+#include <atomic>
+#include <map>
+#include <set>
+#include <condition_variable>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/executor_work_guard.hpp>
 #include "types.hpp"
+#include "zerocopy.hpp"
+#include "transport.hpp"
+#include "shm_channel.hpp"
+#include "tls.hpp"
+#include "compression.hpp"
+#include "rate_limiter.hpp"
+#include "fair_mutex.hpp"
+#include "admission.hpp"
+#include "capture.hpp"
+#include "trace.hpp"
+#include "policies.hpp"
+#include "message.hpp"
+#include "lanes.hpp"
+#include "response_cache.hpp"
+#include "timestamping.hpp"
+#include "hot_restart.hpp"
 
 namespace tcp
 {
 
-class Server
+// Memory one connection holds (estimate from the sizes of its parts, OpenSSL and Boost.Asio internals not included)
+struct ConnectionFootprint
+{
+    size_t object_bytes = 0;    // connection, socket and zero-copy sender objects
+    size_t buffer_bytes = 0;    // rx/tx buffers, partial frames, zero-copy payloads in flight
+    size_t context_bytes = 0;   // io_context of its own, 0 on the shared pool
+    size_t stack_bytes = 0;     // reserved (virtual, mostly not resident) stack of its own thread, 0 on the shared pool
+    size_t fds = 0;             // socket plus the epoll/eventfd/timerfd of an own io_context
+
+    size_t total() const { return object_bytes + buffer_bytes + context_bytes; }
+    ConnectionFootprint& operator+=(const ConnectionFootprint& other);
+};
+
+struct MemoryUsage
+{
+    size_t connections = 0;
+    size_t io_threads = 0;      // shared pool threads, 0 = a thread per connection
+    ConnectionFootprint total;
+
+    size_t bytesPerConnection() const { return connections ? total.total() / connections : 0; }
+};
+
+// Everything but the message handler, see BasicServer
+class ServerBase
 {
 public:
-Server(std::string ip_, uint16_t port_, std::function<void(uint16_t clientPort, std::unique_ptr<Payload> rxBuffer_)> handler_ = nullptr);
-virtual ~Server();
+virtual ~ServerBase();
 
 void start();
+// stops accepting and waits for the accept thread, connections are closed when the Server goes away
+void stop();
 std::future_status status() const;
+// true once the server accepts connections, lets callers start clients without guessing a delay
+bool waitUntilListening(std::chrono::milliseconds timeout) const;
+// called from the server thread when it stops on its own (e.g. bind failed), not after stop()
+void setStoppedCallback(std::function<void()> callback_);
+
+// to clients without framing, payloads of at least zerocopy threshold bytes are sent without copying (see sendZeroCopy)
+// and skip the lanes; otherwise higher priorities go first, and on clients that asked for chunking between the chunks
+// of large messages
+void send(uint16_t clientPort, std::unique_ptr<Payload> txBuffer_, Priority priority = Priority::Normal);
+// the server keeps txBuffer_ until the kernel is done with it, then hands it to completion_ (or frees it);
+// a send that fails, or finds no such client, hands it back as well
+void sendZeroCopy(uint16_t clientPort, std::unique_ptr<Payload> txBuffer_, ZeroCopySender::Completion completion_ = nullptr);
+void sendFile(uint16_t clientPort, int fd, off_t offset, size_t count);
+void setZeroCopyThreshold(size_t bytes);
+// must be called before start()
+void setTls(const TlsConfig& config);
+// must be called before start(), clients that offer the same codec (and dictionary) get compressed frames
+void setCompression(const CompressionConfig& config);
+CompressionStats getCompressionStats() const;
+// must be called before start(); limits are enforced by reading later, data waits in the socket buffer
+void setRateLimits(const RateLimit& per_connection, const RateLimit& per_source_address);
+uint64_t getThrottledReads() const;
+// must be called before start(), what to do once connections, pending work or buffered bytes hit a limit
+void setAdmissionLimits(const AdmissionLimits& limits);
+AdmissionStats getAdmissionStats() const;
+// must be called before start(): 0 (default) gives every connection a thread and io_context of its own,
+// n > 0 runs every connection on n shared threads and reads into per-thread buffers, so an idle connection
+// costs little more than its socket (for many mostly idle connections)
+void setIoThreads(size_t threads);
+// must be called before start(): credit mode, every message the handler gets stays in flight until the handler
+// calls acknowledge() for it (from any thread, whenever it is done). A connection with too many messages or
+// bytes in flight is not read from until they drain. Without acknowledgements a connection stalls for good.
+void setInboundCredits(const InboundCredits& credits);
+// gives back the credit of one message of bytes bytes received from clientPort, ignored for unknown connections
+void acknowledge(uint16_t clientPort, size_t bytes);
+// reads postponed because a connection was out of credit
+uint64_t getPausedReads() const;
+// false if there is no such connection
+bool getConnectionFootprint(uint16_t clientPort, ConnectionFootprint& footprint_) const;
+MemoryUsage getMemoryUsage() const;
+// must be called before start(): kernel receive and transmit times (SO_TIMESTAMPING, software) on TCP connections
+// without TLS; handlers get the receive time of their message from getReceiveTimestamp() (timestamping.hpp)
+void setTimestamping(bool enabled);
+// kernel-to-handler delay of every message and send-to-wire delay of every write
+TimestampStats getTimestampStats() const;
+// must be called before start(): clients that offer checksums (HelloChecksums) get them on every frame, in both
+// directions. A frame that fails its check is dropped with its message and counted, the connection stays up.
+void setIntegrity(bool enabled);
+IntegrityStats getIntegrityStats() const;
+// false if there is no such connection
+bool getIntegrityStats(uint16_t clientPort, IntegrityStats& stats_) const;
+// must be called before start(), every received message is recorded (before any shedding) for later replay
+void setCapture(std::shared_ptr<CaptureWriter> capture_);
+// must be called before start(): a request found in the cache is answered with the responses the handler sent
+// for it last time, without calling the handler. Only responses sent with send() to the requesting client from
+// within the handler call are recorded, requests answered later (or from another thread) are never cached, nor
+// are those whose handler also used sendZeroCopy(), sendFile(), broadcast() or sent to another client.
+void setResponseCache(const ResponseCacheConfig& config);
+ResponseCacheStats getResponseCacheStats() const;
+void clearResponseCache();
+// hot restart, old process: stops accepting and lets go of the listening socket (a duplicate of it) and of every
+// TCP or unix connection without TLS, with what was read of them but not delivered yet, to be sent on with
+// sendHandoff(). A connection goes only once its handlers finished (and, in credit mode, acknowledged) every
+// message it got; one that is not quiet within timeout stays, as do TLS and shared memory connections. Those are
+// not read from any more and are closed when the Server goes away, answers to what they sent still go out.
+HandoffState handOff(std::chrono::milliseconds timeout);
+// hot restart, new process: must be called before start(), the server listens on the listening socket of state
+// instead of binding its own and serves its connections as if it had accepted them
+void adopt(HandoffState state);
+
+// one shared immutable buffer for every receiver, written asynchronously by each connection thread
+void broadcast(std::shared_ptr<const Payload> txBuffer_, Priority priority = Priority::Normal);
+void broadcast(const std::vector<uint16_t>& clientPorts, std::shared_ptr<const Payload> txBuffer_, Priority priority = Priority::Normal);
+void broadcast(const std::string& group, std::shared_ptr<const Payload> txBuffer_, Priority priority = Priority::Normal);
+void joinGroup(const std::string& group, uint16_t clientPort);
+void leaveGroup(const std::string& group, uint16_t clientPort);
 
-void send(uint16_t clientPort, std::unique_ptr<Payload> txBuffer_);
+protected:
+// called for every message with the handler lock held, data is only valid during the call;
+// false when there is no handler, the client then gets a PONG
+using DispatchFunction = bool (*)(ServerBase& server_, uint16_t clientPort, const uint8_t* data, size_t bytes);
+
+// ip_ may also be "unix:<path>" or "shm:<path>" for same-host clients (see transport.hpp);
+// dispatch_ is a static function of the derived class, a plain call with no virtual lookup per message
+ServerBase(std::string ip_, uint16_t port_, DispatchFunction dispatch_);
+
+// stops the connection threads, a derived class calls it first so dispatch_ is not called on a half destroyed object
+void shutdown();
 
 private:
-    class Connection
+    class Connection : public std::enable_shared_from_this<Connection>
     {
         public:
-        Connection();
+        using ReceiveCallback = std::function<void(const boost::system::error_code& ec, const uint8_t* data, size_t bytes)>;
+
+        // shared_context_ = nullptr: io_context and thread of its own
+        explicit Connection(Context* shared_context_ = nullptr);
         ~Connection();
 
         void start();
+        void attachShm(std::shared_ptr<ShmChannel> shm_);
+        void attachTls(std::unique_ptr<TlsChannel> tls_);
+        bool hasTls() const;
+        using HandshakeCallback = std::function<void(const boost::system::error_code& ec)>;
+        // the TLS handshake, step by step on the connection thread; ec is timed_out after tls_handshake_timeout
+        void asyncHandshake(HandshakeCallback callback);
+        // hot restart, in this order: stopReading() cancels the reads on the connection thread (ready once the data
+        // already read is delivered), waitUntilIdle() waits for the handlers to finish and acknowledge what they got,
+        // detach() writes out what waits on the lanes and lets go of the socket; every write after that is dropped
+        std::future<void> stopReading();
+        bool waitUntilIdle(std::chrono::steady_clock::time_point deadline);
+        std::future<HandedOffConnection> detach();
+        // takes over the state of a connection handed off by another process, before start();
+        // false if this server can not decode its frames (another codec or dictionary)
+        bool restore(HandedOffConnection& handed_, std::shared_ptr<Compressor> compressor_);
+        // answers the client Hello, every message after it is framed
+        void enableFraming(Codec codec_, std::shared_ptr<Compressor> compressor_, const Hello& answer);
+        bool isFramed() const;
+        bool isChunked() const;
+        bool isChecksummed() const;
+        // true until the first bytes received showed whether they are a Hello
+        bool awaitsHello() const;
+        // those bytes while a Hello is split over reads, held back until it is whole or can not be one any more
+        Payload& getHelloPrefix();
+        void settleHello();
+        Codec getCodec() const;
+        void encode(const uint8_t* data, size_t bytes, Payload& frame_);
+        bool decode(const FrameHeader& header, const uint8_t* body, Payload& rxBuffer_);
+        // true when the frame may be decoded: no checksums negotiated, or it matched and header_.length no longer counts it
+        bool verify(FrameHeader& header_, const uint8_t* body);
+        IntegrityStats getIntegrityStats() const;
+        bool readFrames(const uint8_t* data, size_t bytes, const FrameReader::FrameCallback& callback);
+        // true when message_ is a whole message (see ChunkAssembler)
+        bool assemble(const FrameHeader& header, Payload& message_, bool& corrupt_);
+        // one frame written right away, past the lanes (queued behind them when writesAsync())
+        void write(boost::asio::const_buffer buffer);
+        // on the shared pool a full socket buffer must not hold up a pool thread, and with it every other connection
+        // it serves: plain sockets there are written asynchronously from the lanes, one frame at a time
+        bool writesAsync() const;
+        // framed (compressed, chunked) if negotiated, raw otherwise, queued on the lane of priority
+        void writeMessage(const uint8_t* data, size_t bytes, Priority priority = Priority::Normal);
+        std::vector<OutboundLanes::Frame> makeFrames(const uint8_t* data, size_t bytes, Priority priority);
+        // frames of bytes payload bytes, written on the connection thread
+        void enqueue(std::vector<OutboundLanes::Frame> frames, size_t bytes, Priority priority);
+        void sendZeroCopy(std::unique_ptr<Payload> txBuffer_, ZeroCopySender::Completion completion_);
+        void sendFile(int fd, off_t offset, size_t count);
+        void setPort(uint16_t port_);
+        uint16_t getPort() const;
+        bool isShm() const;
+        void registerRxBuffer();
+        // counted against the limits of admission_ as long as the connection lives
+        void setAdmission(std::shared_ptr<AdmissionControl> admission_, size_t admitted_bytes_);
+        void setRateLimiters(std::shared_ptr<RateLimiter> connection_limiter_, std::shared_ptr<RateLimiter> source_limiter_);
+        // how long to wait before reading again after messages/bytes were received
+        std::chrono::nanoseconds throttle(size_t messages, size_t bytes);
+        void setCredits(const InboundCredits& credits_);
+        bool hasCredits() const;
+        // a message between admission and the end of its handler call
+        void beginMessage();
+        void finishMessage();
+        // a message handed to the handler
+        void takeCredit(size_t bytes);
+        // an acknowledged one, a parked read resumes once the connection is back under its limits
+        void returnCredit(size_t bytes);
+        // out of credit: keeps callback for returnCredit() to read with later and returns true
+        bool parkIfOutOfCredit(ReceiveCallback callback);
+        // for readers that cannot park (the shared memory ring thread), false on timeout
+        bool waitForCredit(std::chrono::milliseconds timeout);
+        // data is only valid during the callback
+        void asyncReceive(ReceiveCallback callback, std::chrono::nanoseconds delay = std::chrono::nanoseconds(0));
+        // safe from any thread, the receive side is counted as of its last sampleFootprint()
+        ConnectionFootprint getFootprint() const;
+        // on the connection thread, after the receive buffers changed
+        void sampleFootprint();
+        // before anything is written, send-to-wire delays of the connection go to send_to_wire_
+        void enableTimestamps(LatencyHistogram* send_to_wire_);
+        SocketTimestamps& getTimestamps();
+        // reads the transmit stamps queued so far
+        void reapTimestamps();
         Socket& getSocket(); 
         Payload& getRxBuffer();
         Payload& getTxBuffer();
+        ZeroCopySender& getZeroCopySender();
+        void armZeroCopyReaper();
 
         private:
-        Context context_io;
+        // shared with the connection thread, which may outlive the connection (see start())
+        std::shared_ptr<Context> own_context;
+        Context& context_io;
         std::thread _thread;
         std::shared_ptr<Socket> socket;
+        std::shared_ptr<ShmChannel> shm;
+        std::unique_ptr<TlsChannel> tls;
+        std::mutex tx_mutex;
+        uint16_t port;
         Payload rx_buffer; 
         Payload tx_buffer; 
+        std::unique_ptr<ZeroCopySender> zerocopy;
+        std::atomic<bool> zerocopy_reaper_armed;
+        std::atomic<bool> framed;
+        std::atomic<Codec> codec;
+        bool first_receive;
+        Payload hello_prefix;
+        std::shared_ptr<Compressor> compressor;
+        FrameReader frame_reader;
+        ChunkAssembler chunk_assembler;
+        std::atomic<bool> chunked;
+        std::atomic<bool> checksummed;
+        std::atomic<uint64_t> verified_frames;
+        std::atomic<uint64_t> failed_frames;
+        OutboundLanes lanes;
+        std::shared_ptr<RateLimiter> connection_limiter;
+        std::shared_ptr<RateLimiter> source_limiter;
+        boost::asio::steady_timer throttle_timer;
+        std::shared_ptr<AdmissionControl> admission;
+        size_t admitted_bytes;
+        InboundCredits credits;
+        std::mutex credit_mutex;
+        std::condition_variable credit_cv;
+        size_t inflight_messages;
+        size_t inflight_bytes;
+        size_t pending_messages;
+        ReceiveCallback parked_read;
+        // an own io_context runs out of work while nothing is read, its thread would return
+        std::unique_ptr<boost::asio::executor_work_guard<Context::executor_type>> parked_work;
+        SocketTimestamps timestamps;
+        LatencyHistogram* send_to_wire;
+        std::atomic<bool> detaching;
+        bool handed_off;
+        bool async_writing;
+        std::atomic<size_t> receive_buffer_bytes;
+        std::promise<void> reads_stopped;
+        // with nothing read an own io_context runs out of work, it must still be there for detach()
+        std::unique_ptr<boost::asio::executor_work_guard<Context::executor_type>> detach_work;
+        std::promise<HandedOffConnection> detached;
+
+        bool outOfCredit() const;
+        void continueHandshake(HandshakeCallback callback);
+        void finishDetach();
+        // reads what the socket holds now (into the pool thread buffer on the shared pool), waits again if nothing
+        void readReady(ReceiveCallback callback);
+        void writeLocked(boost::asio::const_buffer buffer);
+        // writesAsync(): starts writing the next frame of the lanes unless a write is in flight, tx_mutex held
+        void writeNextLocked();
+        // pushes the frames on their lane and writes frames of every lane, highest first, until they are out
+        void writeFrames(Priority priority, std::vector<OutboundLanes::Frame> frames);
+#ifdef TCP_IO_URING_BACKEND
+        // rx_buffer pinned in the kernel so reads skip the per-call page mapping
+        std::unique_ptr<boost::asio::buffer_registration<std::vector<boost::asio::mutable_buffer>>> rx_registration;
+#endif
     };
 
+    const std::string server_address;
+    const Transport transport;
     Endpoint server_endpoint;
+    uint16_t next_anonymous_port;
     Context io;
     std::unique_ptr<Acceptor> acceptor;
 
     std::map<uint16_t, std::shared_ptr<Connection>> connections;
-    std::mutex rx_mutex;
+    std::map<std::string, std::set<uint16_t>> groups;
+    mutable std::mutex connections_mutex;
+    // handlers run one at a time, connections with pending messages take turns
+    FairMutex rx_mutex;
+    size_t zerocopy_threshold;
+    TlsConfig tls_config;
+    std::unique_ptr<TlsContext> tls_context;
+    CompressionConfig compression_config;
+    std::shared_ptr<Compressor> compressor;
+    RateLimit connection_rate_limit;
+    RateLimit source_rate_limit;
+    std::map<std::string, std::weak_ptr<RateLimiter>> source_limiters;
+    std::atomic<uint64_t> throttled_reads;
+    InboundCredits inbound_credits;
+    std::atomic<uint64_t> paused_reads;
+    std::shared_ptr<AdmissionControl> admission;
+    std::shared_ptr<CaptureWriter> capture;
+    std::unique_ptr<ResponseCache> response_cache;
+    bool timestamping;
+    LatencyHistogram kernel_to_handler;
+    LatencyHistogram send_to_wire;
+    bool integrity;
+    std::atomic<uint64_t> verified_frames;
+    std::atomic<uint64_t> failed_frames;
+    size_t io_threads;
+    std::vector<std::unique_ptr<Context>> io_pool;
+    std::vector<boost::asio::executor_work_guard<Context::executor_type>> io_pool_work;
+    std::vector<std::thread> io_pool_threads;
+    size_t next_pool_context;
 
     std::future<void> status_future;
-
-    std::function<void(uint16_t clientPort, std::unique_ptr<Payload> rxBuffer_)> handler;
+    bool listening;
+    bool stopped;
+    std::atomic<bool> stopping;
+    // wakes up the accept thread, the listening socket may be shared with a successor (no shutdown() on it)
+    int accept_wakeup;
+    HandoffState adopted;
+    std::function<void()> stopped_callback;
+    mutable std::mutex state_mutex;
+    mutable std::condition_variable state_cv;
+    bool shut_down;
+    const DispatchFunction dispatch;
 
     void start_up();
-    void rx_callback(const boost::system::error_code& ec, size_t bytes, std::shared_ptr<Connection> client_connection);
+    // false once the server is stopping, true when a connection may be waiting
+    bool wait_for_accept();
+    std::shared_ptr<Connection> make_connection();
+    // the limits, credits and rate limiters of a new connection, false (and closed) if admission refuses it
+    bool admit_connection(std::shared_ptr<Connection> connection, const Endpoint& remote_endpoint);
+    // registers the connection and starts reading, after the TLS handshake if it has TLS
+    void activate_connection(std::shared_ptr<Connection> connection);
+    void start_receiving(std::shared_ptr<Connection> connection);
+    void adopt_connections();
+    void rx_callback(const boost::system::error_code& ec, const uint8_t* data, size_t bytes, std::shared_ptr<Connection> client_connection);
+    void start_io_pool();
+    void stop_io_pool();
+    Context* next_io_context();
+    bool receive(const uint8_t* data, size_t bytes, std::shared_ptr<Connection> client_connection, size_t& messages);
+    std::shared_ptr<RateLimiter> getSourceLimiter(const std::string& source_address);
+    void negotiate(const Hello& offer, std::shared_ptr<Connection> client_connection);
+    std::shared_ptr<Connection> getConnection(uint16_t clientPort);
+    void remove_connection(uint16_t clientPort);
+    // sendZeroCopy() without touching the response capture, for send()
+    void send_zero_copy(uint16_t clientPort, std::unique_ptr<Payload> txBuffer_, ZeroCopySender::Completion completion_);
+    void fan_out(const std::vector<std::shared_ptr<Connection>>& targets, std::shared_ptr<const Payload> txBuffer_, Priority priority);
+    void process_payload(const uint8_t* data, size_t bytes, std::shared_ptr<Connection> client_connection);
+
+    // a received message admitted to process_payload(): pending for the admission control and the connection
+    // until it goes out of scope, also when the handler throws; a credit taken for it is given back then
+    // unless the handler kept it (it acknowledges the message itself)
+    class PendingMessage
+    {
+        public:
+        PendingMessage(AdmissionControl& admission_, Connection& connection_, size_t bytes_);
+        ~PendingMessage();
+        PendingMessage(const PendingMessage&) = delete;
+        PendingMessage& operator=(const PendingMessage&) = delete;
+
+        void takeCredit();
+        void keepCredit();
+
+        private:
+        AdmissionControl& admission;
+        Connection& connection;
+        const size_t bytes;
+        bool credit;
+    };
+    // true when the request was answered from the response cache
+    bool serve_cached(uint64_t hash, const uint8_t* data, size_t bytes, Connection& client_connection);
 };
 
+// Server with the message handler and the per-message logging (see policies.hpp) fixed at compile time,
+// the handler call is inlined. Transports and framing stay runtime choices: the address picks the transport
+// and every client negotiates framing and compression on its own.
+//
+// The handler is called with the handler lock held, as one of
+//     handler(uint16_t clientPort, const uint8_t* data, size_t bytes)     no copy, data is only valid during the call
+//     handler(uint16_t clientPort, std::unique_ptr<Payload> rxBuffer_)    a copy the handler owns
+//     handler(uint16_t clientPort, MessageView<Schema> message)           no copy either, a typed view of data (see
+//                                                                         message.hpp); other messages are dropped
+template<typename Handler, typename LogPolicy = RuntimeLog>
+class BasicServer final : public ServerBase
+{
+public:
+BasicServer(std::string ip_, uint16_t port_, Handler handler_ = Handler())
+    : ServerBase(std::move(ip_), port_, &BasicServer::dispatch), handler(std::move(handler_)) {}
+~BasicServer() override { shutdown(); }
+
+private:
+    Handler handler;
+
+// the handler and LogPolicy are known here, both are inlined into the one call ServerBase makes per message
+static bool dispatch(ServerBase& server_, uint16_t clientPort, const uint8_t* data, size_t bytes)
+{
+    Handler& handler = static_cast<BasicServer&>(server_).handler;
+
+    if(LogPolicy::enabled(LogLevel::DEBUG))
+    {
+        std::string function_id = getFunctionId(__func__, "Server");
+        LOG_DEBUG << function_id <<  " Got something from Client(" << clientPort << ")";
+        LOG_DEBUG << function_id <<  " Received " << bytes << " bytes";
+        LOG_DEBUG << function_id <<  " Rx Payload: " << std::string(data, data + bytes);
+    }
+
+    if(!isSet(handler)) return false;
+
+    if constexpr(!std::is_void<typename HandlerSchema<Handler>::type>::value)
+    {
+        using Schema = typename HandlerSchema<Handler>::type;
+        MessageView<Schema> view = MessageView<Schema>::from(data, bytes);
+        if(!view)
+        {
+            std::string function_id = getFunctionId(__func__, "Server");
+            LOG_WARNING_SAMPLED(1000) << function_id <<  " Dropping a message from Client(" << clientPort << ") that is not of type "
+                                      << Schema::message_type << " version " << Schema::message_version;
+            return true;
+        }
+        handler(clientPort, view);
+    }
+    else if constexpr(std::is_invocable<Handler&, uint16_t, const uint8_t*, size_t>::value)
+    {
+        handler(clientPort, data, bytes);
+    }
+    else
+    {
+        handler(clientPort, std::make_unique<Payload>(data, data + bytes));
+    }
+    return true;
+}
+};
+
+using ServerHandler = std::function<void(uint16_t clientPort, std::unique_ptr<Payload> rxBuffer_)>;
+// the handler may be nullptr, every message is then answered with a PONG
+using Server = BasicServer<ServerHandler>;
+
 }
@@ -0,0 +1,283 @@
+#include "shm_channel.hpp"
+#include "logger.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <climits>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+namespace tcp
+{
+
+static constexpr uint32_t spin_limit = 100;
+
+static void futex_wait(std::atomic<uint32_t>& word, uint32_t expected)
+{
+    // bounded so a stopped reader notices even if nobody wakes it
+    timespec timeout = {0, 100 * 1000 * 1000};
+    ::syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT, expected, &timeout, nullptr, 0);
+}
+
+static void futex_wake(std::atomic<uint32_t>& word)
+{
+    ::syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+std::shared_ptr<ShmChannel> ShmChannel::create(const std::string& name_)
+{
+    std::string function_id = getFunctionId(__func__, "ShmChannel");
+
+    ::shm_unlink(name_.c_str()); // leftover of a crashed peer
+
+    int fd = ::shm_open(name_.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if(fd < 0)
+    {
+        throw std::runtime_error("shm_open(" + name_ + ") failed: " + std::strerror(errno));
+    }
+
+    if(::ftruncate(fd, sizeof(Segment)) != 0)
+    {
+        ::close(fd);
+        ::shm_unlink(name_.c_str());
+        throw std::runtime_error("ftruncate(" + name_ + ") failed: " + std::strerror(errno));
+    }
+
+    void* address = ::mmap(nullptr, sizeof(Segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if(address == MAP_FAILED)
+    {
+        ::shm_unlink(name_.c_str());
+        throw std::runtime_error("mmap(" + name_ + ") failed: " + std::strerror(errno));
+    }
+
+    // ftruncate already zeroed the pages, only the control words need to be set
+    Segment* segment = static_cast<Segment*>(address);
+    for(Ring& ring : segment->rings)
+    {
+        ring.head.store(0);
+        ring.tail.store(0);
+        ring.seq.store(0);
+        ring.waiting.store(0);
+        ring.closed.store(0);
+    }
+
+    LOG_DEBUG << function_id << " Created shared memory segment " << name_;
+    return std::shared_ptr<ShmChannel>(new ShmChannel(name_, segment, true));
+}
+
+std::shared_ptr<ShmChannel> ShmChannel::open(const std::string& name_)
+{
+    std::string function_id = getFunctionId(__func__, "ShmChannel");
+
+    int fd = ::shm_open(name_.c_str(), O_RDWR, 0600);
+    if(fd < 0)
+    {
+        throw std::runtime_error("shm_open(" + name_ + ") failed: " + std::strerror(errno));
+    }
+
+    struct stat info;
+    if(::fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(Segment))
+    {
+        ::close(fd);
+        throw std::runtime_error("shared memory segment " + name_ + " has an unexpected size");
+    }
+
+    void* address = ::mmap(nullptr, sizeof(Segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if(address == MAP_FAILED)
+    {
+        throw std::runtime_error("mmap(" + name_ + ") failed: " + std::strerror(errno));
+    }
+
+    // both peers hold a mapping now, the name is no longer needed
+    ::shm_unlink(name_.c_str());
+
+    LOG_DEBUG << function_id << " Opened shared memory segment " << name_;
+    return std::shared_ptr<ShmChannel>(new ShmChannel(name_, static_cast<Segment*>(address), false));
+}
+
+ShmChannel::ShmChannel(const std::string& name_, Segment* segment_, bool creator_)
+    : name(name_), segment(segment_),
+      rx_ring(segment_->rings[creator_ ? 1 : 0]), tx_ring(segment_->rings[creator_ ? 0 : 1]),
+      running(false)
+{
+
+}
+
+ShmChannel::~ShmChannel()
+{
+    stop();
+    ::munmap(segment, sizeof(Segment));
+}
+
+void ShmChannel::start(MessageCallback callback_, ClosedCallback closed_callback_)
+{
+    callback = callback_;
+    closed_callback = closed_callback_;
+    running = true;
+
+    // the reader keeps the channel (and the mapping) alive until it leaves read_loop()
+    std::shared_ptr<ShmChannel> self = shared_from_this();
+    reader = std::thread([self](){ self->read_loop(); });
+}
+
+void ShmChannel::stop()
+{
+    running = false;
+
+    tx_ring.closed = 1;
+    rx_ring.closed = 1;
+    futex_wake(tx_ring.seq);
+    futex_wake(rx_ring.seq);
+
+    if(reader.joinable())
+    {
+        if(reader.get_id() == std::this_thread::get_id())
+        {
+            reader.detach(); // stopped from inside the callback
+        }
+        else
+        {
+            reader.join();
+        }
+    }
+}
+
+bool ShmChannel::write(const uint8_t* data, size_t bytes)
+{
+    std::lock_guard<std::mutex> lock(tx_mutex);
+
+    while(bytes > 0)
+    {
+        // closed by either side, the reader takes nothing more
+        if(tx_ring.closed) return false;
+
+        uint32_t length = (uint32_t)std::min(bytes, max_message);
+        uint64_t needed = sizeof(length) + length;
+        uint64_t tail = tx_ring.tail.load(std::memory_order_relaxed);
+
+        uint32_t spins = 0;
+        while(ring_capacity - (tail - tx_ring.head.load(std::memory_order_acquire)) < needed)
+        {
+            if(tx_ring.closed) return false;
+
+            if(++spins < spin_limit)
+            {
+                std::this_thread::yield();
+            }
+            else
+            {
+                std::this_thread::sleep_for(std::chrono::microseconds(50));
+            }
+        }
+
+        copy_to(tx_ring, tail, reinterpret_cast<const uint8_t*>(&length), sizeof(length));
+        copy_to(tx_ring, tail + sizeof(length), data, length);
+        tx_ring.tail.store(tail + needed, std::memory_order_release);
+
+        tx_ring.seq.fetch_add(1);
+        if(tx_ring.waiting.exchange(0))
+        {
+            futex_wake(tx_ring.seq);
+        }
+
+        data += length;
+        bytes -= length;
+    }
+
+    return true;
+}
+
+void ShmChannel::read_loop()
+{
+    std::string function_id = getFunctionId(__func__, "ShmChannel");
+
+    Payload message;
+    uint32_t spins = 0;
+
+    while(running)
+    {
+        uint64_t head = rx_ring.head.load(std::memory_order_relaxed);
+        uint64_t tail = rx_ring.tail.load(std::memory_order_acquire);
+
+        if(head == tail)
+        {
+            if(rx_ring.closed) break;
+
+            if(++spins < spin_limit)
+            {
+                std::this_thread::yield();
+                continue;
+            }
+
+            // announce we are about to sleep, then re-check so a publish in between is not lost
+            uint32_t seq = rx_ring.seq.load();
+            rx_ring.waiting.store(1);
+            if(rx_ring.tail.load() == head && !rx_ring.closed)
+            {
+                futex_wait(rx_ring.seq, seq);
+            }
+            continue;
+        }
+
+        spins = 0;
+
+        // the peer shares the ring, neither its positions nor its length prefix are taken on trust
+        uint64_t available = tail - head;
+        uint32_t length = 0;
+        if(available >= sizeof(length) && available <= ring_capacity)
+        {
+            copy_from(rx_ring, head, reinterpret_cast<uint8_t*>(&length), sizeof(length));
+        }
+        if(available < sizeof(length) || available > ring_capacity || length > max_message || sizeof(length) + length > available)
+        {
+            LOG_ERROR << function_id << " Closing " << name << ": invalid message of " << length << " bytes with "
+                      << available << " bytes published";
+            // the peer's writes fail from now on
+            tx_ring.closed = 1;
+            rx_ring.closed = 1;
+            futex_wake(tx_ring.seq);
+            futex_wake(rx_ring.seq);
+            if(closed_callback)
+            {
+                closed_callback();
+            }
+            break;
+        }
+
+        message.resize(length);
+        copy_from(rx_ring, head + sizeof(length), message.data(), length);
+        rx_ring.head.store(head + sizeof(length) + length, std::memory_order_release);
+
+        if(callback)
+        {
+            callback(message.data(), length);
+        }
+    }
+
+    LOG_DEBUG << function_id << " Reader for " << name << " stopped";
+}
+
+void ShmChannel::copy_from(const Ring& ring, uint64_t position, uint8_t* dst, size_t bytes)
+{
+    size_t offset = position % ring_capacity;
+    size_t first = std::min(bytes, ring_capacity - offset);
+    std::memcpy(dst, ring.data + offset, first);
+    std::memcpy(dst + first, ring.data, bytes - first);
+}
+
+void ShmChannel::copy_to(Ring& ring, uint64_t position, const uint8_t* src, size_t bytes)
+{
+    size_t offset = position % ring_capacity;
+    size_t first = std::min(bytes, ring_capacity - offset);
+    std::memcpy(ring.data + offset, src, first);
+    std::memcpy(ring.data, src + first, bytes - first);
+}
+
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <functional>
+#include "types.hpp"
+
+namespace tcp
+{
+
+// Pair of single-producer/single-consumer byte rings in a POSIX shared memory segment.
+// The client creates the segment, the server opens it; each side writes one ring and reads the other.
+// Messages keep their boundaries (length prefixed) and an idle reader sleeps on a futex.
+class ShmChannel : public std::enable_shared_from_this<ShmChannel>
+{
+public:
+using MessageCallback = std::function<void(const uint8_t* data, size_t bytes)>;
+using ClosedCallback = std::function<void()>;
+
+static constexpr size_t ring_capacity = 1 << 20;
+
+static std::shared_ptr<ShmChannel> create(const std::string& name_);
+static std::shared_ptr<ShmChannel> open(const std::string& name_);
+~ShmChannel();
+
+// closed_callback_ is called from the reader when the peer broke the ring format and the channel closed itself
+void start(MessageCallback callback_, ClosedCallback closed_callback_ = nullptr);
+void stop();
+bool write(const uint8_t* data, size_t bytes);
+
+private:
+    // larger payloads are split, the reader sees them as consecutive messages (like TCP segments)
+    static constexpr size_t max_message = ring_capacity / 2 - sizeof(uint32_t);
+
+    struct Ring
+    {
+        alignas(64) std::atomic<uint64_t> head;     // consumer position
+        alignas(64) std::atomic<uint64_t> tail;     // producer position
+        alignas(64) std::atomic<uint32_t> seq;      // futex word, bumped on every publish
+        std::atomic<uint32_t> waiting;
+        std::atomic<uint32_t> closed;
+        alignas(64) uint8_t data[ring_capacity];
+    };
+
+    struct Segment
+    {
+        Ring rings[2];
+    };
+
+    ShmChannel(const std::string& name_, Segment* segment_, bool creator_);
+
+    const std::string name;
+    Segment* segment;
+    Ring& rx_ring;
+    Ring& tx_ring;
+
+    std::mutex tx_mutex;
+    std::atomic<bool> running;
+    std::thread reader;
+    MessageCallback callback;
+    ClosedCallback closed_callback;
+
+    void read_loop();
+    static void copy_from(const Ring& ring, uint64_t position, uint8_t* dst, size_t bytes);
+    static void copy_to(Ring& ring, uint64_t position, const uint8_t* src, size_t bytes);
+};
+
+}
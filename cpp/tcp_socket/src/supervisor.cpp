@@ -0,0 +1,139 @@
+#include "supervisor.hpp"
+#include "logger.hpp"
+
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <stdexcept>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+
+namespace tcp
+{
+
+Supervisor::Supervisor() : signal_fd(-1), event_fd(-1), stop_requested(false)
+{
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+
+    // delivered through signal_fd only, never to a random thread
+    if(::pthread_sigmask(SIG_BLOCK, &signals, nullptr) != 0)
+    {
+        throw std::runtime_error("pthread_sigmask failed");
+    }
+
+    signal_fd = ::signalfd(-1, &signals, SFD_CLOEXEC);
+    event_fd = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if(signal_fd < 0 || event_fd < 0)
+    {
+        throw std::runtime_error(std::string("supervisor setup failed: ") + std::strerror(errno));
+    }
+}
+
+Supervisor::~Supervisor()
+{
+    ::close(signal_fd);
+    ::close(event_fd);
+}
+
+void Supervisor::watch(ServerBase& server)
+{
+    server.setStoppedCallback([this](){ notify({SupervisorEvent::Source::Server, 0}); });
+}
+
+void Supervisor::watch(ClientBase& client)
+{
+    uint16_t id = client.getId();
+    client.setStoppedCallback([this, id](){ notify({SupervisorEvent::Source::Client, id}); });
+}
+
+void Supervisor::setEventHandler(EventHandler handler_)
+{
+    handler = handler_;
+}
+
+int Supervisor::run()
+{
+    std::string function_id = getFunctionId(__func__, "Supervisor");
+
+    pollfd fds[2] = {{signal_fd, POLLIN, 0}, {event_fd, POLLIN, 0}};
+    while(true)
+    {
+        if(::poll(fds, 2, -1) < 0)
+        {
+            if(errno == EINTR) continue;
+            throw std::runtime_error(std::string("supervisor poll failed: ") + std::strerror(errno));
+        }
+
+        if(fds[0].revents & POLLIN)
+        {
+            signalfd_siginfo info;
+            if(::read(signal_fd, &info, sizeof(info)) == sizeof(info))
+            {
+                LOG_DEBUG << function_id << " Received " << strsignal(info.ssi_signo);
+                return info.ssi_signo;
+            }
+        }
+
+        if(fds[1].revents & POLLIN)
+        {
+            uint64_t count;
+            ssize_t ignored = ::read(event_fd, &count, sizeof(count));
+            (void)ignored;
+            dispatch();
+        }
+
+        std::lock_guard<std::mutex> lock(events_mutex);
+        if(stop_requested)
+        {
+            stop_requested = false;
+            return 0;
+        }
+    }
+}
+
+void Supervisor::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(events_mutex);
+        stop_requested = true;
+    }
+    uint64_t one = 1;
+    ssize_t ignored = ::write(event_fd, &one, sizeof(one));
+    (void)ignored;
+}
+
+void Supervisor::notify(const SupervisorEvent& event)
+{
+    {
+        std::lock_guard<std::mutex> lock(events_mutex);
+        events.push_back(event);
+    }
+    uint64_t one = 1;
+    ssize_t ignored = ::write(event_fd, &one, sizeof(one));
+    (void)ignored;
+}
+
+void Supervisor::dispatch()
+{
+    std::deque<SupervisorEvent> pending;
+    {
+        std::lock_guard<std::mutex> lock(events_mutex);
+        pending.swap(events);
+    }
+
+    // handlers run without the lock, they may restart a client that stops again right away
+    for(const SupervisorEvent& event : pending)
+    {
+        if(handler)
+        {
+            handler(event);
+        }
+    }
+}
+
+}
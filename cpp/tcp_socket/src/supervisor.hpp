@@ -0,0 +1,58 @@
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <functional>
+#include "server.hpp"
+#include "client.hpp"
+
+namespace tcp
+{
+
+struct SupervisorEvent
+{
+    enum class Source : uint8_t
+    {
+        Server,
+        Client
+    };
+
+    Source source;
+    uint16_t id;    // Client::getId(), 0 for the server
+};
+
+// Waits for server/client stop events and SIGINT/SIGTERM on one poll() (eventfd + signalfd),
+// so a failure is handled as soon as it happens and an idle supervisor costs nothing.
+// Construct it before any other thread is started: it blocks SIGINT/SIGTERM for the threads created afterwards.
+class Supervisor
+{
+public:
+using EventHandler = std::function<void(const SupervisorEvent& event)>;
+
+Supervisor();
+~Supervisor();
+
+// the supervisor must outlive what it watches
+void watch(ServerBase& server);
+void watch(ClientBase& client);
+
+// runs on the thread calling run(), may call watch(), Client::start() or stop()
+void setEventHandler(EventHandler handler_);
+
+// blocks until a signal arrives or stop() is called, returns the signal number (0 after stop())
+int run();
+void stop();
+
+private:
+    int signal_fd;
+    int event_fd;
+    bool stop_requested;
+    std::mutex events_mutex;
+    std::deque<SupervisorEvent> events;
+    EventHandler handler;
+
+    void notify(const SupervisorEvent& event);
+    void dispatch();
+};
+
+}
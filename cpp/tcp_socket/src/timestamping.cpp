@@ -0,0 +1,247 @@
+#include "timestamping.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+namespace tcp
+{
+
+namespace
+{
+
+thread_local std::chrono::system_clock::time_point receive_timestamp;
+
+std::chrono::system_clock::time_point toTimePoint(const timespec& ts)
+{
+    return std::chrono::system_clock::time_point(std::chrono::duration_cast<std::chrono::system_clock::duration>(
+        std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec)));
+}
+
+// the software stamp of a SCM_TIMESTAMPING control message, time_point() if there is none
+std::chrono::system_clock::time_point getSoftwareStamp(cmsghdr* cm)
+{
+    scm_timestamping stamps;
+    std::memcpy(&stamps, CMSG_DATA(cm), sizeof(stamps));
+    if(stamps.ts[0].tv_sec == 0 && stamps.ts[0].tv_nsec == 0) return std::chrono::system_clock::time_point();
+    return toTimePoint(stamps.ts[0]);
+}
+
+}
+
+LatencyHistogram::LatencyHistogram() : count(0), sum_ns(0), max_ns(0)
+{
+    for(auto& bucket : buckets)
+    {
+        bucket = 0;
+    }
+}
+
+void LatencyHistogram::record(std::chrono::nanoseconds latency)
+{
+    // clocks are not perfectly in step, a stamp may look slightly in the future
+    uint64_t ns = latency.count() > 0 ? (uint64_t)latency.count() : 0;
+    size_t bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+    buckets[std::min(bucket, bucket_count - 1)].fetch_add(1, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+    sum_ns.fetch_add(ns, std::memory_order_relaxed);
+
+    uint64_t current = max_ns.load(std::memory_order_relaxed);
+    while(ns > current && !max_ns.compare_exchange_weak(current, ns, std::memory_order_relaxed));
+}
+
+LatencySummary LatencyHistogram::getSummary() const
+{
+    LatencySummary summary;
+    uint64_t counts[bucket_count];
+    for(size_t i = 0; i < bucket_count; ++i)
+    {
+        counts[i] = buckets[i].load(std::memory_order_relaxed);
+        summary.count += counts[i];
+    }
+    if(summary.count == 0) return summary;
+
+    summary.mean = std::chrono::nanoseconds(sum_ns.load(std::memory_order_relaxed) / summary.count);
+    summary.max = std::chrono::nanoseconds(max_ns.load(std::memory_order_relaxed));
+
+    auto percentile = [&](double fraction)
+    {
+        uint64_t rank = (uint64_t)(fraction * (summary.count - 1)) + 1;
+        uint64_t seen = 0;
+        for(size_t i = 0; i < bucket_count; ++i)
+        {
+            seen += counts[i];
+            if(seen >= rank)
+            {
+                // bucket i holds [2^(i-1), 2^i)
+                return std::min(std::chrono::nanoseconds(i ? (int64_t)((1ull << i) - 1) : 0), summary.max);
+            }
+        }
+        return summary.max;
+    };
+    summary.p50 = percentile(0.50);
+    summary.p99 = percentile(0.99);
+    return summary;
+}
+
+SocketTimestamps::SocketTimestamps() : fd(-1), rx(false), tx(false), next_id(0)
+{
+
+}
+
+bool SocketTimestamps::enable(int fd_, bool tx_)
+{
+    int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+    if(tx_)
+    {
+        // ids count bytes from here on, stamps come without a copy of the data
+        flags |= SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+    }
+
+    std::lock_guard<std::mutex> lock(tx_mutex);
+    fd = fd_;
+    next_id = 0;
+    pending.clear();
+    receive_time = std::chrono::system_clock::time_point();
+    rx = ::setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) == 0;
+    tx = rx && tx_;
+    return rx;
+}
+
+bool SocketTimestamps::isEnabled() const
+{
+    return rx;
+}
+
+void SocketTimestamps::disableTx()
+{
+    if(!tx.exchange(false)) return;
+
+    int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+    ::setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags));
+
+    std::lock_guard<std::mutex> lock(tx_mutex);
+    pending.clear();
+}
+
+void SocketTimestamps::disable()
+{
+    if(!rx) return;
+
+    int flags = 0;
+    ::setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags));
+    rx = false;
+    tx = false;
+
+    std::lock_guard<std::mutex> lock(tx_mutex);
+    pending.clear();
+}
+
+ssize_t SocketTimestamps::receive(uint8_t* data, size_t bytes)
+{
+    iovec iov = {data, bytes};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(scm_timestamping))];
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t result = ::recvmsg(fd, &msg, MSG_DONTWAIT);
+    if(result <= 0) return result;
+
+    receive_time = std::chrono::system_clock::time_point();
+    for(cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != nullptr; cm = CMSG_NXTHDR(&msg, cm))
+    {
+        if(cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPING)
+        {
+            receive_time = getSoftwareStamp(cm);
+        }
+    }
+    return result;
+}
+
+std::chrono::system_clock::time_point SocketTimestamps::getReceiveTime() const
+{
+    return receive_time;
+}
+
+void SocketTimestamps::sent(size_t bytes, std::chrono::system_clock::time_point started_)
+{
+    if(!tx || bytes == 0) return;
+
+    std::lock_guard<std::mutex> lock(tx_mutex);
+    // TCP stamps the last byte of every sendmsg(), a write is complete with the stamp of its own last byte
+    next_id += (uint32_t)bytes;
+    pending.emplace_back(next_id - 1, started_);
+    if(pending.size() > max_pending)
+    {
+        pending.pop_front();
+    }
+}
+
+void SocketTimestamps::reap(LatencyHistogram& send_to_wire_)
+{
+    if(!tx) return;
+
+    std::lock_guard<std::mutex> lock(tx_mutex);
+    while(!pending.empty())
+    {
+        alignas(cmsghdr) char control[256];
+        msghdr msg = {};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if(::recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+        {
+            return; // EAGAIN, nothing stamped yet
+        }
+
+        std::chrono::system_clock::time_point stamp;
+        const sock_extended_err* serr = nullptr;
+        for(cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != nullptr; cm = CMSG_NXTHDR(&msg, cm))
+        {
+            if(cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPING)
+            {
+                stamp = getSoftwareStamp(cm);
+            }
+            else if((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                    (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+            {
+                serr = reinterpret_cast<const sock_extended_err*>(CMSG_DATA(cm));
+            }
+        }
+        if(!serr || serr->ee_errno != ENOMSG || serr->ee_origin != SO_EE_ORIGIN_TIMESTAMPING ||
+           serr->ee_info != SCM_TSTAMP_SND || stamp == std::chrono::system_clock::time_point())
+        {
+            continue;
+        }
+
+        // writes up to the stamped byte are on the wire, in order
+        uint32_t stamped = serr->ee_data;
+        while(!pending.empty() && (int32_t)(pending.front().first - stamped) <= 0)
+        {
+            if(pending.front().first == stamped)
+            {
+                send_to_wire_.record(stamp - pending.front().second);
+            }
+            pending.pop_front();
+        }
+    }
+}
+
+std::chrono::system_clock::time_point getReceiveTimestamp()
+{
+    return receive_timestamp;
+}
+
+void setReceiveTimestamp(std::chrono::system_clock::time_point when)
+{
+    receive_timestamp = when;
+}
+
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <sys/types.h>
+
+namespace tcp
+{
+
+struct LatencySummary
+{
+    uint64_t count = 0;
+    std::chrono::nanoseconds mean{0};
+    std::chrono::nanoseconds p50{0};    // percentiles are the upper bound of their power of two bucket
+    std::chrono::nanoseconds p99{0};
+    std::chrono::nanoseconds max{0};
+};
+
+// Lock free latency distribution in power of two buckets of nanoseconds
+class LatencyHistogram
+{
+public:
+LatencyHistogram();
+
+void record(std::chrono::nanoseconds latency);
+LatencySummary getSummary() const;
+
+private:
+    static constexpr size_t bucket_count = 64;
+
+    std::atomic<uint64_t> buckets[bucket_count];
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> sum_ns;
+    std::atomic<uint64_t> max_ns;
+};
+
+struct TimestampStats
+{
+    LatencySummary kernel_to_handler;   // kernel received the data -> handler called (our reading and queueing)
+    LatencySummary send_to_wire;        // written to the socket -> kernel handed it to the driver (socket buffer, qdisc)
+};
+
+// Software kernel timestamps (SO_TIMESTAMPING) of one TCP socket. Receive times come with the data when it is
+// read through receive(); transmit times are queued by the kernel on the socket error queue and matched to
+// the writes reported with sent() by their byte offset.
+class SocketTimestamps
+{
+public:
+SocketTimestamps();
+
+// before anything is written to the socket, false when the kernel refuses (the socket then has no timestamps)
+bool enable(int fd_, bool tx_);
+bool isEnabled() const;
+// for writes we do not see (sendfile) or an error queue shared with MSG_ZEROCOPY, receive times go on
+void disableTx();
+// stamps off for good, in both directions (a socket passed to another process)
+void disable();
+
+// recv(MSG_DONTWAIT) that keeps the kernel receive time of the data, -1 with errno set as recv() does
+ssize_t receive(uint8_t* data, size_t bytes);
+// of the last receive(), time_point() if the kernel gave none
+std::chrono::system_clock::time_point getReceiveTime() const;
+
+// a write of bytes that started at started_ (before the call, the kernel may stamp it before the call returns)
+void sent(size_t bytes, std::chrono::system_clock::time_point started_);
+// reads the transmit times the kernel queued so far, every write they complete goes to send_to_wire_
+void reap(LatencyHistogram& send_to_wire_);
+
+private:
+    // writes waiting for their stamp, the oldest are dropped beyond this (the kernel may drop stamps too)
+    static constexpr size_t max_pending = 4096;
+
+    int fd;
+    bool rx;
+    std::atomic<bool> tx;
+    std::chrono::system_clock::time_point receive_time;
+    std::mutex tx_mutex;
+    uint32_t next_id;
+    // id of the last byte of a write and when it was written
+    std::deque<std::pair<uint32_t, std::chrono::system_clock::time_point>> pending;
+};
+
+// kernel receive time of the data holding the message dispatched on this thread, only valid during the handler
+// call; time_point() if there is none (timestamping off, TLS or shared memory transport)
+std::chrono::system_clock::time_point getReceiveTimestamp();
+void setReceiveTimestamp(std::chrono::system_clock::time_point when);
+
+}
@@ -0,0 +1,321 @@
+#include "tls.hpp"
+#include "logger.hpp"
+
+#include <csignal>
+#include <stdexcept>
+#include <poll.h>
+#include <unistd.h>
+#include <boost/asio/ip/address.hpp>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+
+namespace tcp
+{
+
+static void ignoreSigpipe()
+{
+    // OpenSSL writes with write(2), a reset peer must surface as an error instead of killing the process
+    static std::once_flag once;
+    std::call_once(once, [](){ std::signal(SIGPIPE, SIG_IGN); });
+}
+
+static std::string getSslError()
+{
+    char buffer[256] = {};
+    ERR_error_string_n(ERR_get_error(), buffer, sizeof(buffer));
+    return buffer;
+}
+
+std::unique_ptr<TlsContext> makeServerTlsContext(const TlsConfig& config)
+{
+    ignoreSigpipe();
+    std::unique_ptr<TlsContext> context = std::make_unique<TlsContext>(TlsContext::tls_server);
+
+    context->set_options(TlsContext::default_workarounds | TlsContext::no_sslv2 | TlsContext::no_sslv3 |
+                         TlsContext::no_tlsv1 | TlsContext::no_tlsv1_1 | TlsContext::single_dh_use);
+    context->use_certificate_chain_file(config.certificate_file);
+    context->use_private_key_file(config.private_key_file, TlsContext::pem);
+
+    if(!config.ca_file.empty())
+    {
+        context->load_verify_file(config.ca_file);
+        context->set_verify_mode(boost::asio::ssl::verify_peer | boost::asio::ssl::verify_fail_if_no_peer_cert);
+    }
+
+    // resumption: session cache for TLS 1.2, tickets (on by default) for TLS 1.3
+    static const unsigned char session_id_context[] = "tcp_socket";
+    SSL_CTX_set_session_cache_mode(context->native_handle(), SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_session_id_context(context->native_handle(), session_id_context, sizeof(session_id_context) - 1);
+
+    if(config.ktls)
+    {
+        SSL_CTX_set_options(context->native_handle(), SSL_OP_ENABLE_KTLS);
+    }
+
+    return context;
+}
+
+std::unique_ptr<TlsContext> makeClientTlsContext(const TlsConfig& config)
+{
+    ignoreSigpipe();
+    std::unique_ptr<TlsContext> context = std::make_unique<TlsContext>(TlsContext::tls_client);
+
+    context->set_options(TlsContext::default_workarounds | TlsContext::no_sslv2 | TlsContext::no_sslv3 |
+                         TlsContext::no_tlsv1 | TlsContext::no_tlsv1_1);
+
+    if(!config.certificate_file.empty() && !config.private_key_file.empty())
+    {
+        context->use_certificate_chain_file(config.certificate_file);
+        context->use_private_key_file(config.private_key_file, TlsContext::pem);
+    }
+
+    if(!config.ca_file.empty())
+    {
+        context->load_verify_file(config.ca_file);
+        context->set_verify_mode(boost::asio::ssl::verify_peer);
+    }
+    else
+    {
+        context->set_verify_mode(boost::asio::ssl::verify_none);
+    }
+
+    // sessions are handed to the owner through the new session callback, see Client
+    SSL_CTX_set_session_cache_mode(context->native_handle(), SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+
+    if(config.ktls)
+    {
+        SSL_CTX_set_options(context->native_handle(), SSL_OP_ENABLE_KTLS);
+    }
+
+    return context;
+}
+
+TlsChannel::TlsChannel(TlsContext& context_, Socket& socket_, bool server_)
+    : socket(socket_), ssl(SSL_new(context_.native_handle())), server(server_)
+{
+    if(ssl == nullptr)
+    {
+        throw std::runtime_error("SSL_new failed: " + getSslError());
+    }
+
+    socket.native_non_blocking(true);
+    SSL_set_fd(ssl, socket.native_handle());
+}
+
+TlsChannel::~TlsChannel()
+{
+    // best effort close_notify; it also marks the shutdown as clean, otherwise
+    // SSL_free() invalidates the session and the next connect cannot resume it
+    if(SSL_is_init_finished(ssl))
+    {
+        SSL_shutdown(ssl);
+    }
+    SSL_free(ssl);
+}
+
+void TlsChannel::handshake(SSL_SESSION* session_)
+{
+    std::lock_guard<std::mutex> lock(ssl_mutex);
+
+    if(session_ != nullptr)
+    {
+        SSL_set_session(ssl, session_);
+    }
+
+    auto deadline = std::chrono::steady_clock::now() + tls_handshake_timeout;
+    while(true)
+    {
+        int result = server ? SSL_accept(ssl) : SSL_connect(ssl);
+        if(result == 1) break;
+
+        int error = SSL_get_error(ssl, result);
+        if((error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE) || std::chrono::steady_clock::now() > deadline)
+        {
+            throw std::runtime_error("TLS handshake failed: " + getSslError());
+        }
+        wait_for(error);
+    }
+
+    log_handshake();
+}
+
+bool TlsChannel::handshakeStep(Socket::wait_type& wait_)
+{
+    std::lock_guard<std::mutex> lock(ssl_mutex);
+
+    ERR_clear_error();
+    int result = server ? SSL_accept(ssl) : SSL_connect(ssl);
+    if(result == 1)
+    {
+        log_handshake();
+        return true;
+    }
+
+    switch (SSL_get_error(ssl, result))
+    {
+    case SSL_ERROR_WANT_READ:
+        wait_ = Socket::wait_read;
+        return false;
+    case SSL_ERROR_WANT_WRITE:
+        wait_ = Socket::wait_write;
+        return false;
+    default:
+        throw std::runtime_error("TLS handshake failed: " + getSslError());
+    }
+}
+
+void TlsChannel::setServerName(const std::string& name)
+{
+    std::lock_guard<std::mutex> lock(ssl_mutex);
+
+    boost::system::error_code ec;
+    boost::asio::ip::make_address(name, ec);
+    if(!ec)
+    {
+        // SNI carries host names only
+        if(X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), name.c_str()) != 1)
+        {
+            throw std::runtime_error("Invalid TLS server address " + name + ": " + getSslError());
+        }
+        return;
+    }
+
+    SSL_set_hostflags(ssl, X509_CHECK_FLAG_NO_PARTIAL_WILDCARDS);
+    if(SSL_set1_host(ssl, name.c_str()) != 1 || SSL_set_tlsext_host_name(ssl, name.c_str()) != 1)
+    {
+        throw std::runtime_error("Invalid TLS server name " + name + ": " + getSslError());
+    }
+}
+
+size_t TlsChannel::read_some(uint8_t* data, size_t size, boost::system::error_code& ec)
+{
+    std::lock_guard<std::mutex> lock(ssl_mutex);
+
+    ERR_clear_error();
+    int result = SSL_read(ssl, data, (int)size);
+    if(result > 0)
+    {
+        return result;
+    }
+
+    switch (SSL_get_error(ssl, result))
+    {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        return 0;
+    case SSL_ERROR_ZERO_RETURN:
+        ec = boost::asio::error::eof;
+        return 0;
+    case SSL_ERROR_SYSCALL:
+        // peer went away without close_notify
+        if(ERR_peek_error() == 0)
+        {
+            ec = boost::asio::error::eof;
+        }
+        else
+        {
+            ec = boost::asio::error::connection_aborted;
+        }
+        return 0;
+    default:
+        ec = boost::asio::error::connection_aborted;
+        return 0;
+    }
+}
+
+void TlsChannel::write(const uint8_t* data, size_t size)
+{
+    std::lock_guard<std::mutex> lock(ssl_mutex);
+
+    while(size > 0)
+    {
+        ERR_clear_error();
+        size_t written = 0;
+        int result = SSL_write_ex(ssl, data, size, &written);
+        if(result == 1)
+        {
+            data += written;
+            size -= written;
+            continue;
+        }
+
+        int error = SSL_get_error(ssl, result);
+        if(error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE)
+        {
+            throw std::runtime_error("TLS write failed: " + getSslError());
+        }
+        wait_for(error);
+    }
+}
+
+void TlsChannel::sendFile(int fd, off_t offset, size_t count)
+{
+    if(ktlsSend())
+    {
+        std::lock_guard<std::mutex> lock(ssl_mutex);
+
+        // the kernel encrypts straight from the page cache
+        while(count > 0)
+        {
+            ossl_ssize_t sent = SSL_sendfile(ssl, fd, offset, count, 0);
+            if(sent > 0)
+            {
+                offset += sent;
+                count -= sent;
+                continue;
+            }
+
+            int error = SSL_get_error(ssl, (int)sent);
+            if(error != SSL_ERROR_WANT_WRITE)
+            {
+                throw std::runtime_error("TLS sendfile failed: " + getSslError());
+            }
+            wait_for(error);
+        }
+        return;
+    }
+
+    Payload chunk(std::min(count, (size_t)(64 * 1024)));
+    while(count > 0)
+    {
+        ssize_t bytes = ::pread(fd, chunk.data(), std::min(count, chunk.size()), offset);
+        if(bytes <= 0)
+        {
+            throw std::runtime_error("pread stopped with " + std::to_string(count) + " bytes left");
+        }
+        write(chunk.data(), bytes);
+        offset += bytes;
+        count -= bytes;
+    }
+}
+
+bool TlsChannel::sessionReused() const
+{
+    return SSL_session_reused(ssl);
+}
+
+bool TlsChannel::ktlsSend() const
+{
+    return BIO_get_ktls_send(SSL_get_wbio(ssl));
+}
+
+bool TlsChannel::ktlsRecv() const
+{
+    return BIO_get_ktls_recv(SSL_get_rbio(ssl));
+}
+
+void TlsChannel::log_handshake() const
+{
+    LOG_DEBUG << getFunctionId("handshake", "TlsChannel") << " " << SSL_get_version(ssl) << " " << SSL_get_cipher_name(ssl)
+              << ", resumed: " << std::boolalpha << (bool)SSL_session_reused(ssl)
+              << ", ktls tx: " << (bool)BIO_get_ktls_send(SSL_get_wbio(ssl))
+              << ", ktls rx: " << (bool)BIO_get_ktls_recv(SSL_get_rbio(ssl));
+}
+
+void TlsChannel::wait_for(int ssl_error)
+{
+    pollfd pfd = {socket.native_handle(), (short)((ssl_error == SSL_ERROR_WANT_WRITE) ? POLLOUT : POLLIN), 0};
+    ::poll(&pfd, 1, 100);
+}
+
+}
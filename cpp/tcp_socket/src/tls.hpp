@@ -0,0 +1,68 @@
+#pragma once
+
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <boost/asio/ssl/context.hpp>
+#include <openssl/ssl.h>
+#include "types.hpp"
+
+namespace tcp
+{
+
+struct TlsConfig
+{
+    bool enabled = false;
+    std::string certificate_file;   // PEM chain, required on the server
+    std::string private_key_file;
+    std::string ca_file;            // when set the peer certificate is verified against it
+    std::string server_name;        // client: the name (or IP address) the server certificate must be issued for,
+                                    // also sent as SNI; the server address when empty
+    bool ktls = true;               // let the kernel encrypt/decrypt records when it supports it
+};
+
+using TlsContext = boost::asio::ssl::context;
+
+// how long a handshake may take, blocking or driven step by step
+constexpr std::chrono::milliseconds tls_handshake_timeout(5000);
+
+std::unique_ptr<TlsContext> makeServerTlsContext(const TlsConfig& config);
+std::unique_ptr<TlsContext> makeClientTlsContext(const TlsConfig& config);
+
+// TLS driven directly on the socket fd (not through an Asio BIO pair), so OpenSSL can switch
+// the connection to kernel TLS after the handshake. The fd is put in non-blocking mode:
+// readers wait for Socket::wait_read and call read_some(), writers block in write().
+class TlsChannel
+{
+public:
+TlsChannel(TlsContext& context_, Socket& socket_, bool server_);
+~TlsChannel();
+
+// blocking, throws std::runtime_error on failure
+void handshake(SSL_SESSION* session_ = nullptr);
+// non-blocking: true once the handshake is done, otherwise wait_ is what the socket must become ready for
+// before the next step; throws std::runtime_error on failure (the caller enforces tls_handshake_timeout)
+bool handshakeStep(Socket::wait_type& wait_);
+// client, before the handshake: the certificate must be issued for name (a host name, also sent as SNI, or an IP address)
+void setServerName(const std::string& name);
+
+// returns 0 when nothing is available yet
+size_t read_some(uint8_t* data, size_t size, boost::system::error_code& ec);
+void write(const uint8_t* data, size_t size);
+void sendFile(int fd, off_t offset, size_t count);
+
+bool sessionReused() const;
+bool ktlsSend() const;
+bool ktlsRecv() const;
+
+private:
+    Socket& socket;
+    SSL* ssl;
+    const bool server;
+    std::mutex ssl_mutex;
+
+    void wait_for(int ssl_error);
+    void log_handshake() const;
+};
+
+}
@@ -0,0 +1,245 @@
+#include "trace.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+namespace tcp
+{
+
+std::atomic<uint32_t> Tracer::sample_every(0);
+
+namespace
+{
+
+struct TraceEvent
+{
+    uint64_t trace_id;
+    uint64_t time;          // steady clock, ns
+    uint32_t thread;
+    uint16_t connection;
+    TraceStage stage;
+};
+
+// written by its thread only, the exporter reads the first `size` events
+struct ThreadBuffer
+{
+    static constexpr size_t capacity = 64 * 1024;
+
+    std::vector<TraceEvent> events = std::vector<TraceEvent>(capacity);
+    std::atomic<size_t> size{0};
+    std::atomic<uint64_t> dropped{0};
+};
+
+// connection threads come and go (and may be gone by export time): the events of an exited thread are kept,
+// compacted, up to max_retired_events in all, and its buffer goes to the next thread or is freed
+constexpr size_t max_retired_events = 1024 * 1024;
+constexpr size_t max_spare_buffers = 16;
+
+std::mutex registry_mutex;
+std::vector<ThreadBuffer*> registry;    // buffers of the running threads
+std::vector<std::unique_ptr<ThreadBuffer>> spare_buffers;
+std::vector<TraceEvent> retired_events;
+uint64_t retired_dropped = 0;
+std::atomic<uint64_t> next_trace_id(1);
+
+class ThreadBufferOwner
+{
+public:
+    ThreadBufferOwner()
+    {
+        {
+            std::lock_guard<std::mutex> lock(registry_mutex);
+            if(!spare_buffers.empty())
+            {
+                buffer = std::move(spare_buffers.back());
+                spare_buffers.pop_back();
+            }
+        }
+        if(!buffer)
+        {
+            buffer = std::make_unique<ThreadBuffer>();
+        }
+
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        registry.push_back(buffer.get());
+    }
+
+    ~ThreadBufferOwner()
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        registry.erase(std::find(registry.begin(), registry.end(), buffer.get()));
+
+        size_t size = buffer->size.load(std::memory_order_acquire);
+        size_t kept = std::min(size, max_retired_events - retired_events.size());
+        retired_events.insert(retired_events.end(), buffer->events.begin(), buffer->events.begin() + kept);
+        retired_dropped += buffer->dropped.load(std::memory_order_relaxed) + (size - kept);
+
+        if(spare_buffers.size() < max_spare_buffers)
+        {
+            buffer->size.store(0, std::memory_order_relaxed);
+            buffer->dropped.store(0, std::memory_order_relaxed);
+            spare_buffers.push_back(std::move(buffer));
+        }
+    }
+
+    std::unique_ptr<ThreadBuffer> buffer;
+};
+
+ThreadBuffer& threadBuffer()
+{
+    thread_local ThreadBufferOwner owner;
+    return *owner.buffer;
+}
+
+uint32_t threadId()
+{
+    thread_local uint32_t id = (uint32_t)::syscall(SYS_gettid);
+    return id;
+}
+
+thread_local uint64_t current_trace = 0;
+thread_local uint32_t reads_until_sample = 0;
+
+}
+
+const char* toString(TraceStage stage)
+{
+    switch(stage)
+    {
+        case TraceStage::ReadComplete: return "read complete";
+        case TraceStage::LockAcquired: return "lock acquired";
+        case TraceStage::HandlerStart: return "handler start";
+        case TraceStage::HandlerEnd: return "handler end";
+        case TraceStage::WriteQueued: return "write queued";
+        case TraceStage::WriteComplete: return "write complete";
+    }
+    return "unknown";
+}
+
+void Tracer::enable(uint32_t sample_every_)
+{
+    sample_every = sample_every_;
+}
+
+bool Tracer::enabled()
+{
+    return sample_every.load(std::memory_order_relaxed) != 0;
+}
+
+uint64_t Tracer::sample()
+{
+    uint32_t every = sample_every.load(std::memory_order_relaxed);
+    if(every == 0)
+    {
+        current_trace = 0;
+        return 0;
+    }
+
+    // per thread countdown, sampling costs no shared write
+    if(reads_until_sample > 0)
+    {
+        --reads_until_sample;
+        current_trace = 0;
+        return 0;
+    }
+    reads_until_sample = every - 1;
+    current_trace = next_trace_id.fetch_add(1, std::memory_order_relaxed);
+    return current_trace;
+}
+
+uint64_t Tracer::current()
+{
+    return current_trace;
+}
+
+void Tracer::setCurrent(uint64_t trace_id)
+{
+    current_trace = trace_id;
+}
+
+void Tracer::stamp(uint64_t trace_id, TraceStage stage, uint16_t connection)
+{
+    if(trace_id == 0) return;
+
+    ThreadBuffer& buffer = threadBuffer();
+    size_t size = buffer.size.load(std::memory_order_relaxed);
+    if(size == ThreadBuffer::capacity)
+    {
+        buffer.dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    TraceEvent& event = buffer.events[size];
+    event.trace_id = trace_id;
+    event.time = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    event.thread = threadId();
+    event.connection = connection;
+    event.stage = stage;
+    // publishes the event to exportChromeTrace()
+    buffer.size.store(size + 1, std::memory_order_release);
+}
+
+uint64_t Tracer::getDropped()
+{
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    uint64_t dropped = retired_dropped;
+    for(auto& buffer : registry)
+    {
+        dropped += buffer->dropped.load(std::memory_order_relaxed);
+    }
+    return dropped;
+}
+
+bool Tracer::exportChromeTrace(const std::string& path)
+{
+    std::map<uint64_t, std::vector<TraceEvent>> traces;
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        for(const TraceEvent& event : retired_events)
+        {
+            traces[event.trace_id].push_back(event);
+        }
+        for(auto& buffer : registry)
+        {
+            size_t size = buffer->size.load(std::memory_order_acquire);
+            for(size_t i = 0; i < size; ++i)
+            {
+                traces[buffer->events[i].trace_id].push_back(buffer->events[i]);
+            }
+        }
+    }
+
+    std::ofstream file(path);
+    if(!file) return false;
+
+    // one complete ("X") event per step, named after the stages it spans, on the thread that started it
+    file << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    bool first = true;
+    for(auto& trace : traces)
+    {
+        std::vector<TraceEvent>& events = trace.second;
+        std::stable_sort(events.begin(), events.end(), [](const TraceEvent& a, const TraceEvent& b){ return a.time < b.time; });
+
+        for(size_t i = 1; i < events.size(); ++i)
+        {
+            const TraceEvent& from = events[i - 1];
+            const TraceEvent& to = events[i];
+            file << (first ? "" : ",") << "\n{\"name\":\"" << toString(from.stage) << " -> " << toString(to.stage) << "\""
+                 << ",\"cat\":\"message\",\"ph\":\"X\",\"pid\":1,\"tid\":" << from.thread
+                 << ",\"ts\":" << std::fixed << from.time / 1e3 << ",\"dur\":" << (to.time - from.time) / 1e3
+                 << ",\"args\":{\"message\":" << trace.first << ",\"connection\":" << from.connection << "}}";
+            first = false;
+        }
+    }
+    file << "\n]}\n";
+    return (bool)file;
+}
+
+}
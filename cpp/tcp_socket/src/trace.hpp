@@ -0,0 +1,56 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+namespace tcp
+{
+
+// Where a traced message is when it gets stamped
+enum class TraceStage : uint8_t
+{
+    ReadComplete,   // the read holding the message completed
+    LockAcquired,   // rx_mutex taken, the message is next for the handler
+    HandlerStart,
+    HandlerEnd,
+    WriteQueued,    // the handler called send() for the reply
+    WriteComplete   // the reply was handed to the kernel (zero-copy: the kernel released the buffer)
+};
+
+const char* toString(TraceStage stage);
+
+// Sampled per-message tracing through the server pipeline.
+//
+// Every sample_every-th read of a thread starts a trace, its first message is stamped at every stage it
+// goes through. Replies are tied to it when the handler sends them from its own thread (the common
+// request/response case). Stamps go to a fixed size buffer of the stamping thread, so tracing takes no
+// lock on the hot path; once a buffer is full further stamps of that thread are dropped and counted.
+// Buffers of exited threads are recycled, their stamps are kept (up to a bound) for the export.
+//
+// exportChromeTrace() writes the spans between consecutive stamps of each message in the Chrome trace
+// event format, open it in chrome://tracing or https://ui.perfetto.dev.
+class Tracer
+{
+public:
+// 0 = off (default), must be called before the traced threads start
+static void enable(uint32_t sample_every);
+static bool enabled();
+
+// starts a trace for every sample_every-th call on this thread and makes it current, returns its id (0 = not sampled)
+static uint64_t sample();
+// message traced by this thread right now, 0 if none
+static uint64_t current();
+static void setCurrent(uint64_t trace_id);
+// no-op for trace_id 0
+static void stamp(uint64_t trace_id, TraceStage stage, uint16_t connection);
+
+// false when the file can not be written, may be called while tracing goes on
+static bool exportChromeTrace(const std::string& path);
+static uint64_t getDropped();
+
+private:
+static std::atomic<uint32_t> sample_every;
+};
+
+}
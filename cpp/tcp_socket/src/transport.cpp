@@ -0,0 +1,126 @@
+#include "transport.hpp"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <sys/un.h>
+
+namespace tcp
+{
+
+static const std::string unixPrefix("unix:");
+static const std::string shmPrefix("shm:");
+
+Transport getTransport(const std::string& address)
+{
+    if(address.compare(0, unixPrefix.size(), unixPrefix) == 0) return Transport::Unix;
+    if(address.compare(0, shmPrefix.size(), shmPrefix) == 0) return Transport::SharedMemory;
+    return Transport::Tcp;
+}
+
+std::string getTransportPath(const std::string& address)
+{
+    switch (getTransport(address))
+    {
+    case Transport::Unix:
+        return address.substr(unixPrefix.size());
+    case Transport::SharedMemory:
+        return address.substr(shmPrefix.size());
+    case Transport::Tcp:
+    default:
+        return std::string();
+    }
+}
+
+Endpoint makeEndpoint(const std::string& address, uint16_t port)
+{
+    if(getTransport(address) == Transport::Tcp)
+    {
+        return Endpoint(boost::asio::ip::tcp::endpoint(boost::asio::ip::make_address_v4(address), port));
+    }
+
+    return Endpoint(boost::asio::local::stream_protocol::endpoint(getTransportPath(address)));
+}
+
+Endpoint makeClientEndpoint(const std::string& address, uint16_t port, const std::string& server_address)
+{
+    if(getTransport(server_address) == Transport::Tcp)
+    {
+        return makeEndpoint(address, port);
+    }
+
+    return Endpoint(boost::asio::local::stream_protocol::endpoint(getTransportPath(server_address) + "." + std::to_string(port)));
+}
+
+uint16_t getPort(const Endpoint& endpoint)
+{
+    switch (endpoint.data()->sa_family)
+    {
+    case AF_INET:
+        return ntohs(reinterpret_cast<const sockaddr_in*>(endpoint.data())->sin_port);
+    case AF_INET6:
+        return ntohs(reinterpret_cast<const sockaddr_in6*>(endpoint.data())->sin6_port);
+    case AF_UNIX:
+    {
+        std::string path = toString(endpoint);
+        size_t dot = path.find_last_of('.');
+        if(dot == std::string::npos || dot + 1 == path.size()) return 0;
+
+        std::string port = path.substr(dot + 1);
+        if(!std::all_of(port.begin(), port.end(), ::isdigit)) return 0;
+        return (uint16_t)std::stoul(port);
+    }
+    default:
+        return 0;
+    }
+}
+
+std::string getSourceAddress(const Endpoint& endpoint)
+{
+    switch (endpoint.data()->sa_family)
+    {
+    case AF_INET:
+    {
+        char ip[INET_ADDRSTRLEN] = {};
+        ::inet_ntop(AF_INET, &reinterpret_cast<const sockaddr_in*>(endpoint.data())->sin_addr, ip, sizeof(ip));
+        return ip;
+    }
+    case AF_INET6:
+    {
+        char ip[INET6_ADDRSTRLEN] = {};
+        ::inet_ntop(AF_INET6, &reinterpret_cast<const sockaddr_in6*>(endpoint.data())->sin6_addr, ip, sizeof(ip));
+        return ip;
+    }
+    default:
+        return "local";
+    }
+}
+
+std::string toString(const Endpoint& endpoint)
+{
+    switch (endpoint.data()->sa_family)
+    {
+    case AF_INET:
+    {
+        char ip[INET_ADDRSTRLEN] = {};
+        ::inet_ntop(AF_INET, &reinterpret_cast<const sockaddr_in*>(endpoint.data())->sin_addr, ip, sizeof(ip));
+        return std::string(ip) + ":" + std::to_string(getPort(endpoint));
+    }
+    case AF_UNIX:
+    {
+        const sockaddr_un* address = reinterpret_cast<const sockaddr_un*>(endpoint.data());
+        size_t length = endpoint.size() - offsetof(sockaddr_un, sun_path);
+        return std::string(address->sun_path, strnlen(address->sun_path, length));
+    }
+    default:
+        return std::string();
+    }
+}
+
+std::string getShmName(const std::string& server_address, uint16_t port)
+{
+    std::string name = getTransportPath(server_address);
+    std::replace(name.begin(), name.end(), '/', '_');
+    return "/tcp" + name + "." + std::to_string(port);
+}
+
+}
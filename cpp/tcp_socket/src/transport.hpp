@@ -0,0 +1,34 @@
+#pragma once
+
+#include <string>
+#include "types.hpp"
+
+namespace tcp
+{
+
+// Selected by the address given to Server/Client:
+//   "127.0.0.1"        -> Tcp
+//   "unix:/tmp/app"    -> Unix domain socket at /tmp/app
+//   "shm:/tmp/app"     -> Unix domain socket at /tmp/app for connection setup, payloads over shared memory rings
+enum class Transport : uint8_t
+{
+    Tcp,
+    Unix,
+    SharedMemory
+};
+
+Transport getTransport(const std::string& address);
+std::string getTransportPath(const std::string& address);
+
+Endpoint makeEndpoint(const std::string& address, uint16_t port);
+// same-host clients bind to "<server path>.<port>" so the server still tells them apart by port
+Endpoint makeClientEndpoint(const std::string& address, uint16_t port, const std::string& server_address);
+
+uint16_t getPort(const Endpoint& endpoint);
+std::string toString(const Endpoint& endpoint);
+// peer address without the port ("local" for unix sockets), groups connections coming from one host
+std::string getSourceAddress(const Endpoint& endpoint);
+
+std::string getShmName(const std::string& server_address, uint16_t port);
+
+}
@@ -2,6 +2,8 @@
 
 #include <vector>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
+#include <boost/asio/generic/stream_protocol.hpp>
 
 
 namespace tcp
@@ -11,9 +13,24 @@ namespace tcp
 using Payload = std::vector<uint8_t>;
 
 // Boost types
+// generic stream sockets, so TCP and Unix domain sockets share the same code path (see transport.hpp)
 using Context = boost::asio::io_context;
-using Endpoint = boost::asio::ip::tcp::endpoint;
-using Socket = boost::asio::ip::tcp::socket;
-using Acceptor = boost::asio::ip::tcp::acceptor;
+using Endpoint = boost::asio::generic::stream_protocol::endpoint;
+using Socket = boost::asio::generic::stream_protocol::socket;
+using Acceptor = boost::asio::basic_socket_acceptor<boost::asio::generic::stream_protocol>;
+
+// I/O backend selected at build time (see TCP_USE_IO_URING in CMakeLists.txt)
+#if defined(BOOST_ASIO_HAS_IO_URING) && defined(BOOST_ASIO_DISABLE_EPOLL)
+#define TCP_IO_URING_BACKEND
+#endif
+
+inline const char* getIoBackend()
+{
+#ifdef TCP_IO_URING_BACKEND
+    return "io_uring";
+#else
+    return "epoll";
+#endif
+}
 
 }
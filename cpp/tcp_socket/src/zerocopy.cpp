@@ -0,0 +1,234 @@
+#include "zerocopy.hpp"
+#include "logger.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <linux/errqueue.h>
+
+namespace tcp
+{
+
+ZeroCopySender::ZeroCopySender(Socket& socket_)
+    : socket(socket_), zerocopy_enabled(false), copied_logged(false), next_id(0)
+{
+
+}
+
+ZeroCopySender::~ZeroCopySender()
+{
+    std::lock_guard<std::mutex> lock(pending_mutex);
+
+    // the kernel keeps its own page references, dropping our ownership here is safe
+    pending_sends.clear();
+}
+
+bool ZeroCopySender::enable()
+{
+    std::string function_id = getFunctionId(__func__, "ZeroCopySender");
+
+    if(zerocopy_enabled) return true;
+
+    int one = 1;
+    if(::setsockopt(socket.native_handle(), SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) != 0)
+    {
+        LOG_WARNING << function_id << " SO_ZEROCOPY not supported: " << std::strerror(errno);
+        return false;
+    }
+
+    LOG_DEBUG << function_id << " SO_ZEROCOPY enabled";
+    zerocopy_enabled = true;
+    return true;
+}
+
+bool ZeroCopySender::enabled() const
+{
+    return zerocopy_enabled;
+}
+
+size_t ZeroCopySender::pending() const
+{
+    std::lock_guard<std::mutex> lock(pending_mutex);
+    return pending_sends.size();
+}
+
+size_t ZeroCopySender::pendingBytes() const
+{
+    std::lock_guard<std::mutex> lock(pending_mutex);
+    size_t bytes = 0;
+    for(const PendingSend& pending_send : pending_sends)
+    {
+        bytes += pending_send.buffer ? pending_send.buffer->capacity() : 0;
+    }
+    return bytes;
+}
+
+void ZeroCopySender::send(std::unique_ptr<Payload> txBuffer_, Completion completion_)
+{
+    std::string function_id = getFunctionId(__func__, "ZeroCopySender");
+
+    std::deque<PendingSend> finished;
+    std::unique_lock<std::mutex> lock(pending_mutex);
+
+    const uint8_t* data = txBuffer_->data();
+    size_t remaining = txBuffer_->size();
+    bool sent_any = false;
+
+    while(remaining > 0)
+    {
+        ssize_t sent = ::send(socket.native_handle(), data, remaining, MSG_ZEROCOPY | MSG_NOSIGNAL);
+        if(sent < 0)
+        {
+            if(errno == EINTR) continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                wait_for(POLLOUT);
+                continue;
+            }
+            if(errno == ENOBUFS)
+            {
+                // optmem limit reached by pinned pages, wait for the kernel to release some
+                wait_for(POLLERR);
+                reap_locked(finished);
+                continue;
+            }
+
+            LOG_ERROR_LIMITED(10) << function_id << " send failed: " << std::strerror(errno);
+            break;
+        }
+
+        // every successful MSG_ZEROCOPY call consumes one notification id
+        ++next_id;
+        sent_any = true;
+        data += sent;
+        remaining -= sent;
+    }
+
+    if(sent_any)
+    {
+        // also after a failure part way, the kernel reports the calls that went through
+        pending_sends.push_back({next_id - 1, std::move(txBuffer_), completion_});
+    }
+    else
+    {
+        // the kernel never saw the pages, the caller gets its payload back with the others
+        finished.push_back({0, std::move(txBuffer_), completion_});
+    }
+
+    reap_locked(finished);
+    lock.unlock();
+
+    // completions may send again, never run them under pending_mutex
+    complete(finished);
+}
+
+void ZeroCopySender::sendFile(int fd, off_t offset, size_t count)
+{
+    std::string function_id = getFunctionId(__func__, "ZeroCopySender");
+
+    std::lock_guard<std::mutex> lock(pending_mutex);
+
+    while(count > 0)
+    {
+        ssize_t sent = ::sendfile(socket.native_handle(), fd, &offset, count);
+        if(sent < 0)
+        {
+            if(errno == EINTR) continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                wait_for(POLLOUT);
+                continue;
+            }
+
+            LOG_ERROR_LIMITED(10) << function_id << " sendfile failed: " << std::strerror(errno);
+            return;
+        }
+        if(sent == 0)
+        {
+            LOG_WARNING << function_id << " sendfile reached end of file with " << count << " bytes left";
+            return;
+        }
+
+        count -= sent;
+    }
+}
+
+void ZeroCopySender::reap()
+{
+    std::deque<PendingSend> finished;
+    {
+        std::lock_guard<std::mutex> lock(pending_mutex);
+        reap_locked(finished);
+    }
+    complete(finished);
+}
+
+void ZeroCopySender::complete(std::deque<PendingSend>& finished)
+{
+    for(auto& done : finished)
+    {
+        if(done.completion)
+        {
+            done.completion(std::move(done.buffer));
+        }
+    }
+    finished.clear();
+}
+
+void ZeroCopySender::wait_for(short events)
+{
+    pollfd pfd = {socket.native_handle(), events, 0};
+    ::poll(&pfd, 1, 100);
+}
+
+void ZeroCopySender::reap_locked(std::deque<PendingSend>& finished)
+{
+    std::string function_id = getFunctionId(__func__, "ZeroCopySender");
+
+    while(!pending_sends.empty())
+    {
+        char control[128];
+        msghdr msg = {};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if(::recvmsg(socket.native_handle(), &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+        {
+            return; // EAGAIN, nothing completed yet
+        }
+
+        for(cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != nullptr; cm = CMSG_NXTHDR(&msg, cm))
+        {
+            if(!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                 (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+            {
+                continue;
+            }
+
+            sock_extended_err* serr = reinterpret_cast<sock_extended_err*>(CMSG_DATA(cm));
+            if(serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+            {
+                continue;
+            }
+
+            if((serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) && !copied_logged)
+            {
+                // e.g. loopback, the kernel fell back to copying - still correct, just not faster
+                LOG_DEBUG << function_id << " Kernel copied the zerocopy payload";
+                copied_logged = true;
+            }
+
+            // [ee_info, ee_data] is the range of completed ids, TCP completes them in order
+            uint32_t completed = serr->ee_data;
+            while(!pending_sends.empty() && (int32_t)(pending_sends.front().last_id - completed) <= 0)
+            {
+                finished.push_back(std::move(pending_sends.front()));
+                pending_sends.pop_front();
+            }
+        }
+    }
+}
+
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <functional>
+#include <sys/types.h>
+#include "types.hpp"
+
+namespace tcp
+{
+
+// Large payload sends that skip the user-space copy into tx_buffer.
+// Payloads go out with MSG_ZEROCOPY and stay owned here until the kernel reports
+// (on the socket error queue) that it no longer references their pages.
+class ZeroCopySender
+{
+public:
+using Completion = std::function<void(std::unique_ptr<Payload> txBuffer_)>;
+
+ZeroCopySender(Socket& socket_);
+~ZeroCopySender();
+
+// returns false if the kernel refused SO_ZEROCOPY (caller should use a plain send)
+bool enable();
+bool enabled() const;
+
+// completion_ gets txBuffer_ back once the kernel released its pages, or right away if none of it was sent
+void send(std::unique_ptr<Payload> txBuffer_, Completion completion_ = nullptr);
+void sendFile(int fd, off_t offset, size_t count);
+
+// releases every payload whose completion notification already arrived
+void reap();
+size_t pending() const;
+size_t pendingBytes() const;
+
+private:
+    struct PendingSend
+    {
+        uint32_t last_id;
+        std::unique_ptr<Payload> buffer;
+        Completion completion;
+    };
+
+    Socket& socket;
+    bool zerocopy_enabled;
+    bool copied_logged;
+    uint32_t next_id;
+
+    mutable std::mutex pending_mutex;
+    std::deque<PendingSend> pending_sends;
+
+    void wait_for(short events);
+    void reap_locked(std::deque<PendingSend>& finished);
+    static void complete(std::deque<PendingSend>& finished);
+};
+
+}